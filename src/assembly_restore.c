@@ -69,7 +69,11 @@ static GQueue* assemble_area() {
 				&& id == c->id) {
 			if (destor.simulation_level == SIMULATION_NO) {
 				struct chunk *buf = get_chunk_in_container(con, &c->fp);
-				assert(c->size == buf->size);
+				/* the recipe keeps the size before compression */
+				assembly_area.size += buf->size - c->size;
+				c->size = buf->size;
+				if (CHECK_CHUNK(buf, CHUNK_RAW))
+					SET_CHUNK(c, CHUNK_RAW);
 				c->data = malloc(c->size);
 				memcpy(c->data, buf->data, c->size);
 				free_chunk(buf);
@@ -118,8 +122,10 @@ static int assembly_area_push(struct chunk* c) {
 void* assembly_restore_thread(void *arg) {
 	init_assembly_area();
 
+	SyncQueueReader *input = sync_queue_reader_new(restore_recipe_queue,
+			SYNC_QUEUE_READER_BATCH);
 	struct chunk* c;
-	while ((c = sync_queue_pop(restore_recipe_queue))) {
+	while ((c = sync_queue_reader_pop(input))) {
 
 		TIMER_DECLARE(1);
 		TIMER_BEGIN(1);
@@ -184,5 +190,6 @@ void* assembly_restore_thread(void *arg) {
 	}
 
 	sync_queue_term(restore_chunk_queue);
+	sync_queue_reader_free(input);
 	return NULL;
 }
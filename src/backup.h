@@ -42,6 +42,12 @@ void stop_dedup_phase();
  */
 void start_rewrite_phase();
 void stop_rewrite_phase();
+/*
+ * Chunks that may be stored are compressed and marked CHUNK_COMPRESSED.
+ */
+void start_compress_phase();
+void stop_compress_phase();
+int32_t chunk_origin_size(struct chunk *c);
 /*
  * Determine which chunks are required to be written according to their flags.
  * All unique/rewritten chunks aggregate into containers.
@@ -70,5 +76,7 @@ SyncQueue* trace_queue;
 SyncQueue* dedup_queue;
 /* Output of rewrite phase. */
 SyncQueue* rewrite_queue;
+/* Output of compress phase. */
+SyncQueue* compress_queue;
 
 #endif /* BACKUP_H_ */
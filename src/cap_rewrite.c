@@ -43,9 +43,11 @@ static void cap_segment_get_top() {
  */
 void *cap_rewrite(void* arg) {
 	top = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, free);
+	SyncQueueReader *input = sync_queue_reader_new(dedup_queue,
+			SYNC_QUEUE_READER_BATCH);
 
 	while (1) {
-		struct chunk *c = sync_queue_pop(dedup_queue);
+		struct chunk *c = sync_queue_reader_pop(input);
 
 		if (c == NULL)
 			break;
@@ -102,6 +104,7 @@ void *cap_rewrite(void* arg) {
 	g_hash_table_remove_all(top);
 
 	sync_queue_term(rewrite_queue);
+	sync_queue_reader_free(input);
 
 	return NULL;
 }
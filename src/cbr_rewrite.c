@@ -74,10 +74,12 @@ static void utility_buckets_update(double rewrite_utility) {
 void *cbr_rewrite(void* arg) {
 
 	init_utility_buckets();
+	SyncQueueReader *input = sync_queue_reader_new(dedup_queue,
+			SYNC_QUEUE_READER_BATCH);
 
 	/* content-based rewrite*/
 	while (1) {
-		struct chunk *c = sync_queue_pop(dedup_queue);
+		struct chunk *c = sync_queue_reader_pop(input);
 		if (c == NULL)
 			break;
 
@@ -145,6 +147,7 @@ void *cbr_rewrite(void* arg) {
 	while ((remaining_chunk = rewrite_buffer_pop()))
 		sync_queue_push(rewrite_queue, remaining_chunk);
 	sync_queue_term(rewrite_queue);
+	sync_queue_reader_free(input);
 
 	return NULL;
 }
@@ -17,6 +17,8 @@ static int64_t chunk_num;
  */
 /* ----------------------------------------------------------------------------*/
 void *cfl_rewrite(void* arg) {
+	SyncQueueReader *input = sync_queue_reader_new(dedup_queue,
+			SYNC_QUEUE_READER_BATCH);
 	/*
 	 * A chunk with an ID that is different from the chunks in buffer,
 	 * or a NULL pointer,
@@ -25,7 +27,7 @@ void *cfl_rewrite(void* arg) {
 	containerid last_id = TEMPORARY_ID;
 	int buffer_full = 0;
 	while (1) {
-		struct chunk* c = sync_queue_pop(dedup_queue);
+		struct chunk* c = sync_queue_reader_pop(input);
 		if (c == NULL) {
 			/* The end */
 			break;
@@ -89,5 +91,6 @@ void *cfl_rewrite(void* arg) {
 	buffer_full = 0;
 
 	sync_queue_term(rewrite_queue);
+	sync_queue_reader_free(input);
 	return NULL;
 }
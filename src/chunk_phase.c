@@ -3,17 +3,57 @@
 #include "chunking/chunking.h"
 #include "backup.h"
 #include "storage/containerstore.h"
-#include <zstd.h>
 
 static pthread_t chunk_t;
 static int64_t chunk_num;
 
 static int (*chunking)(unsigned char* buf, int size);
 
+static unsigned char *zeros;
+
 static inline int fixed_chunk_data(unsigned char* buf, int size){
 	return destor.chunk_avg_size > size ? size : destor.chunk_avg_size;
 }
 
+/* chunks sent to the hash phase together */
+#define OUTPUT_BATCH 32
+static struct chunk *output[OUTPUT_BATCH];
+static int output_num;
+
+/*
+ * Buffer a chunk for chunk_queue,
+ * a file is sent when it ends so that no chunk waits for the next file.
+ */
+static void output_chunk(struct chunk *c) {
+	output[output_num++] = c;
+	if (output_num == OUTPUT_BATCH || CHECK_CHUNK(c, CHUNK_FILE_END)) {
+		sync_queue_push_n(chunk_queue, (void **) output, output_num);
+		output_num = 0;
+	}
+}
+
+/*
+ * Send a chunk of size bytes at p to the hash phase.
+ * It is compressed after deduplication, in the compress phase.
+ */
+static void emit_chunk(unsigned char *p, int size) {
+	jcr.origin_data_size += size;
+	int chunk_size = size;
+	struct chunk *nc = new_chunk(chunk_size);
+	memcpy(nc->data, p, chunk_size);
+
+	if (memcmp(zeros, nc->data, chunk_size) == 0) {
+		VERBOSE("Chunk phase: %ldth chunk  of %d zero bytes",
+				chunk_num++, chunk_size);
+		jcr.zero_chunk_num++;
+		jcr.zero_chunk_size += chunk_size;
+	} else
+		VERBOSE("Chunk phase: %ldth chunk of %d bytes", chunk_num++,
+				chunk_size);
+
+	output_chunk(nc);
+}
+
 /*
  * chunk-level deduplication.
  * Destor currently supports fixed-sized chunking and (normalized) rabin-based chunking.
@@ -23,11 +63,6 @@ static void* chunk_thread(void *arg) {
 	int leftoff = 0;
 	unsigned char *leftbuf = malloc(DEFAULT_BLOCK_SIZE + destor.chunk_max_size);
 
-	unsigned char *zeros = malloc(destor.chunk_max_size);
-	bzero(zeros, destor.chunk_max_size);
-	unsigned char *data = malloc(destor.chunk_max_size);
-	unsigned char *compress_buf = malloc(destor.chunk_max_size);
-
 	struct chunk* c = NULL;
 
 	while (1) {
@@ -41,7 +76,7 @@ static void* chunk_thread(void *arg) {
 		}
 
 		assert(CHECK_CHUNK(c, CHUNK_FILE_START));
-		sync_queue_push(chunk_queue, c);
+		output_chunk(c);
 
 		/* Try to receive normal chunks. */
 		c = sync_queue_pop(read_queue);
@@ -78,32 +113,12 @@ static void* chunk_thread(void *arg) {
 
 			TIMER_END(1, jcr.chunk_time);
 
-			// compress the chunk
-			jcr.origin_data_size += chunk_size;
-			size_t compressed_size = ZSTD_compress(compress_buf, destor.chunk_max_size, leftbuf + leftoff, chunk_size, ZSTD_CLEVEL_DEFAULT);
+			emit_chunk(leftbuf + leftoff, chunk_size);
 			leftlen -= chunk_size;
 			leftoff += chunk_size;
-			chunk_size = compressed_size;
-			if (ZSTD_isError(compressed_size)) {
-				WARNING("ZSTD compression error: %s", ZSTD_getErrorName(compressed_size));
-				exit(1);
-			}
-			struct chunk *nc = new_chunk(chunk_size);
-			memcpy(nc->data, compress_buf, chunk_size);
-
-			if (memcmp(zeros, nc->data, chunk_size) == 0) {
-				VERBOSE("Chunk phase: %ldth chunk  of %d zero bytes",
-						chunk_num++, chunk_size);
-				jcr.zero_chunk_num++;
-				jcr.zero_chunk_size += chunk_size;
-			} else
-				VERBOSE("Chunk phase: %ldth chunk of %d bytes", chunk_num++,
-						chunk_size);
-
-			sync_queue_push(chunk_queue, nc);
 		}
 
-		sync_queue_push(chunk_queue, c);
+		output_chunk(c);
 		leftoff = 0;
 		c = NULL;
 
@@ -114,13 +129,216 @@ static void* chunk_thread(void *arg) {
 	}
 
 	free(leftbuf);
-	free(zeros);
-	free(data);
-	free(compress_buf);
 	return NULL;
 }
 
+/*
+ * Parallel chunking.
+ * The buffered data of a file is cut into segments,
+ * and each worker chunks its segment starting from a guessed boundary,
+ * the start of the segment.
+ * A chunk depends only on the data from its start,
+ * so once the true chunk sequence reaches a boundary found by the worker,
+ * the rest of the worker's boundaries are also true.
+ * The merge walks the true sequence from the previous segment
+ * and chunks by itself until it meets the worker's boundaries,
+ * so the chunks are identical to those of chunk_thread.
+ */
+#define CHUNK_SEGMENT_SIZE (2 * DEFAULT_BLOCK_SIZE)
+
+/* The chunks of a worker starting at begin, the last one starts before end. */
+struct chunkSegment {
+	int64_t begin;
+	int64_t end;
+	/* cuts[i] is the end of the ith chunk */
+	int64_t *cuts;
+	int num;
+	int max_num;
+};
+
+/* The buffered data of the current file. */
+static struct {
+	unsigned char *buf;
+	int64_t len;
+	/* the end offsets of the blocks from the read phase */
+	int64_t *block_ends;
+	int block_num;
+	int block_max_num;
+	/* the whole file is buffered */
+	int eof;
+} window;
+
+static pthread_t *chunk_workers;
+static SyncQueue *segment_queue;
+static SyncQueue *segment_done_queue;
+
+/*
+ * The size chunk_thread would pass to chunking at pos:
+ * it reads blocks until at least chunk_max_size bytes are buffered,
+ * or the file ends.
+ * Return -1 if that block has not arrived yet.
+ */
+static int64_t window_avail(int64_t pos) {
+	int lo = 0, hi = window.block_num;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (window.block_ends[mid] - pos >= destor.chunk_max_size)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	if (lo < window.block_num)
+		return window.block_ends[lo] - pos;
+	return window.eof ? window.len - pos : -1;
+}
+
+static void window_append(struct chunk *c) {
+	memcpy(window.buf + window.len, c->data, c->size);
+	window.len += c->size;
+	if (window.block_num == window.block_max_num) {
+		window.block_max_num *= 2;
+		window.block_ends = realloc(window.block_ends,
+				sizeof(int64_t) * window.block_max_num);
+	}
+	window.block_ends[window.block_num++] = window.len;
+}
+
+static void chunk_segment(struct chunkSegment *seg) {
+	seg->num = 0;
+	int64_t pos = seg->begin;
+	while (pos < seg->end) {
+		int64_t n = window_avail(pos);
+		assert(n > 0);
+		pos += chunking(window.buf + pos, n);
+		if (seg->num == seg->max_num) {
+			seg->max_num *= 2;
+			seg->cuts = realloc(seg->cuts, sizeof(int64_t) * seg->max_num);
+		}
+		seg->cuts[seg->num++] = pos;
+	}
+}
+
+static void* chunk_worker(void *arg) {
+	struct chunkSegment *seg;
+	while ((seg = sync_queue_pop(segment_queue))) {
+		chunk_segment(seg);
+		sync_queue_push(segment_done_queue, seg);
+	}
+	return NULL;
+}
+
+/*
+ * Chunk and send the chunks starting before limit.
+ * Return the end of the last chunk.
+ */
+static int64_t chunk_window(struct chunkSegment *segs, int64_t limit) {
+	int nseg = limit / CHUNK_SEGMENT_SIZE;
+	if (nseg > destor.chunk_threads)
+		nseg = destor.chunk_threads;
+
+	int i;
+	if (nseg <= 1) {
+		/* too small to be split, chunk it here */
+		nseg = 1;
+		segs[0].begin = 0;
+		segs[0].end = limit;
+		chunk_segment(&segs[0]);
+	} else {
+		for (i = 0; i < nseg; i++) {
+			segs[i].begin = limit * i / nseg;
+			segs[i].end = limit * (i + 1) / nseg;
+			sync_queue_push(segment_queue, &segs[i]);
+		}
+		for (i = 0; i < nseg; i++)
+			sync_queue_pop(segment_done_queue);
+	}
+
+	int64_t pos = 0;
+	for (i = 0; i < nseg; i++) {
+		struct chunkSegment *seg = &segs[i];
+		int k = 0;
+		while (pos < seg->end) {
+			/* skip the worker's boundaries behind pos */
+			while (k < seg->num && (k == 0 ? seg->begin : seg->cuts[k - 1]) < pos)
+				k++;
+			int64_t next;
+			if (k < seg->num && (k == 0 ? seg->begin : seg->cuts[k - 1]) == pos)
+				next = seg->cuts[k++];
+			else
+				next = pos + chunking(window.buf + pos, window_avail(pos));
+			emit_chunk(window.buf + pos, next - pos);
+			pos = next;
+		}
+	}
+	return pos;
+}
+
+static void* parallel_chunk_thread(void *arg) {
+	int64_t batch = (int64_t) CHUNK_SEGMENT_SIZE * destor.chunk_threads;
+	window.buf = malloc(batch + DEFAULT_BLOCK_SIZE + destor.chunk_max_size);
+	window.block_max_num = 64;
+	window.block_ends = malloc(sizeof(int64_t) * window.block_max_num);
+
+	struct chunkSegment *segs = calloc(destor.chunk_threads,
+			sizeof(struct chunkSegment));
+	int i;
+	for (i = 0; i < destor.chunk_threads; i++) {
+		segs[i].max_num = 1024;
+		segs[i].cuts = malloc(sizeof(int64_t) * segs[i].max_num);
+	}
+
+	struct chunk* c = NULL;
+	while ((c = sync_queue_pop(read_queue))) {
+		assert(CHECK_CHUNK(c, CHUNK_FILE_START));
+		output_chunk(c);
+
+		window.len = 0;
+		window.block_num = 0;
+		window.eof = 0;
+		while (!window.eof) {
+			/* buffer a batch */
+			while (window.len < batch + destor.chunk_max_size) {
+				c = sync_queue_pop(read_queue);
+				if (CHECK_CHUNK(c, CHUNK_FILE_END)) {
+					window.eof = 1;
+					break;
+				}
+				window_append(c);
+				free_chunk(c);
+			}
+
+			/* the chunks that can be found with the buffered blocks */
+			int64_t limit = window.len;
+			if (!window.eof && window.block_num > 0)
+				limit = window.block_ends[window.block_num - 1]
+						- destor.chunk_max_size + 1;
+
+			TIMER_DECLARE(1);
+			TIMER_BEGIN(1);
+			int64_t pos = chunk_window(segs, limit);
+			TIMER_END(1, jcr.chunk_time);
 
+			/* keep the rest for the next batch */
+			memmove(window.buf, window.buf + pos, window.len - pos);
+			window.len -= pos;
+			int j = 0;
+			for (i = 0; i < window.block_num; i++)
+				if (window.block_ends[i] > pos)
+					window.block_ends[j++] = window.block_ends[i] - pos;
+			window.block_num = j;
+		}
+		assert(window.len == 0);
+		output_chunk(c);
+	}
+	sync_queue_term(chunk_queue);
+
+	for (i = 0; i < destor.chunk_threads; i++)
+		free(segs[i].cuts);
+	free(segs);
+	free(window.buf);
+	free(window.block_ends);
+	return NULL;
+}
 
 void start_chunk_phase() {
 
@@ -185,16 +403,49 @@ void start_chunk_phase() {
 
 		chunking = ae_chunk_data;
 		ae_init();
+	}else if(destor.chunk_algorithm == CHUNK_FASTCDC){
+		assert(destor.chunk_avg_size >= destor.chunk_min_size);
+		assert(destor.chunk_avg_size <= destor.chunk_max_size);
+		assert(destor.chunk_max_size <= CONTAINER_SIZE - CONTAINER_META_SIZE);
+
+		chunking = fastcdc_chunk_data;
+		fastcdc_init();
 	}else{
 		NOTICE("Invalid chunking algorithm");
 		exit(1);
 	}
 
+	zeros = calloc(1, destor.chunk_max_size);
+
 	chunk_queue = sync_queue_new(100);
-	pthread_create(&chunk_t, NULL, chunk_thread, NULL);
+
+	/* fixed-sized chunking is cheap and does not resynchronize */
+	if (destor.chunk_threads > 1 && chunking != fixed_chunk_data) {
+		NOTICE("chunk phase: %d threads", destor.chunk_threads);
+		segment_queue = sync_queue_new(destor.chunk_threads);
+		segment_done_queue = sync_queue_new(destor.chunk_threads);
+		chunk_workers = malloc(sizeof(pthread_t) * destor.chunk_threads);
+		int i;
+		for (i = 0; i < destor.chunk_threads; i++)
+			pthread_create(&chunk_workers[i], NULL, chunk_worker, NULL);
+		pthread_create(&chunk_t, NULL, parallel_chunk_thread, NULL);
+	} else {
+		pthread_create(&chunk_t, NULL, chunk_thread, NULL);
+	}
 }
 
 void stop_chunk_phase() {
 	pthread_join(chunk_t, NULL);
+	if (chunk_workers) {
+		sync_queue_term(segment_queue);
+		int i;
+		for (i = 0; i < destor.chunk_threads; i++)
+			pthread_join(chunk_workers[i], NULL);
+		free(chunk_workers);
+		chunk_workers = NULL;
+		sync_queue_free(segment_queue, NULL);
+		sync_queue_free(segment_done_queue, NULL);
+	}
+	free(zeros);
 	NOTICE("chunk phase stops successfully!");
 }
@@ -15,4 +15,7 @@ int ae_chunk_data(unsigned char *p, int n);
 
 int tttd_chunk_data(unsigned char *p, int n);
 
+void fastcdc_init();
+int fastcdc_chunk_data(unsigned char *p, int n);
+
 #endif
@@ -0,0 +1,128 @@
+/*
+ * FastCDC: gear-based rolling hash, normalized chunking and cut-point skipping.
+ * See the ATC'16 paper of Wen Xia et al. for more details.
+ *
+ * The gear hash is (h << 1) + gear[byte], so a byte leaves the hash after
+ * 64 bytes and the hash at any position can be rebuilt from the 63 bytes
+ * before it. The boundary scan uses that to test several stripes of the
+ * buffer at once: the stripes are independent dependency chains the CPU
+ * runs in parallel, and the first stripe with a cut point wins.
+ */
+
+#include "../destor.h"
+
+/* bytes per stripe, and the scan runs 4 stripes at once */
+#define STRIPE 256
+#define WINDOW 64
+
+static uint64_t gear[256];
+static uint64_t mask_s, mask_l;
+
+/* bits ones spread over bit 47 to bit 16, as the masks of FastCDC */
+static uint64_t spread_mask(int bits) {
+	uint64_t mask = 0;
+	int k;
+	for (k = 0; k < bits; k++)
+		mask |= 1ULL << (47 - k * 32 / bits);
+	return mask;
+}
+
+void fastcdc_init() {
+	/* splitmix64 with a fixed seed, so the chunks are stable across runs */
+	uint64_t s = 0x2f0f3c1dULL;
+	int i;
+	for (i = 0; i < 256; i++) {
+		uint64_t z = (s += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+
+	int bits = 0;
+	while ((2 << bits) <= destor.chunk_avg_size)
+		bits++;
+	/* normalization level 2 */
+	mask_s = spread_mask(bits + 2);
+	mask_l = spread_mask(bits - 2);
+}
+
+/*
+ * The hash of the bytes before i,
+ * which the scan started at start.
+ */
+static inline uint64_t warm_up(unsigned char *p, int start, int i) {
+	uint64_t h = 0;
+	int j = i - WINDOW + 1 > start ? i - WINDOW + 1 : start;
+	for (; j < i; j++)
+		h = (h << 1) + gear[p[j]];
+	return h;
+}
+
+/*
+ * Find the first cut point in [from, to) of a hash started at start.
+ * Return the chunk size, or 0 if there is no cut point.
+ */
+static int scan(unsigned char *p, int start, int from, int to, uint64_t mask) {
+	int i = from;
+	uint64_t h = warm_up(p, start, i);
+	for (; to - i >= 4 * STRIPE; i += 4 * STRIPE) {
+		unsigned char *p0 = p + i, *p1 = p0 + STRIPE,
+				*p2 = p1 + STRIPE, *p3 = p2 + STRIPE;
+		/* the first stripe continues the last one of the previous round */
+		uint64_t h0 = h;
+		uint64_t h1 = warm_up(p, start, i + STRIPE);
+		uint64_t h2 = warm_up(p, start, i + 2 * STRIPE);
+		uint64_t h3 = warm_up(p, start, i + 3 * STRIPE);
+		int cut1 = 0, cut2 = 0, cut3 = 0;
+		int k;
+		for (k = 0; k < STRIPE; k++) {
+			h0 = (h0 << 1) + gear[p0[k]];
+			h1 = (h1 << 1) + gear[p1[k]];
+			h2 = (h2 << 1) + gear[p2[k]];
+			h3 = (h3 << 1) + gear[p3[k]];
+			if (__builtin_expect(!(h0 & mask) || !(h1 & mask) || !(h2 & mask)
+					|| !(h3 & mask), 0)) {
+				if (!(h0 & mask))
+					return i + k + 1;
+				if (!(h1 & mask) && !cut1)
+					cut1 = i + STRIPE + k + 1;
+				if (!(h2 & mask) && !cut2)
+					cut2 = i + 2 * STRIPE + k + 1;
+				if (!(h3 & mask) && !cut3)
+					cut3 = i + 3 * STRIPE + k + 1;
+			}
+		}
+		if (cut1)
+			return cut1;
+		if (cut2)
+			return cut2;
+		if (cut3)
+			return cut3;
+		h = h3;
+	}
+
+	for (; i < to; i++) {
+		h = (h << 1) + gear[p[i]];
+		if (!(h & mask))
+			return i + 1;
+	}
+	return 0;
+}
+
+/*
+ * Skip chunk_min_size bytes,
+ * use the harder mask before chunk_avg_size and the easier one after.
+ */
+int fastcdc_chunk_data(unsigned char *p, int n) {
+	if (n <= destor.chunk_min_size)
+		return n;
+
+	int end = n > destor.chunk_max_size ? destor.chunk_max_size : n;
+	int normal = destor.chunk_avg_size < end ? destor.chunk_avg_size : end;
+	int start = destor.chunk_min_size;
+
+	int size = scan(p, start, start, normal, mask_s);
+	if (size == 0)
+		size = scan(p, start, normal, end, mask_l);
+	return size == 0 ? end : size;
+}
@@ -0,0 +1,282 @@
+/*
+ * compress_phase.c
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Boju Chen
+ *
+ * Compress the chunks that may be written to containers.
+ * It runs after the rewrite phase, so duplicate chunks are never compressed,
+ * and the fingerprints are taken over the raw data.
+ * The chunks of a segment are compressed by a pool of workers,
+ * each reusing its own ZSTD context,
+ * while the filter phase is storing the previous segment.
+ * Chunks that look incompressible, or do not shrink, are stored raw
+ * and marked CHUNK_RAW.
+ * With compress-dictionary-size, a dictionary is trained on each segment
+ * and sent to the filter phase in the segment head, which stores it in
+ * every container holding chunks compressed with it.
+ */
+
+#include "destor.h"
+#include "jcr.h"
+#include "backup.h"
+#include <zstd.h>
+#include <zdict.h>
+#include <math.h>
+
+/* the entropy is estimated on SAMPLE_SLICES slices of SAMPLE_SLICE bytes */
+#define SAMPLE_SLICES 16
+#define SAMPLE_SLICE 256
+
+/* the dictionary is trained on up to 100 times its size */
+#define DICT_SAMPLES_RATIO 100
+
+static pthread_t compress_t;
+static pthread_t *compress_workers;
+static SyncQueue *task_queue;
+static SyncQueue *done_queue;
+
+/* A slice of the chunks of a segment */
+struct compressTask {
+	struct chunk **cks;
+	int n;
+	ZSTD_CDict *cdict;
+};
+
+/*
+ * A chunk is written if it is unique, or fragmented and not denied.
+ * The filter phase may still deny some of them.
+ */
+static int may_be_stored(struct chunk *c) {
+	if (IS_SIGNAL_CHUNK(c) || c->data == NULL)
+		return 0;
+	if (!CHECK_CHUNK(c, CHUNK_DUPLICATE))
+		return 1;
+	return !CHECK_CHUNK(c, CHUNK_REWRITE_DENIED)
+			&& (CHECK_CHUNK(c, CHUNK_SPARSE)
+					|| CHECK_CHUNK(c, CHUNK_OUT_OF_ORDER));
+}
+
+/*
+ * Shannon entropy, in bits per byte, of slices spread over the chunk.
+ * Compressed media, archives and encrypted data are close to 8.
+ */
+static double sample_entropy(unsigned char *p, int size) {
+	uint32_t count[256] = { 0 };
+	int n = 0;
+	if (size <= SAMPLE_SLICES * SAMPLE_SLICE) {
+		for (; n < size; n++)
+			count[p[n]]++;
+	} else {
+		int i, k;
+		int64_t stride = (size - SAMPLE_SLICE) / (SAMPLE_SLICES - 1);
+		for (i = 0; i < SAMPLE_SLICES; i++) {
+			unsigned char *s = p + i * stride;
+			for (k = 0; k < SAMPLE_SLICE; k++)
+				count[s[k]]++;
+		}
+		n = SAMPLE_SLICES * SAMPLE_SLICE;
+	}
+	if (n == 0)
+		return 0;
+
+	double e = 0;
+	int i;
+	for (i = 0; i < 256; i++)
+		if (count[i]) {
+			double f = (double) count[i] / n;
+			e -= f * log2(f);
+		}
+	return e;
+}
+
+static void* compress_worker(void *arg) {
+	ZSTD_CCtx *cctx = ZSTD_createCCtx();
+	size_t bound = ZSTD_compressBound(destor.chunk_max_size);
+	unsigned char *buf = malloc(bound);
+
+	struct compressTask *t;
+	while ((t = sync_queue_pop(task_queue))) {
+		int i;
+		for (i = 0; i < t->n; i++) {
+			struct chunk *c = t->cks[i];
+			if (sample_entropy(c->data, c->size) > destor.compress_entropy_threshold) {
+				SET_CHUNK(c, CHUNK_RAW);
+				continue;
+			}
+			size_t size = t->cdict ?
+					ZSTD_compress_usingCDict(cctx, buf, bound, c->data,
+							c->size, t->cdict) :
+					ZSTD_compressCCtx(cctx, buf, bound, c->data, c->size,
+							destor.compress_level);
+			if (ZSTD_isError(size)) {
+				WARNING("ZSTD compression error: %s", ZSTD_getErrorName(size));
+				exit(1);
+			}
+			if (size >= c->size) {
+				SET_CHUNK(c, CHUNK_RAW);
+				continue;
+			}
+			c->data = realloc(c->data, size);
+			memcpy(c->data, buf, size);
+			c->size = size;
+			SET_CHUNK(c, CHUNK_COMPRESSED);
+		}
+		sync_queue_push(done_queue, t);
+	}
+
+	free(buf);
+	ZSTD_freeCCtx(cctx);
+	return NULL;
+}
+
+/*
+ * Split the chunks to be compressed among the workers and wait for them.
+ */
+static void compress_segment(struct chunk **cks, int n,
+		struct compressTask *tasks, ZSTD_CDict *cdict) {
+	int i, num = 0;
+	for (i = 0; i < destor.compress_threads; i++) {
+		tasks[i].cdict = cdict;
+		tasks[i].cks = cks + (int64_t) n * i / destor.compress_threads;
+		tasks[i].n = (int64_t) n * (i + 1) / destor.compress_threads
+				- (int64_t) n * i / destor.compress_threads;
+		if (tasks[i].n > 0) {
+			sync_queue_push(task_queue, &tasks[i]);
+			num++;
+		}
+	}
+	for (i = 0; i < num; i++)
+		sync_queue_pop(done_queue);
+}
+
+/*
+ * Train a dictionary on the chunks to be compressed.
+ * Return its size, or 0 if ZDICT fails, as with too few samples.
+ */
+static size_t train_dict(struct chunk **cks, int n, unsigned char *dict) {
+	int64_t limit = (int64_t) destor.compress_dict_size * DICT_SAMPLES_RATIO;
+	unsigned char *samples = malloc(limit);
+	size_t *sizes = malloc(sizeof(size_t) * n);
+	int64_t total = 0;
+	int i, num = 0;
+	for (i = 0; i < n && total + cks[i]->size <= limit; i++) {
+		memcpy(samples + total, cks[i]->data, cks[i]->size);
+		total += cks[i]->size;
+		sizes[num++] = cks[i]->size;
+	}
+
+	size_t size = ZDICT_trainFromBuffer(dict, destor.compress_dict_size,
+			samples, sizes, num);
+	free(samples);
+	free(sizes);
+	if (ZDICT_isError(size)) {
+		VERBOSE("Compress phase: no dictionary, %s", ZDICT_getErrorName(size));
+		return 0;
+	}
+	return size;
+}
+
+static void* compress_thread(void *arg) {
+	struct compressTask *tasks = malloc(
+			sizeof(struct compressTask) * destor.compress_threads);
+	/* the chunks of the current segment */
+	int max_num = 1024;
+	struct chunk **segment = malloc(sizeof(struct chunk*) * max_num);
+	struct chunk **todo = malloc(sizeof(struct chunk*) * max_num);
+	unsigned char *dict = destor.compress_dict_size > 0 ?
+			malloc(destor.compress_dict_size) : NULL;
+
+	SyncQueueReader *input = sync_queue_reader_new(rewrite_queue,
+			SYNC_QUEUE_READER_BATCH);
+	struct chunk *c;
+	while ((c = sync_queue_reader_pop(input))) {
+		assert(CHECK_CHUNK(c, CHUNK_SEGMENT_START));
+		int num = 0, n = 0;
+		segment[num++] = c;
+		do {
+			c = sync_queue_reader_pop(input);
+			if (num == max_num) {
+				max_num *= 2;
+				segment = realloc(segment, sizeof(struct chunk*) * max_num);
+				todo = realloc(todo, sizeof(struct chunk*) * max_num);
+			}
+			segment[num++] = c;
+			if (may_be_stored(c))
+				todo[n++] = c;
+		} while (!CHECK_CHUNK(c, CHUNK_SEGMENT_END));
+
+		if (destor.simulation_level < SIMULATION_APPEND) {
+			TIMER_DECLARE(1);
+			TIMER_BEGIN(1);
+			ZSTD_CDict *cdict = NULL;
+			size_t dict_size = dict ? train_dict(todo, n, dict) : 0;
+			if (dict_size > 0) {
+				cdict = ZSTD_createCDict(dict, dict_size, destor.compress_level);
+				/* the segment head carries the dictionary to the filter phase */
+				segment[0]->data = malloc(dict_size);
+				memcpy(segment[0]->data, dict, dict_size);
+				segment[0]->size = dict_size;
+			}
+			compress_segment(todo, n, tasks, cdict);
+			if (cdict)
+				ZSTD_freeCDict(cdict);
+			TIMER_END(1, jcr.compress_time);
+
+			int i;
+			for (i = 0; i < n; i++)
+				if (CHECK_CHUNK(todo[i], CHUNK_RAW)) {
+					jcr.raw_chunk_num++;
+					jcr.raw_chunk_size += todo[i]->size;
+				}
+		}
+
+		sync_queue_push_n(compress_queue, (void **) segment, num);
+	}
+	sync_queue_term(compress_queue);
+	sync_queue_reader_free(input);
+
+	free(segment);
+	free(todo);
+	free(tasks);
+	free(dict);
+	return NULL;
+}
+
+/*
+ * The size of the data before compression.
+ */
+int32_t chunk_origin_size(struct chunk *c) {
+	if (!CHECK_CHUNK(c, CHUNK_COMPRESSED))
+		return c->size;
+	unsigned long long size = ZSTD_getFrameContentSize(c->data, c->size);
+	assert(size != ZSTD_CONTENTSIZE_UNKNOWN && size != ZSTD_CONTENTSIZE_ERROR);
+	return size;
+}
+
+void start_compress_phase() {
+	compress_queue = sync_queue_new(1000);
+
+	task_queue = sync_queue_new(destor.compress_threads);
+	done_queue = sync_queue_new(destor.compress_threads);
+	compress_workers = malloc(sizeof(pthread_t) * destor.compress_threads);
+	int i;
+	for (i = 0; i < destor.compress_threads; i++)
+		pthread_create(&compress_workers[i], NULL, compress_worker, NULL);
+
+	pthread_create(&compress_t, NULL, compress_thread, NULL);
+}
+
+void stop_compress_phase() {
+	pthread_join(compress_t, NULL);
+
+	sync_queue_term(task_queue);
+	int i;
+	for (i = 0; i < destor.compress_threads; i++)
+		pthread_join(compress_workers[i], NULL);
+	free(compress_workers);
+	sync_queue_free(task_queue, NULL);
+	sync_queue_free(done_queue, NULL);
+
+	NOTICE("compress phase stops successfully!");
+}
@@ -66,6 +66,35 @@ void load_config_from_string(sds config, const char *sep) {
 			destor.direct_reads = atoi(argv[1]);
 		} else if (strcasecmp(argv[0], "upgrade-phase") == 0 && argc == 2) {
 			destor.upgrade_phase = atoi(argv[1]);
+		} else if (strcasecmp(argv[0], "upgrade-hash-threads") == 0 && argc == 2) {
+			destor.upgrade_hash_threads = atoi(argv[1]);
+		} else if (strcasecmp(argv[0], "upgrade-read-depth") == 0 && argc == 2) {
+			destor.upgrade_read_depth = atoi(argv[1]);
+		} else if (strcasecmp(argv[0], "upgrade-external-prefetch") == 0 && argc == 2) {
+			destor.upgrade_external_prefetch = atoi(argv[1]);
+		} else if (strcasecmp(argv[0], "upgrade-prefetch-depth") == 0 && argc == 2) {
+			destor.upgrade_prefetch_depth = atoi(argv[1]);
+		} else if (strcasecmp(argv[0], "upgrade-cache") == 0 && argc == 2) {
+			if (strcasecmp(argv[1], "lru") == 0)
+				destor.upgrade_cache_policy = UPGRADE_CACHE_LRU;
+			else if (strcasecmp(argv[1], "opt") == 0)
+				destor.upgrade_cache_policy = UPGRADE_CACHE_OPT;
+			else {
+				err = "Invalid upgrade cache";
+				goto loaderr;
+			}
+		} else if (strcasecmp(argv[0], "upgrade-opt-window-size") == 0 && argc == 2) {
+			destor.upgrade_opt_window_size = atoi(argv[1]);
+		} else if (strcasecmp(argv[0], "upgrade-dedup-threads") == 0 && argc == 2) {
+			destor.upgrade_dedup_threads = atoi(argv[1]);
+		} else if (strcasecmp(argv[0], "upgrade-preprocess-threads") == 0 && argc == 2) {
+			destor.upgrade_preprocess_threads = atoi(argv[1]);
+		} else if (strcasecmp(argv[0], "recipe-format") == 0 && argc == 2) {
+			destor.recipe_format = atoi(argv[1]);
+			if (destor.recipe_format != 1 && destor.recipe_format != 2) {
+				err = "Invalid recipe format";
+				goto loaderr;
+			}
 		} else if (strcasecmp(argv[0], "trace-format") == 0 && argc == 2) {
             if (strcasecmp(argv[1], "destor") == 0) {
 				destor.trace_format = TRACE_DESTOR;
@@ -101,6 +130,8 @@ void load_config_from_string(sds config, const char *sep) {
 				destor.chunk_algorithm = CHUNK_FILE;
 			} else if (strcasecmp(argv[1], "ae") == 0) {
 				destor.chunk_algorithm = CHUNK_AE;
+			} else if (strcasecmp(argv[1], "fastcdc") == 0) {
+				destor.chunk_algorithm = CHUNK_FASTCDC;
 			} else {
 				err = "Invalid chunk algorithm";
 				goto loaderr;
@@ -111,6 +142,34 @@ void load_config_from_string(sds config, const char *sep) {
 			destor.chunk_max_size = atoi(argv[1]);
 		} else if (strcasecmp(argv[0], "chunk-min-size") == 0 && argc == 2) {
 			destor.chunk_min_size = atoi(argv[1]);
+		} else if (strcasecmp(argv[0], "compress-level") == 0 && argc == 2) {
+			destor.compress_level = atoi(argv[1]);
+		} else if (strcasecmp(argv[0], "compress-threads") == 0 && argc == 2) {
+			destor.compress_threads = atoi(argv[1]);
+			if (destor.compress_threads < 1) {
+				err = "Invalid compress threads";
+				goto loaderr;
+			}
+		} else if (strcasecmp(argv[0], "compress-entropy-threshold") == 0 && argc == 2) {
+			destor.compress_entropy_threshold = atof(argv[1]);
+		} else if (strcasecmp(argv[0], "compress-dictionary-size") == 0 && argc == 2) {
+			destor.compress_dict_size = atoi(argv[1]);
+			if (destor.compress_dict_size < 0 || destor.compress_dict_size > 1048576) {
+				err = "Invalid compress dictionary size";
+				goto loaderr;
+			}
+		} else if (strcasecmp(argv[0], "hash-threads") == 0 && argc == 2) {
+			destor.hash_threads = atoi(argv[1]);
+			if (destor.hash_threads < 1) {
+				err = "Invalid hash threads";
+				goto loaderr;
+			}
+		} else if (strcasecmp(argv[0], "chunk-threads") == 0 && argc == 2) {
+			destor.chunk_threads = atoi(argv[1]);
+			if (destor.chunk_threads < 1) {
+				err = "Invalid chunk threads";
+				goto loaderr;
+			}
 		} else if (strcasecmp(argv[0], "fingerprint-index") == 0 && argc >= 3) {
 			if (strcasecmp(argv[1], "exact") == 0) {
 				destor.index_category[0] = INDEX_CATEGORY_EXACT;
@@ -343,6 +402,20 @@ void load_config_from_string(sds config, const char *sep) {
 			}
 
 			destor.restore_cache[1] = atoi(argv[2]);
+		} else if (strcasecmp(argv[0], "cache-policy") == 0 && argc == 2) {
+			if (strcasecmp(argv[1], "lru") == 0)
+				destor.cache_policy = CACHE_POLICY_LRU;
+			else if (strcasecmp(argv[1], "clock") == 0)
+				destor.cache_policy = CACHE_POLICY_CLOCK;
+			else if (strcasecmp(argv[1], "2q") == 0)
+				destor.cache_policy = CACHE_POLICY_2Q;
+			else {
+				err = "Invalid cache policy";
+				goto loaderr;
+			}
+		} else if (strcasecmp(argv[0], "restore-cache-bytes") == 0
+				&& argc == 2) {
+			destor.restore_cache_bytes = atoll(argv[1]);
 		} else if (strcasecmp(argv[0], "restore-opt-window-size") == 0
 				&& argc == 2) {
 			destor.restore_opt_window_size = atoi(argv[1]);
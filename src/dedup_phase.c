@@ -30,9 +30,13 @@ void send_segment(struct segment* s) {
 	 * CHUNK_SEGMENT_START and _END are used for
 	 * reconstructing the segment in filter phase.
 	 */
+	struct chunk **out = malloc(sizeof(struct chunk*)
+			* (g_sequence_get_length(s->chunks) + 2));
+	int n = 0;
+
 	struct chunk* ss = new_chunk(0);
 	SET_CHUNK(ss, CHUNK_SEGMENT_START);
-	sync_queue_push(dedup_queue, ss);
+	out[n++] = ss;
 
 	GSequenceIter *end = g_sequence_get_end_iter(s->chunks);
 	GSequenceIter *begin = g_sequence_get_begin_iter(s->chunks);
@@ -52,14 +56,17 @@ void send_segment(struct segment* s) {
 			}
 
 		}
-		sync_queue_push(dedup_queue, c);
+		out[n++] = c;
 		g_sequence_remove(begin);
 		begin = g_sequence_get_begin_iter(s->chunks);
 	}
 
 	struct chunk* se = new_chunk(0);
 	SET_CHUNK(se, CHUNK_SEGMENT_END);
-	sync_queue_push(dedup_queue, se);
+	out[n++] = se;
+
+	sync_queue_push_n(dedup_queue, (void **) out, n);
+	free(out);
 
 	s->chunk_num = 0;
 
@@ -67,13 +74,12 @@ void send_segment(struct segment* s) {
 
 void *dedup_thread(void *arg) {
 	struct segment* s = NULL;
+	SyncQueueReader *input = sync_queue_reader_new(
+			destor.simulation_level != SIMULATION_ALL ? hash_queue : trace_queue,
+			SYNC_QUEUE_READER_BATCH);
 
 	while (1) {
-		struct chunk *c = NULL;
-		if (destor.simulation_level != SIMULATION_ALL)
-			c = sync_queue_pop(hash_queue);
-		else
-			c = sync_queue_pop(trace_queue);
+		struct chunk *c = sync_queue_reader_pop(input);
 
 		/* Add the chunk to the segment. */
 		s = segmenting(c);
@@ -106,6 +112,7 @@ void *dedup_thread(void *arg) {
 	}
 
 	sync_queue_term(dedup_queue);
+	sync_queue_reader_free(input);
 
 	return NULL;
 }
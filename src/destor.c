@@ -12,7 +12,7 @@
 
 extern void do_backup(char *path);
 //extern void do_delete(int revision);
-extern void do_restore(int revision, char *path);
+extern void do_restore(int revision, char *path, char *pattern);
 extern void do_update(int revision, char *path);
 void do_delete(int jobid);
 extern void make_trace(char *raw_files);
@@ -23,7 +23,7 @@ extern void load_config_from_string(sds config, const char *sep);
 /* : means argument is required.
  * :: means argument is required and no space.
  */
-const char * const short_options = "sr::n::u::i::t::p::h";
+const char * const short_options = "sr::n::u::i::t::p::f::h";
 
 struct option long_options[] = {
 		{ "state", 0, NULL, 's' },
@@ -39,6 +39,9 @@ void usage() {
 	puts("\tstart a restore job");
 	puts("\t\tdestor -r<JOB_ID> /path/to/restore -p\"a line in config file\"");
 
+	puts("\tstart a restore job of some files");
+	puts("\t\tdestor -r<JOB_ID> /path/to/restore -f\"a file, directory or glob in the backup\"");
+
 	puts("\tstart a sha256 restore job");
 	puts("\t\tdestor -n<JOB_ID> /path/to/restore -p\"a line in config file\"");
 
@@ -95,14 +98,33 @@ void destor_start() {
 	destor.simulation_level = SIMULATION_NO;
     destor.trace_format = TRACE_DESTOR;
 	destor.verbosity = DESTOR_WARNING;
+	destor.recipe_format = 1;
+
+	destor.upgrade_hash_threads = 1;
+	destor.upgrade_read_depth = 4;
+	destor.upgrade_external_prefetch = 4;
+	destor.upgrade_prefetch_depth = 8;
+	destor.upgrade_cache_policy = UPGRADE_CACHE_LRU;
+	destor.upgrade_dedup_threads = 1;
+	destor.upgrade_preprocess_threads = 4;
+	destor.upgrade_opt_window_size = 1000000;
 
 	destor.chunk_algorithm = CHUNK_RABIN;
 	destor.chunk_max_size = 65536;
 	destor.chunk_min_size = 1024;
 	destor.chunk_avg_size = 8192;
+	destor.chunk_threads = 1;
+	destor.hash_threads = 1;
+
+	destor.compress_level = 3; // ZSTD_CLEVEL_DEFAULT
+	destor.compress_threads = 1;
+	destor.compress_entropy_threshold = 7.5;
+	destor.compress_dict_size = 0;
 
 	destor.restore_cache[0] = RESTORE_CACHE_LRU;
 	destor.restore_cache[1] = 1024;
+	destor.cache_policy = CACHE_POLICY_LRU;
+	destor.restore_cache_bytes = 0;
 	destor.restore_opt_window_size = 1000000;
 
 	destor.index_category[0] = INDEX_CATEGORY_NEAR_EXACT;
@@ -280,6 +302,7 @@ int main(int argc, char **argv) {
 
 	job = DESTOR_BACKUP;
 	int revision = -1;
+	char *pattern = NULL;
 
 	int opt = 0;
 	while ((opt = getopt_long(argc, argv, short_options, long_options, NULL))
@@ -306,6 +329,9 @@ int main(int argc, char **argv) {
 		case 't':
 			job = DESTOR_MAKE_TRACE;
 			break;
+		case 'f':
+			pattern = optarg;
+			break;
 		case 'h':
 			usage();
 			break;
@@ -361,7 +387,7 @@ int main(int argc, char **argv) {
 			usage();
 		}
 
-		do_restore(revision, path[0] == 0 ? 0 : path);
+		do_restore(revision, path[0] == 0 ? 0 : path, pattern);
 
 		sdsfree(path);
 		break;
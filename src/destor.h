@@ -33,6 +33,7 @@
 #include "utils/sds.h"
 // #include <hiredis/hiredis.h>
 #include "utils/cache.h"
+#include "utils/hashed_cache.h"
 
 #define TIMER_DECLARE(n) struct timeval b##n,e##n
 #define TIMER_BEGIN(n) gettimeofday(&b##n, NULL)
@@ -101,6 +102,7 @@ int job;
 #define CHUNK_FILE 3 /* approximate file-level */
 #define CHUNK_AE 4 /* Asymmetric Extremum CDC */
 #define CHUNK_TTTD 5
+#define CHUNK_FASTCDC 6 /* gear hash with normalized chunking */
 
 /*
  * A global fingerprint index is required.
@@ -193,6 +195,9 @@ int job;
 #define RESTORE_CACHE_OPT 1
 #define RESTORE_CACHE_ASM 2
 
+#define UPGRADE_CACHE_LRU 0
+#define UPGRADE_CACHE_OPT 1
+
 #define REWRITE_NO 0
 #define REWRITE_CFL_SELECTIVE_DEDUPLICATION 1
 #define REWRITE_CONTEXT_BASED 2
@@ -214,6 +219,8 @@ int job;
 #define CHUNK_REWRITE_DENIED (0x1000)
 #define CHUNK_REPROCESS (0x2000) // 需要读取新container重新计算sha1
 #define CHUNK_PROCESSING (0x4000) // 正在处理中
+#define CHUNK_COMPRESSED (0x8000) // data is compressed by the compress phase
+#define CHUNK_RAW (0x10000) // data is stored without compression
 
 /* signal chunk */
 #define CHUNK_FILE_START (0x0001)
@@ -244,6 +251,7 @@ struct destor {
 	int simulation_level;
     int trace_format;
 	int verbosity;
+	int recipe_format; // 1: .recipe, 2: .crecipe instead, see columnar_recipe.h
 
 	// upgrade flags
 	int upgrade_level;
@@ -254,14 +262,32 @@ struct destor {
 	int upgrade_relation_level;
 	int upgrade_cdc_level;
 	int direct_reads;
+	int upgrade_hash_threads; // number of sha256 workers in the container pass
+	int upgrade_read_depth; // number of container reads in flight in the container pass
+	int upgrade_external_prefetch; // number of readers staging relations in the recipe pass
+	int upgrade_prefetch_depth; // units staged ahead of the dedup workers
+	int upgrade_cache_policy;
+	int upgrade_dedup_threads; // number of dedup workers in the recipe pass
+	int upgrade_preprocess_threads; // number of workers computing recipe features
+	int upgrade_opt_window_size; // container accesses announced ahead of the dedup thread
 
 	int chunk_algorithm;
 	int chunk_max_size;
 	int chunk_min_size;
 	int chunk_avg_size;
+	int chunk_threads; // number of workers chunking a large file in parallel, 1 is serial
+	int hash_threads; // number of SHA-1 workers in backup, 1 is serial
+
+	int compress_level; // ZSTD level of the stored chunks
+	int compress_threads; // number of workers in the compress phase
+	/* chunks of a higher sampled entropy, in bits per byte, are stored raw */
+	double compress_entropy_threshold;
+	int compress_dict_size; // maximum size of the dictionary of a segment, 0 disables it
 
 	/* the cache type and size */
+	int cache_policy; // eviction of the lru-style caches, CACHE_POLICY_*
 	int restore_cache[2];
+	int64_t restore_cache_bytes; // if positive, bounds the lru restore cache in bytes instead
 	int restore_opt_window_size;
 
 	/* Specify fingerprint index,
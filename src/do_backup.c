@@ -31,6 +31,7 @@ void do_backup(char *path) {
 	}
 	start_dedup_phase();
 	start_rewrite_phase();
+	start_compress_phase();
 	start_filter_phase();
 
     do{
@@ -51,6 +52,7 @@ void do_backup(char *path) {
 	}
 	stop_dedup_phase();
 	stop_rewrite_phase();
+	stop_compress_phase();
 	stop_filter_phase();
 
 	TIMER_END(1, jcr.total_time);
@@ -73,7 +75,12 @@ void do_backup(char *path) {
 	printf("number of unique chunks: %" PRId32 "\n", jcr.unique_chunk_num);
 	printf("origin size(B): %" PRId64 "\n", jcr.origin_data_size);
 	printf("total size(B): %" PRId64 "\n", jcr.data_size);
-	printf("compress ratio: %.2f\n", jcr.data_size != 0 ? jcr.origin_data_size / (double) (jcr.data_size) : 0);
+	printf("compress ratio: %.2f\n",
+			jcr.unique_data_size + jcr.rewritten_chunk_size != 0 ?
+					jcr.stored_origin_size
+							/ (double) (jcr.unique_data_size
+									+ jcr.rewritten_chunk_size) :
+					0);
 	printf("stored data size(B): %" PRId64 "\n",
 			jcr.unique_data_size + jcr.rewritten_chunk_size);
 	printf("deduplication ratio: %.4f, %.4f\n",
@@ -93,6 +100,10 @@ void do_backup(char *path) {
 	printf("size of rewritten chunks: %" PRId64 "\n", jcr.rewritten_chunk_size);
 	printf("rewritten rate in size: %.3f\n",
 			jcr.rewritten_chunk_size / (double) jcr.data_size);
+	printf("number of raw chunks: %" PRId32 "\n", jcr.raw_chunk_num);
+	printf("size of raw chunks: %" PRId64 "\n", jcr.raw_chunk_size);
+	printf("number of dictionaries: %" PRId32 "\n", jcr.dict_num);
+	printf("size of dictionaries: %" PRId64 "\n", jcr.dict_size);
 
 	destor.data_size += jcr.data_size;
 	destor.stored_data_size += jcr.unique_data_size + jcr.rewritten_chunk_size;
@@ -118,6 +129,10 @@ void do_backup(char *path) {
 	printf("rewrite_time : %.3fs, %.2fMB/s\n", jcr.rewrite_time / 1000000,
 			jcr.data_size * 1000000 / jcr.rewrite_time / 1024 / 1024);
 
+	printf("compress_time : %.3fs, %.2fMB/s\n",
+			jcr.compress_time / 1000000,
+			jcr.stored_origin_size * 1000000 / jcr.compress_time / 1024 / 1024);
+
 	printf("filter_time : %.3fs, %.2fMB/s\n",
 			jcr.filter_time / 1000000,
 			jcr.data_size * 1000000 / jcr.filter_time / 1024 / 1024);
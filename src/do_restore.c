@@ -2,21 +2,37 @@
 #include "jcr.h"
 #include "recipe/recipestore.h"
 #include "storage/containerstore.h"
-#include "utils/lru_cache.h"
 #include "restore.h"
 #include <zstd.h>
 
+/*
+ * The restore cache is keyed by the container id in the recipe,
+ * so a chunk is looked up only in the container it belongs to.
+ */
 static void* lru_restore_thread(void *arg) {
-	struct lruCache *cache;
-	if (destor.simulation_level >= SIMULATION_RESTORE)
-		cache = new_lru_cache(destor.restore_cache[1], free_container_meta,
-				lookup_fingerprint_in_container_meta);
+	int simulation = destor.simulation_level >= SIMULATION_RESTORE;
+	int64_t limit, unit;
+	if (destor.restore_cache_bytes > 0) {
+		limit = destor.restore_cache_bytes;
+		unit = simulation ? CONTAINER_META_SIZE : CONTAINER_SIZE;
+	} else {
+		limit = destor.restore_cache[1];
+		unit = 1;
+	}
+	struct hashedCache *cache;
+	if (simulation)
+		cache = new_hashed_cache(destor.cache_policy, limit,
+				offsetof(struct containerMeta, node), g_int64_hash,
+				g_int64_equal, free_container_meta);
 	else
-		cache = new_lru_cache(destor.restore_cache[1], free_container,
-				lookup_fingerprint_in_container);
+		cache = new_hashed_cache(destor.cache_policy, limit,
+				offsetof(struct container, meta.node), g_int64_hash,
+				g_int64_equal, free_container);
 
+	SyncQueueReader *input = sync_queue_reader_new(restore_recipe_queue,
+			SYNC_QUEUE_READER_BATCH);
 	struct chunk* c;
-	while ((c = sync_queue_pop(restore_recipe_queue))) {
+	while ((c = sync_queue_reader_pop(input))) {
 
 		if (CHECK_CHUNK(c, CHUNK_FILE_START) || CHECK_CHUNK(c, CHUNK_FILE_END)) {
 			sync_queue_push(restore_chunk_queue, c);
@@ -26,25 +42,25 @@ static void* lru_restore_thread(void *arg) {
 		TIMER_DECLARE(1);
 		TIMER_BEGIN(1);
 
-		if (destor.simulation_level >= SIMULATION_RESTORE) {
-			struct containerMeta *cm = lru_cache_lookup(cache, &c->fp);
-			if (!cm) {
-				VERBOSE("Restore cache: container %lld is missed", c->id);
-				cm = retrieve_container_meta_by_id(c->id);
-				assert(lookup_fingerprint_in_container_meta(cm, &c->fp));
-				lru_cache_insert(cache, cm, NULL, NULL);
-				jcr.read_container_num++;
+		void *con = hashed_cache_lookup(cache, &c->id);
+		if (!con) {
+			VERBOSE("Restore cache: container %lld is missed", c->id);
+			if (simulation) {
+				struct containerMeta *cm = retrieve_container_meta_by_id(c->id);
+				hashed_cache_insert(cache, cm, &cm->id, unit);
+				con = cm;
+			} else {
+				struct container *ct = retrieve_container_by_id(c->id);
+				hashed_cache_insert(cache, ct, &ct->meta.id, unit);
+				con = ct;
 			}
+			jcr.read_container_num++;
+		}
 
+		if (simulation) {
+			assert(lookup_fingerprint_in_container_meta(con, &c->fp));
 			TIMER_END(1, jcr.read_chunk_time);
 		} else {
-			struct container *con = lru_cache_lookup(cache, &c->fp);
-			if (!con) {
-				VERBOSE("Restore cache: container %lld is missed", c->id);
-				con = retrieve_container_by_id(c->id);
-				lru_cache_insert(cache, con, NULL, NULL);
-				jcr.read_container_num++;
-			}
 			struct chunk *rc = get_chunk_in_container(con, &c->fp);
 			assert(rc);
 			TIMER_END(1, jcr.read_chunk_time);
@@ -57,15 +73,20 @@ static void* lru_restore_thread(void *arg) {
 	}
 
 	sync_queue_term(restore_chunk_queue);
+	sync_queue_reader_free(input);
 
-	free_lru_cache(cache);
+	NOTICE("Restore cache (%s): %" PRId64 " hits, %" PRId64 " misses, %" PRId64 " evictions",
+			hashed_cache_policy_name(cache->policy), cache->hit_count,
+			cache->miss_count, cache->evict_count);
+	free_hashed_cache(cache);
 
 	return NULL;
 }
 
 static void* read_recipe_thread(void *arg) {
 
-	int i, j, k;
+	int i, j;
+	struct recipeCursor *cursor = new_recipe_cursor(jcr.bv);
 	for (i = 0; i < jcr.bv->number_of_files; i++) {
 		TIMER_DECLARE(1);
 		TIMER_BEGIN(1);
@@ -84,7 +105,8 @@ static void* read_recipe_thread(void *arg) {
 			TIMER_DECLARE(1);
 			TIMER_BEGIN(1);
 
-			struct chunkPointer* cp = read_next_n_chunk_pointers(jcr.bv, 1, &k);
+			struct recipeRecord* cp = recipe_cursor_next(cursor);
+			assert(cp);
 
 			struct chunk* c = new_chunk(0);
 			memcpy(&c->fp, &cp->fp, sizeof(fingerprint));
@@ -94,6 +116,73 @@ static void* read_recipe_thread(void *arg) {
 			TIMER_END(1, jcr.read_recipe_time);
 
 			sync_queue_push(restore_recipe_queue, c);
+		}
+
+		c = new_chunk(0);
+		SET_CHUNK(c, CHUNK_FILE_END);
+		sync_queue_push(restore_recipe_queue, c);
+
+		free_file_recipe_meta(r);
+	}
+	free_recipe_cursor(cursor);
+
+	sync_queue_term(restore_recipe_queue);
+	return NULL;
+}
+
+/* If set, only the files matching it are restored, see file_index_match */
+static char *restore_pattern;
+
+#define RESTORE_RECIPE_BATCH 4096
+
+/*
+ * Read the recipes of the files matching restore_pattern,
+ * seeking to them through the file index of the backup version.
+ */
+static void* read_matched_recipe_thread(void *arg) {
+	TIMER_DECLARE(1);
+	TIMER_BEGIN(1);
+
+	struct fileIndex *fi = open_file_index(jcr.bv);
+	if (fi == NULL) {
+		fprintf(stderr, "Backup version %d has no file index!\n", jcr.bv->bv_num);
+		exit(1);
+	}
+	int64_t n, i, j;
+	struct fileIndexEntry **matches = file_index_match(fi, restore_pattern, &n);
+	NOTICE("%" PRId64 " files match %s", n, restore_pattern);
+
+	TIMER_END(1, jcr.read_recipe_time);
+
+	for (i = 0; i < n; i++) {
+		TIMER_BEGIN(1);
+
+		struct fileRecipeMeta *r = read_file_recipe_meta_at(jcr.bv, matches[i]->meta_off);
+
+		struct chunk *c = new_chunk(sdslen(r->filename) + 1);
+		strcpy(c->data, r->filename);
+		SET_CHUNK(c, CHUNK_FILE_START);
+
+		TIMER_END(1, jcr.read_recipe_time);
+
+		sync_queue_push(restore_recipe_queue, c);
+
+		for (j = 0; j < r->chunknum; j += RESTORE_RECIPE_BATCH) {
+			int k, num = r->chunknum - j > RESTORE_RECIPE_BATCH ?
+					RESTORE_RECIPE_BATCH : r->chunknum - j;
+
+			TIMER_BEGIN(1);
+			struct chunkPointer *cp = read_n_chunk_pointers(jcr.bv,
+					matches[i]->recipe_off + j * RECIPE_RECORD_SIZE, num);
+			TIMER_END(1, jcr.read_recipe_time);
+
+			for (k = 0; k < num; k++) {
+				struct chunk* c = new_chunk(0);
+				memcpy(&c->fp, &cp[k].fp, sizeof(fingerprint));
+				c->size = cp[k].size;
+				c->id = cp[k].id;
+				sync_queue_push(restore_recipe_queue, c);
+			}
 			free(cp);
 		}
 
@@ -103,6 +192,8 @@ static void* read_recipe_thread(void *arg) {
 
 		free_file_recipe_meta(r);
 	}
+	free(matches);
+	close_file_index(fi);
 
 	sync_queue_term(restore_recipe_queue);
 	return NULL;
@@ -132,7 +223,9 @@ void* write_restore_data(void* arg) {
 	struct chunk *c = NULL;
 	FILE *fp = NULL;
 
-	while ((c = sync_queue_pop(restore_chunk_queue))) {
+	SyncQueueReader *input = sync_queue_reader_new(restore_chunk_queue,
+			SYNC_QUEUE_READER_BATCH);
+	while ((c = sync_queue_reader_pop(input))) {
 
 		TIMER_DECLARE(1);
 		TIMER_BEGIN(1);
@@ -175,13 +268,18 @@ void* write_restore_data(void* arg) {
 		} else {
 			assert(destor.simulation_level == SIMULATION_NO);
 			VERBOSE("Restoring %d bytes", c->size);
-			// decompress
-			size_t size = ZSTD_decompress(decompBuf, destor.chunk_max_size, c->data, c->size);
-			if (size > 0) {
-				fwrite(decompBuf, size, 1, fp);
+			if (CHECK_CHUNK(c, CHUNK_RAW)) {
+				/* stored without compression */
+				fwrite(c->data, c->size, 1, fp);
 			} else {
-				fprintf(stderr, "Decompress error\n");
-				exit(1);
+				// decompress
+				size_t size = ZSTD_decompress(decompBuf, destor.chunk_max_size, c->data, c->size);
+				if (size > 0) {
+					fwrite(decompBuf, size, 1, fp);
+				} else {
+					fprintf(stderr, "Decompress error\n");
+					exit(1);
+				}
 			}
 		}
 
@@ -190,12 +288,13 @@ void* write_restore_data(void* arg) {
 		TIMER_END(1, jcr.write_chunk_time);
 	}
 
+	sync_queue_reader_free(input);
 	free(decompBuf);
     jcr.status = JCR_STATUS_DONE;
     return NULL;
 }
 
-void do_restore(int revision, char *path) {
+void do_restore(int revision, char *path, char *pattern) {
 
 	init_recipe_store();
 	init_container_store();
@@ -206,6 +305,16 @@ void do_restore(int revision, char *path) {
 	destor_log(DESTOR_NOTICE, "backup path: %s", jcr.bv->path);
 	destor_log(DESTOR_NOTICE, "restore to: %s", jcr.path);
 
+	restore_pattern = pattern;
+	if (restore_pattern) {
+		destor_log(DESTOR_NOTICE, "restore files matching: %s", restore_pattern);
+		if (destor.restore_cache[0] == RESTORE_CACHE_OPT) {
+			/* The access records cover the whole backup */
+			WARNING("OPT restore cache needs a full restore, use LRU");
+			destor.restore_cache[0] = RESTORE_CACHE_LRU;
+		}
+	}
+
 	restore_chunk_queue = sync_queue_new(100);
 	restore_recipe_queue = sync_queue_new(100);
 
@@ -216,7 +325,8 @@ void do_restore(int revision, char *path) {
 
     jcr.status = JCR_STATUS_RUNNING;
 	pthread_t recipe_t, read_t, write_t;
-	pthread_create(&recipe_t, NULL, read_recipe_thread, NULL);
+	pthread_create(&recipe_t, NULL,
+			restore_pattern ? read_matched_recipe_thread : read_recipe_thread, NULL);
 
 	if (destor.restore_cache[0] == RESTORE_CACHE_LRU) {
 		destor_log(DESTOR_NOTICE, "restore cache is LRU");
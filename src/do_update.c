@@ -2,15 +2,21 @@
 #include "jcr.h"
 #include "recipe/recipestore.h"
 #include "storage/containerstore.h"
-#include "utils/lru_cache.h"
 #include "utils/cache.h"
 #include "update.h"
 #include "backup.h"
 #include "index/index.h"
 #include "index/upgrade_cache.h"
+#include "index/upgrade_external.h"
 #include "similarity.h"
+#include "utils/hash_many.h"
+#include <zstd.h>
 
 #define QUEUE_SIZE 5
+/* the queues of chunks are as deep as those of backup, so that batches fill */
+#define CHUNK_QUEUE_SIZE 100
+/* chunks move between the upgrade stages in batches of up to RECIPE_BATCH */
+#define RECIPE_BATCH 32
 /* defined in index.c */
 extern struct index_overhead index_overhead, upgrade_index_overhead;
 extern GHashTable *upgrade_processing;
@@ -22,9 +28,12 @@ void end_update();
 
 static void* read_recipe_thread(void *arg) {
 	pthread_setname_np(pthread_self(), "read_recipe_thread");
-	int i, j, k;
+	int i, j;
 	fingerprint zero_fp;
 	memset(zero_fp, 0, sizeof(fingerprint));
+	struct recipeCursor *cursor = new_recipe_cursor(jcr.bv);
+	struct chunk *out[RECIPE_BATCH];
+	int n = 0;
 	for (i = 0; i < jcr.bv->number_of_files; i++) {
 		TIMER_DECLARE(1);
 		TIMER_BEGIN(1);
@@ -38,17 +47,13 @@ static void* read_recipe_thread(void *arg) {
 
 		TIMER_END(1, jcr.read_recipe_time);
 
-		sync_queue_push(upgrade_recipe_queue, c);
-
-		TIMER_BEGIN(1);
-		struct chunkPointer* cps = read_next_n_chunk_pointers(jcr.bv, r->chunknum, &k);
-		TIMER_END(1, jcr.read_recipe_time);
-		assert(k == r->chunknum);
+		out[n++] = c;
 
 		for (j = 0; j < r->chunknum; j++) {
 			TIMER_BEGIN(1);
 
-			struct chunkPointer* cp = cps + j;
+			struct recipeRecord* cp = recipe_cursor_next(cursor);
+			assert(cp);
 
 			struct chunk* c = new_chunk(0);
 			memcpy(&c->old_fp, &cp->fp, sizeof(fingerprint));
@@ -58,137 +63,367 @@ static void* read_recipe_thread(void *arg) {
 
 			TIMER_END(1, jcr.read_recipe_time);
 
-			sync_queue_push(upgrade_recipe_queue, c);
+			out[n++] = c;
+			if (n == RECIPE_BATCH) {
+				sync_queue_push_n(upgrade_recipe_queue, (void **) out, n);
+				n = 0;
+			}
 		}
-		free(cps);
 
 		c = new_chunk(0);
 		SET_CHUNK(c, CHUNK_FILE_END);
-		sync_queue_push(upgrade_recipe_queue, c);
+		out[n++] = c;
+		/* a file is never held back */
+		sync_queue_push_n(upgrade_recipe_queue, (void **) out, n);
+		n = 0;
 
 		free_file_recipe_meta(r);
 	}
+	free_recipe_cursor(cursor);
 
 	sync_queue_term(upgrade_recipe_queue);
 	return NULL;
 }
 
 static void* lru_get_chunk_thread(void *arg) {
-	struct lruCache *cache;
 	// if (destor.simulation_level >= SIMULATION_RESTORE)
-	cache = new_lru_cache(destor.restore_cache[1], free_container,
-			lookup_fingerprint_in_container);
-
-	struct chunk* c;
-	while ((c = sync_queue_pop(pre_dedup_queue))) {
+	struct hashedCache *cache = new_hashed_cache(destor.cache_policy,
+			destor.restore_cache[1], offsetof(struct container, meta.node),
+			g_int64_hash, g_int64_equal, free_container);
+
+	struct chunk* cks[RECIPE_BATCH];
+	int n, i;
+	while ((n = sync_queue_pop_n(pre_dedup_queue, (void **) cks, RECIPE_BATCH,
+			1, -1))) {
+		for (i = 0; i < n; i++) {
+			struct chunk *c = cks[i];
+			if (CHECK_CHUNK(c, CHUNK_FILE_START) || CHECK_CHUNK(c, CHUNK_FILE_END) || CHECK_CHUNK(c, CHUNK_DUPLICATE))
+				continue;
+
+			TIMER_DECLARE(1);
+			TIMER_BEGIN(1);
 
-		if (CHECK_CHUNK(c, CHUNK_FILE_START) || CHECK_CHUNK(c, CHUNK_FILE_END) || CHECK_CHUNK(c, CHUNK_DUPLICATE)) {
-			sync_queue_push(upgrade_chunk_queue, c);
-			continue;
+			// if (destor.simulation_level >= SIMULATION_RESTORE) {
+			struct container *con = hashed_cache_lookup(cache, &c->id);
+			if (!con) {
+				con = retrieve_container_by_id(c->id);
+				hashed_cache_insert(cache, con, &con->meta.id, 1);
+				jcr.read_container_num++;
+			}
+			struct chunk *rc = get_chunk_in_container(con, &c->old_fp);
+			memcpy(rc->old_fp, c->old_fp, sizeof(fingerprint));
+			rc->id = TEMPORARY_ID;
+			assert(rc);
+			TIMER_END(1, jcr.read_chunk_time);
+
+			cks[i] = rc;
+
+			// filter_phase已经算过一遍了
+			// jcr.data_size += c->size;
+			// jcr.chunk_num++;
+			free_chunk(c);
 		}
 
-		TIMER_DECLARE(1);
-		TIMER_BEGIN(1);
+		sync_queue_push_n(upgrade_chunk_queue, (void **) cks, n);
+	}
 
-		// if (destor.simulation_level >= SIMULATION_RESTORE) {
-		struct container *con = lru_cache_lookup(cache, &c->old_fp);
-		if (!con) {
-			con = retrieve_container_by_id(c->id);
-			lru_cache_insert(cache, con, NULL, NULL);
-			jcr.read_container_num++;
-		}
-		struct chunk *rc = get_chunk_in_container(con, &c->old_fp);
-		memcpy(rc->old_fp, c->old_fp, sizeof(fingerprint));
-		rc->id = TEMPORARY_ID;
-		assert(rc);
-		TIMER_END(1, jcr.read_chunk_time);
+	sync_queue_term(upgrade_chunk_queue);
 
-		sync_queue_push(upgrade_chunk_queue, rc);
+	free_hashed_cache(cache);
 
-		// filter_phase已经算过一遍了
-		// jcr.data_size += c->size;
-		// jcr.chunk_num++;
-		free_chunk(c);
-	}
+	return NULL;
+}
 
-	sync_queue_term(upgrade_chunk_queue);
+/*
+ * The container prefetcher keeps upgrade_read_depth container reads
+ * in flight. Each reader claims the next container id and reads it
+ * with pread(); read_container_thread delivers the containers to
+ * upgrade_chunk_queue in id order. A reader never runs more than
+ * upgrade_read_depth containers ahead of the delivery.
+ */
+struct container_prefetcher {
+	int depth;
+	int64_t count;
+	containerid next_read;
+	containerid next_deliver;
+	struct container **slots;
+	pthread_t *readers;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static void* prefetch_container_thread(void *arg) {
+	pthread_setname_np(pthread_self(), "prefetch_con");
+	struct container_prefetcher *p = (struct container_prefetcher *)arg;
 
-	free_lru_cache(cache);
+	while (1) {
+		pthread_mutex_lock(&p->mutex);
+		while (p->next_read < p->count && p->next_read >= p->next_deliver + p->depth)
+			pthread_cond_wait(&p->cond, &p->mutex);
+		if (p->next_read >= p->count) {
+			pthread_mutex_unlock(&p->mutex);
+			break;
+		}
+		containerid id = p->next_read++;
+		pthread_mutex_unlock(&p->mutex);
+
+		struct container *con = retrieve_container_by_id(id);
 
+		pthread_mutex_lock(&p->mutex);
+		assert(p->slots[id % p->depth] == NULL);
+		p->slots[id % p->depth] = con;
+		pthread_cond_broadcast(&p->cond);
+		pthread_mutex_unlock(&p->mutex);
+	}
 	return NULL;
 }
 
-#define CONTAINER_BUFFER_SIZE 2
 void* read_container_thread(void *arg) {
 	pthread_setname_np(pthread_self(), "read_container");
 
-	struct chunk *ck;
-	int64_t count = get_container_count();
-	struct container **buffer[CONTAINER_BUFFER_SIZE], *con;
-	int bufOffset = 0, bufSize = 0;
-	for (containerid id = 0; id < count; id++) {
+	struct container_prefetcher p;
+	struct container *con;
+	int i;
+
+	p.depth = destor.upgrade_read_depth > 0 ? destor.upgrade_read_depth : 1;
+	p.count = get_container_count();
+	p.next_read = 0;
+	p.next_deliver = 0;
+	p.slots = calloc(p.depth, sizeof(struct container *));
+	p.readers = malloc(p.depth * sizeof(pthread_t));
+	pthread_mutex_init(&p.mutex, NULL);
+	pthread_cond_init(&p.cond, NULL);
+	for (i = 0; i < p.depth; i++)
+		pthread_create(&p.readers[i], NULL, prefetch_container_thread, &p);
+
+	for (containerid id = 0; id < p.count; id++) {
 		TIMER_DECLARE(1);
 		TIMER_BEGIN(1);
-		
-		if (bufOffset == bufSize) {
-			bufSize = (count - id) > CONTAINER_BUFFER_SIZE ? CONTAINER_BUFFER_SIZE : (count - id);
-			for (int i = 0; i < bufSize; i++) {
-				buffer[i] = retrieve_container_by_id(id + i);
-				jcr.read_container_num++;
-			}
-			bufOffset = 0;
-		}
-		con = buffer[bufOffset++];
+
+		pthread_mutex_lock(&p.mutex);
+		while (p.slots[id % p.depth] == NULL)
+			pthread_cond_wait(&p.cond, &p.mutex);
+		con = p.slots[id % p.depth];
+		p.slots[id % p.depth] = NULL;
+		p.next_deliver++;
+		pthread_cond_broadcast(&p.cond);
+		pthread_mutex_unlock(&p.mutex);
+		assert(con->meta.id == id);
+		jcr.read_container_num++;
 
 		TIMER_END(1, jcr.read_chunk_time);
 		sync_queue_push(upgrade_chunk_queue, con);
 		jcr.processed_container_num++; 
 	}
 	sync_queue_term(upgrade_chunk_queue);
+
+	for (i = 0; i < p.depth; i++)
+		pthread_join(p.readers[i], NULL);
+	pthread_mutex_destroy(&p.mutex);
+	pthread_cond_destroy(&p.cond);
+	free(p.readers);
+	free(p.slots);
+	return NULL;
+}
+
+/*
+ * Lookahead prefetch of the recipe pass.
+ * While the dedup thread works on one unit, this thread collects the
+ * containers referenced by the next units that are not in the fingerprint
+ * cache and stages their relations from the external cache.
+ * A staged relation whose container got cached in the meantime is
+ * simply dropped, and a container evicted after staging is read again
+ * synchronously, so the lookahead never changes the dedup result.
+ * Up to upgrade_prefetch_depth units are staged ahead of the workers.
+ */
+static void* prefetch_recipe_thread(void *arg) {
+	pthread_setname_np(pthread_self(), "prefetch_recipe");
+	recipeUnit_t *u;
+	GHashTable *seen = g_hash_table_new(g_int64_hash, g_int64_equal);
+	int opt = destor.upgrade_cache_policy == UPGRADE_CACHE_OPT;
+	while ((u = sync_queue_pop(upgrade_recipe_queue))) {
+		TIMER_DECLARE(1);
+		TIMER_BEGIN(1);
+		containerid *ids = malloc(u->chunk_num * sizeof(containerid));
+		int n = 0;
+		for (int i = 0; i < u->chunk_num; i++) {
+			struct chunk *c = u->cks + i;
+			if (c->id < 0 || g_hash_table_contains(seen, &c->id))
+				continue;
+			g_hash_table_add(seen, &c->id);
+			/*
+			 * The shards of the LRU cache have their own locks, only the
+			 * OPT cache needs upgrade_index_lock, taken per container
+			 * so the dedup workers are never held up by the whole unit.
+			 */
+			int cached;
+			if (opt) {
+				pthread_mutex_lock(&upgrade_index_lock.mutex);
+				cached = upgrade_fingerprint_cache_contains(c->id);
+				pthread_mutex_unlock(&upgrade_index_lock.mutex);
+			} else {
+				cached = upgrade_fingerprint_cache_contains(c->id);
+			}
+			if (!cached)
+				ids[n++] = c->id;
+		}
+		g_hash_table_remove_all(seen);
+
+		u->staged = upgrade_external_cache_stage(ids, n);
+		free(ids);
+		TIMER_END(1, jcr.external_prefetch_time);
+		sync_queue_push(upgrade_prefetch_queue, u);
+	}
+	sync_queue_term(upgrade_prefetch_queue);
+	g_hash_table_destroy(seen);
 	return NULL;
 }
 
+/*
+ * Dedup workers of the recipe pass.
+ * With several workers, units are processed concurrently and reach
+ * filter_thread_recipe out of order, which is fine since each unit is
+ * written at its own chunk_off. The last worker terminates hash_queue.
+ */
+static int dedup_worker_num;
+static int dedup_worker_alive;
+
 void *reorder_dedup_thread(void *arg) {
 	pthread_setname_np(pthread_self(), "reorder_dedup");
+	SyncQueue *queue = arg;
 	recipeUnit_t *c;
-	while ((c = sync_queue_pop(upgrade_recipe_queue))) {
+	while ((c = sync_queue_pop(queue))) {
 		assert(jcr.container_processed);
+		upgrade_external_cache_set_staged(c->staged);
+		if (destor.upgrade_relation_level == 1) {
+			upgrade_index_lookup_n(c->cks, c->chunk_num);
+		} else if (dedup_worker_num > 1) {
+			upgrade_index_lookup_concurrent_n(c->cks, c->chunk_num);
+		} else {
+			for (int i = 0; i < c->chunk_num; i++) {
+				pthread_mutex_lock(&upgrade_index_lock.mutex);
+				upgrade_index_lookup(c->cks + i);
+				pthread_mutex_unlock(&upgrade_index_lock.mutex);
+			}
+		}
 		for (int i = 0; i < c->chunk_num; i++) {
-			upgrade_index_lookup(c->cks + i);
 			assert(CHECK_CHUNK((c->cks + i), CHUNK_DUPLICATE));
 		}
+		upgrade_external_cache_set_staged(NULL);
+		if (c->staged) {
+			g_hash_table_destroy(c->staged);
+			c->staged = NULL;
+		}
 		sync_queue_push(hash_queue, c);
 	}
-	sync_queue_term(hash_queue);
+	pthread_mutex_lock(&upgrade_index_lock.mutex);
+	if (--dedup_worker_alive == 0)
+		sync_queue_term(hash_queue);
+	pthread_mutex_unlock(&upgrade_index_lock.mutex);
 	return NULL;
 }
 
 static void* pre_dedup_thread(void *arg) {
-	while (1) {
-		struct chunk* c = sync_queue_pop(upgrade_recipe_queue);
-
-		if (c == NULL) {
-			break;
+	struct chunk* cks[RECIPE_BATCH];
+	int n, i, m;
+	while ((n = sync_queue_pop_n(upgrade_recipe_queue, (void **) cks,
+			RECIPE_BATCH, 1, -1))) {
+		m = 0;
+		for (i = 0; i < n; i++) {
+			struct chunk *c = cks[i];
+			if (CHECK_CHUNK(c, CHUNK_FILE_START) || CHECK_CHUNK(c, CHUNK_FILE_END)
+				|| destor.upgrade_level == UPGRADE_LFU) {
+				cks[m++] = c;
+			}
 		}
+		sync_queue_push_n(pre_dedup_queue, (void **) cks, m);
+	}
+	sync_queue_term(pre_dedup_queue);
+	return NULL;
+}
 
-		if (CHECK_CHUNK(c, CHUNK_FILE_START) || CHECK_CHUNK(c, CHUNK_FILE_END)
-			|| destor.upgrade_level == UPGRADE_LFU) {
-			sync_queue_push(pre_dedup_queue, c);
+/* The number of chunks hashed together by hash_many() in sha256_thread. */
+#define HASH_BATCH 64
+
+/*
+ * Set job to hash the data of c into digest.
+ * Fingerprints are taken over the data before compression,
+ * so a compressed chunk is decompressed first.
+ * Return the decompressed data, to be freed after hashing, or NULL.
+ */
+static unsigned char* set_hash_job(struct hashJob *job, struct chunk *c,
+		unsigned char *digest) {
+	job->digest = digest;
+	if (CHECK_CHUNK(c, CHUNK_RAW)) {
+		job->data = c->data;
+		job->len = c->size;
+		return NULL;
+	}
+	unsigned long long size = ZSTD_getFrameContentSize(c->data, c->size);
+	assert(size != ZSTD_CONTENTSIZE_UNKNOWN && size != ZSTD_CONTENTSIZE_ERROR);
+	unsigned char *raw = malloc(size);
+	size_t len = ZSTD_decompress(raw, size, c->data, c->size);
+	if (ZSTD_isError(len)) {
+		WARNING("ZSTD decompression error: %s", ZSTD_getErrorName(len));
+		exit(1);
+	}
+	job->data = raw;
+	job->len = len;
+	return raw;
+}
+
+/*
+ * Reprocessed chunks get their SHA-1 back into old_fp,
+ * the others get the new SHA-256 fingerprint.
+ * Both are computed over the decompressed chunk, see set_hash_job.
+ */
+static void hash_batch(struct chunk **batch, int *todo, int n) {
+	struct hashJob sha1_jobs[HASH_BATCH], sha256_jobs[HASH_BATCH];
+	unsigned char *raw1[HASH_BATCH], *raw256[HASH_BATCH];
+	int i, n1 = 0, n256 = 0;
+
+	TIMER_DECLARE(1);
+	TIMER_BEGIN(1);
+	for (i = 0; i < n; i++) {
+		struct chunk *c = batch[i];
+		if (!todo[i])
 			continue;
+		if (CHECK_CHUNK(c, CHUNK_REPROCESS)) {
+			assert(c->id >= 0);
+			raw1[n1] = set_hash_job(&sha1_jobs[n1], c, c->old_fp);
+			n1++;
+		} else {
+			assert(c->id == TEMPORARY_ID);
+			raw256[n256] = set_hash_job(&sha256_jobs[n256], c, c->fp);
+			n256++;
 		}
 	}
-	sync_queue_term(pre_dedup_queue);
-	return NULL;
+	hash_many(sha1_jobs, n1, HASH_SHA1);
+	hash_many(sha256_jobs, n256, HASH_SHA256);
+	for (i = 0; i < n1; i++)
+		free(raw1[i]);
+	for (i = 0; i < n256; i++)
+		free(raw256[i]);
+	jcr.hash_num += n1 + n256;
+	TIMER_END(1, jcr.hash_time);
+
+	sync_queue_push_n(hash_queue, (void **) batch, n);
 }
 
 static void* sha256_thread(void* arg) {
 	pthread_setname_np(pthread_self(), "sha256_thread");
 	// 只有计算在container内的chunk的hash, 如果不是2D, 则始终为TRUE
 	int in_container = TRUE;
+	struct chunk *batch[HASH_BATCH];
+	int todo[HASH_BATCH];
+	int n = 0;
+	SyncQueueReader *input = sync_queue_reader_new(upgrade_chunk_queue,
+			SYNC_QUEUE_READER_BATCH);
 	while (1) {
-		struct chunk* c = sync_queue_pop(upgrade_chunk_queue);
+		struct chunk* c = sync_queue_reader_pop(input);
 
 		if (c == NULL) {
+			hash_batch(batch, todo, n);
 			sync_queue_term(hash_queue);
 			break;
 		}
@@ -199,72 +434,146 @@ static void* sha256_thread(void* arg) {
 			in_container = FALSE;
 		}
 
+		batch[n] = c;
+		todo[n] = 0;
 		if (!in_container || IS_SIGNAL_CHUNK(c) || CHECK_CHUNK(c, CHUNK_DUPLICATE)) {
-			sync_queue_push(hash_queue, c);
-			continue;
-		}
-
-		if (destor.simulation_level >= SIMULATION_RESTORE) {
+			// passed through unchanged
+		} else if (destor.simulation_level >= SIMULATION_RESTORE) {
 			jcr.hash_num++;
 			if (CHECK_CHUNK(c, CHUNK_REPROCESS)) {
 				memcpy(c->old_fp, c->fp, sizeof(fingerprint));
 			} else {
 				memcpy(c->fp, c->old_fp, sizeof(fingerprint));
 			}
-			sync_queue_push(hash_queue, c);
-			continue;
+		} else {
+			todo[n] = 1;
 		}
+		n++;
 
-		TIMER_DECLARE(1);
-		TIMER_BEGIN(1);
-		jcr.hash_num++;
-		if (CHECK_CHUNK(c, CHUNK_REPROCESS)) {
-			// 计算SHA1
-			assert(c->id >= 0);
-			SHA_CTX ctx;
-			SHA1_Init(&ctx);
-			SHA1_Update(&ctx, c->data, c->size);
-			SHA1_Final(c->old_fp, &ctx);
-		} else {
-			// 计算SHA256
-			assert(c->id == TEMPORARY_ID);
-			SHA256_CTX ctx;
-			SHA256_Init(&ctx);
-			SHA256_Update(&ctx, c->data, c->size);
-			SHA256_Final(c->fp, &ctx);
+		if (n == HASH_BATCH || CHECK_CHUNK(c, CHUNK_FILE_END)) {
+			hash_batch(batch, todo, n);
+			n = 0;
 		}
-		TIMER_END(1, jcr.hash_time);
-		sync_queue_push(hash_queue, c);
 	}
+	sync_queue_reader_free(input);
 	return NULL;
 }
 
+/*
+ * The container pass hashes containers on a pool of workers.
+ * read_container_thread emits containers in id order, and
+ * filter_thread_container (and the layout of the external cache)
+ * relies on that order, so each worker waits for its turn
+ * before pushing its container into hash_queue.
+ */
+struct hash_worker {
+	int index;
+	pthread_t tid;
+	double hash_time;
+	int64_t hash_size;
+	uint32_t hash_num;
+	uint32_t container_num;
+};
+
+static struct hash_worker *hash_workers;
+static int hash_worker_num;
+static int hash_worker_alive;
+static containerid next_hashed_id;
+static pthread_mutex_t hash_order_mutex;
+static pthread_cond_t hash_order_cond;
+
 static void* sha256_container(void* arg) {
-	pthread_setname_np(pthread_self(), "sha256_thread");
+	struct hash_worker *w = (struct hash_worker *)arg;
+	char name[16];
+	snprintf(name, sizeof(name), "sha256_%d", w->index);
+	pthread_setname_np(pthread_self(), name);
+
 	struct container *con;
 	struct chunk *c;
+	struct hashJob *jobs = NULL;
+	unsigned char **raw = NULL;
+	int jobs_size = 0;
 	while ((con = sync_queue_pop(upgrade_chunk_queue)) != NULL) {
 		TIMER_DECLARE(1);
 		TIMER_BEGIN(1);
+		if (con->meta.chunk_num > jobs_size) {
+			jobs_size = con->meta.chunk_num;
+			jobs = realloc(jobs, jobs_size * sizeof(struct hashJob));
+			raw = realloc(raw, jobs_size * sizeof(unsigned char *));
+		}
 		for (int i = 0; i < con->meta.chunk_num; i++) {
 			c = con->chunks + i;
-			jcr.hash_num++;
+			w->hash_size += c->size;
 			if (destor.simulation_level >= SIMULATION_RESTORE) {
 				memcpy(c->fp, c->old_fp, sizeof(fingerprint));
 			} else {
-				SHA256_CTX ctx;
-				SHA256_Init(&ctx);
-				SHA256_Update(&ctx, c->data, c->size);
-				SHA256_Final(c->fp, &ctx);
+				raw[i] = set_hash_job(&jobs[i], c, c->fp);
 			}
 		}
-		TIMER_END(1, jcr.hash_time);
+		if (destor.simulation_level < SIMULATION_RESTORE) {
+			hash_many(jobs, con->meta.chunk_num, HASH_SHA256);
+			for (int i = 0; i < con->meta.chunk_num; i++)
+				free(raw[i]);
+		}
+		w->hash_num += con->meta.chunk_num;
+		TIMER_END(1, w->hash_time);
+		w->container_num++;
+
+		pthread_mutex_lock(&hash_order_mutex);
+		while (con->meta.id != next_hashed_id)
+			pthread_cond_wait(&hash_order_cond, &hash_order_mutex);
 		sync_queue_push(hash_queue, con);
+		next_hashed_id++;
+		pthread_cond_broadcast(&hash_order_cond);
+		pthread_mutex_unlock(&hash_order_mutex);
 	}
-	sync_queue_term(hash_queue);
+
+	free(jobs);
+	free(raw);
+
+	pthread_mutex_lock(&hash_order_mutex);
+	jcr.hash_num += w->hash_num;
+	jcr.hash_time += w->hash_time;
+	if (--hash_worker_alive == 0)
+		sync_queue_term(hash_queue);
+	pthread_mutex_unlock(&hash_order_mutex);
 	return NULL;
 }
 
+static void start_sha256_container_workers() {
+	hash_worker_num = destor.upgrade_hash_threads > 0 ? destor.upgrade_hash_threads : 1;
+	hash_worker_alive = hash_worker_num;
+	next_hashed_id = 0;
+	pthread_mutex_init(&hash_order_mutex, NULL);
+	pthread_cond_init(&hash_order_cond, NULL);
+
+	hash_workers = calloc(hash_worker_num, sizeof(struct hash_worker));
+	for (int i = 0; i < hash_worker_num; i++) {
+		hash_workers[i].index = i;
+		pthread_create(&hash_workers[i].tid, NULL, sha256_container, &hash_workers[i]);
+	}
+}
+
+static void stop_sha256_container_workers() {
+	for (int i = 0; i < hash_worker_num; i++)
+		pthread_join(hash_workers[i].tid, NULL);
+	pthread_mutex_destroy(&hash_order_mutex);
+	pthread_cond_destroy(&hash_order_cond);
+}
+
+static void print_hash_workers() {
+	if (!hash_workers)
+		return;
+	for (int i = 0; i < hash_worker_num; i++) {
+		struct hash_worker *w = &hash_workers[i];
+		printf("----- hash_worker_%d:\t%.3fs, %" PRIu32 " containers, %" PRIu32 " chunks, %.2fMB/s\n",
+				w->index, w->hash_time / 1000000, w->container_num, w->hash_num,
+				w->hash_time > 0 ? w->hash_size * 1000000 / (1024.0 * 1024 * w->hash_time) : 0);
+	}
+	free(hash_workers);
+	hash_workers = NULL;
+}
+
 void print_status() {
 	fprintf(stderr, "%" PRId64 " GB, %" PRId32 " chunks, %d files, %d container, %d files pre_processed\r", 
 		jcr.data_size >> 30, jcr.chunk_num, jcr.file_num, jcr.processed_container_num, jcr.pre_process_file_num);
@@ -310,10 +619,17 @@ static void pre_process_args() {
 		assert(0);
 		break;
 	}
+
+	// the optimal cache needs the scheduled recipe order of the reorder upgrade
+	if (destor.upgrade_cache_policy == UPGRADE_CACHE_OPT
+			&& (!destor.upgrade_reorder || destor.upgrade_relation_level != 2)) {
+		WARNING("The optimal upgrade cache requires 2D reorder upgrade, use LRU instead");
+		destor.upgrade_cache_policy = UPGRADE_CACHE_LRU;
+	}
 }
 
 void do_reorder_upgrade_container() {
-	pthread_t read_t, hash_t, filter_t, recipe_t;
+	pthread_t read_t, filter_t, recipe_t;
 
 	TIMER_DECLARE(1);
 	TIMER_BEGIN(1);
@@ -322,7 +638,7 @@ void do_reorder_upgrade_container() {
 	upgrade_chunk_queue = sync_queue_new(QUEUE_SIZE);
 	hash_queue = sync_queue_new(QUEUE_SIZE);
 	pthread_create(&read_t, NULL, read_container_thread, NULL);
-	pthread_create(&hash_t, NULL, sha256_container, NULL);
+	start_sha256_container_workers();
 	pthread_create(&filter_t, NULL, filter_thread_container, NULL);
 	pthread_create(&recipe_t, NULL, pre_process_recipe_thread, NULL);
 
@@ -331,7 +647,7 @@ void do_reorder_upgrade_container() {
 	assert(sync_queue_size(upgrade_chunk_queue) == 0);
 	assert(sync_queue_size(hash_queue) == 0);
 	pthread_join(read_t, NULL);
-	pthread_join(hash_t, NULL);
+	stop_sha256_container_workers();
 	pthread_join(filter_t, NULL);
 	pthread_join(recipe_t, NULL);
 	wait_append_thread();
@@ -342,20 +658,40 @@ void do_reorder_upgrade_container() {
 }
 
 void do_reorder_upgrade_recipe() {
-	pthread_t read_t, dedup_t, filter_t;
+	pthread_t read_t, prefetch_t, filter_t;
 
 	TIMER_DECLARE(1);
 	TIMER_BEGIN(1);
 	puts("==== upgrade recipe begin ====");
 	jcr.status = JCR_STATUS_RUNNING;
-	upgrade_recipe_queue = sync_queue_new(QUEUE_SIZE);
+	// the optimal cache bounds the reader by its window instead
+	upgrade_recipe_queue = sync_queue_new(
+			destor.upgrade_cache_policy == UPGRADE_CACHE_OPT ? -1 : QUEUE_SIZE);
 	hash_queue = sync_queue_new(QUEUE_SIZE);
 	if (destor.upgrade_similarity) {
 		pthread_create(&read_t, NULL, read_similarity_recipe_thread, (void *)1);
 	} else {
 		pthread_create(&read_t, NULL, read_recipe_batch_thread, NULL);
 	}
-	pthread_create(&dedup_t, NULL, reorder_dedup_thread, NULL);
+	dedup_worker_num = destor.upgrade_dedup_threads > 0 ? destor.upgrade_dedup_threads : 1;
+	if (dedup_worker_num > 1 && (!upgrade_external_cache_concurrent()
+			|| destor.upgrade_cache_policy == UPGRADE_CACHE_OPT)) {
+		WARNING("Concurrent recipe dedup requires 2D relations in the file or RocksDB store and the LRU cache");
+		dedup_worker_num = 1;
+	}
+	dedup_worker_alive = dedup_worker_num;
+	pthread_t *dedup_t = malloc(dedup_worker_num * sizeof(pthread_t));
+
+	int prefetch = init_upgrade_external_stage(destor.upgrade_external_prefetch);
+	SyncQueue *dedup_queue = upgrade_recipe_queue;
+	if (prefetch) {
+		upgrade_prefetch_queue = sync_queue_new(MAX(destor.upgrade_prefetch_depth,
+				dedup_worker_num + 1));
+		pthread_create(&prefetch_t, NULL, prefetch_recipe_thread, NULL);
+		dedup_queue = upgrade_prefetch_queue;
+	}
+	for (int i = 0; i < dedup_worker_num; i++)
+		pthread_create(&dedup_t[i], NULL, reorder_dedup_thread, dedup_queue);
 	pthread_create(&filter_t, NULL, filter_thread_recipe, NULL);
 	
 	wait_jobs_done();
@@ -363,7 +699,13 @@ void do_reorder_upgrade_recipe() {
 	assert(sync_queue_size(upgrade_recipe_queue) == 0);
 	assert(sync_queue_size(hash_queue) == 0);
 	pthread_join(read_t, NULL);
-	pthread_join(dedup_t, NULL);
+	if (prefetch) {
+		pthread_join(prefetch_t, NULL);
+		close_upgrade_external_stage();
+	}
+	for (int i = 0; i < dedup_worker_num; i++)
+		pthread_join(dedup_t[i], NULL);
+	free(dedup_t);
 	pthread_join(filter_t, NULL);
 	TIMER_END(1, jcr.recipe_time);
 }
@@ -421,6 +763,15 @@ void record_args() {
 	WARNING("index_key_value_store %d", destor.index_key_value_store);
 	WARNING("upgrade_external_store %d", destor.upgrade_external_store);
 	WARNING("direct_reads %d", destor.direct_reads);
+	WARNING("upgrade_hash_threads %d", destor.upgrade_hash_threads);
+	WARNING("upgrade_read_depth %d", destor.upgrade_read_depth);
+	WARNING("upgrade_external_prefetch %d", destor.upgrade_external_prefetch);
+	WARNING("upgrade_prefetch_depth %d", destor.upgrade_prefetch_depth);
+	WARNING("upgrade_cache_policy %d %d", destor.upgrade_cache_policy, destor.upgrade_opt_window_size);
+	WARNING("upgrade_dedup_threads %d", destor.upgrade_dedup_threads);
+	WARNING("upgrade_preprocess_threads %d", destor.upgrade_preprocess_threads);
+	WARNING("recipe_format %d", destor.recipe_format);
+	WARNING("hash engine %s", hash_many_engine(HASH_SHA256));
 }
 
 void do_update(int revision, char *path) {
@@ -441,10 +792,10 @@ void do_update(int revision, char *path) {
 		return;
 	}
 	
-	upgrade_recipe_queue = sync_queue_new(QUEUE_SIZE);
-	upgrade_chunk_queue = sync_queue_new(QUEUE_SIZE);
-	pre_dedup_queue = sync_queue_new(QUEUE_SIZE);
-	hash_queue = sync_queue_new(QUEUE_SIZE);
+	upgrade_recipe_queue = sync_queue_new(CHUNK_QUEUE_SIZE);
+	upgrade_chunk_queue = sync_queue_new(CHUNK_QUEUE_SIZE);
+	pre_dedup_queue = sync_queue_new(CHUNK_QUEUE_SIZE);
+	hash_queue = sync_queue_new(CHUNK_QUEUE_SIZE);
 
 	TIMER_DECLARE(1);
 	TIMER_BEGIN(1);
@@ -521,6 +872,7 @@ void end_update() {
 	printf("1. container_time: %.3fs\n", jcr.pre_process_container_time / 1000000);
 	printf("----- read_chunk_time:\t%.3fs\n", jcr.read_chunk_time / 1000000);
 	printf("----- hash_time:\t%.3fs\n", jcr.hash_time / 1000000);
+	print_hash_workers();
 	printf("----- filter_time:\t%.3fs\n", jcr.container_filter_time / 1000000);
 	printf("----- append_time:\t%.3fs\n", jcr.write_time / 1000000);
 	printf("----- pre_recipe_time:\t%.3fs\n", jcr.pre_process_recipe_time / 1000000);
@@ -531,6 +883,7 @@ void end_update() {
 
 	printf("memory_cache_time:\t%.3fs\n", jcr.memory_cache_time / 1000000);
 	printf("external_cache_time:\t%.3fs\n", jcr.external_cache_time / 1000000);
+	printf("external_prefetch_time:\t%.3fs\n", jcr.external_prefetch_time / 1000000);
 	printf("external_cache_lookup:\t%" PRId32 "\n", upgrade_index_overhead.kvstore_lookup_requests);
 
 	char logfile[] = "log/update.log";
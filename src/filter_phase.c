@@ -13,6 +13,11 @@
 
 static pthread_t filter_t;
 static int64_t chunk_num;
+/* compress_queue in backup, rewrite_queue in update */
+static SyncQueue *input_queue;
+/* the dictionary of the current segment, see compress_phase.c */
+static unsigned char *segment_dict;
+static int32_t segment_dict_size;
 extern GHashTable *upgrade_processing;
 extern GHashTable *upgrade_container;
 extern GHashTable *upgrade_storage_buffer;
@@ -111,8 +116,10 @@ static void* filter_thread(void *arg) {
         bv = jcr.bv;
     }
 
+    SyncQueueReader *input = sync_queue_reader_new(input_queue,
+            SYNC_QUEUE_READER_BATCH);
     while (1) {
-        struct chunk* c = sync_queue_pop(rewrite_queue);
+        struct chunk* c = sync_queue_reader_pop(input);
 
         if (c == NULL)
             /* backup job finish */
@@ -123,16 +130,20 @@ static void* filter_thread(void *arg) {
 
         /* segment head */
         assert(CHECK_CHUNK(c, CHUNK_SEGMENT_START));
+        free(segment_dict);
+        segment_dict = c->data;
+        segment_dict_size = c->size;
+        c->data = NULL;
         free_chunk(c);
 
-        c = sync_queue_pop(rewrite_queue);
+        c = sync_queue_reader_pop(input);
         while (!(CHECK_CHUNK(c, CHUNK_SEGMENT_END))) {
             g_sequence_append(s->chunks, c);
             if (!CHECK_CHUNK(c, CHUNK_FILE_START)
                     && !CHECK_CHUNK(c, CHUNK_FILE_END))
                 s->chunk_num++;
 
-            c = sync_queue_pop(rewrite_queue);
+            c = sync_queue_reader_pop(input);
         }
         free_chunk(c);
 
@@ -215,7 +226,10 @@ static void* filter_thread(void *arg) {
                 		storage_buffer.chunks = g_sequence_new(free_chunk);
                 }
 
-                if (container_overflow(storage_buffer.container_buffer, c->size)) {
+                /* compressed with the dictionary of the segment */
+                unsigned char *dict = CHECK_CHUNK(c, CHUNK_COMPRESSED) ? segment_dict : NULL;
+                if (container_dict_overflow(storage_buffer.container_buffer, c->size,
+                        dict, segment_dict_size)) {
 
                     if(destor.index_category[1] == INDEX_CATEGORY_PHYSICAL_LOCALITY){
                         /*
@@ -236,11 +250,18 @@ static void* filter_thread(void *arg) {
                     storage_buffer.container_buffer = create_container();
                 }
 
+                if (dict && add_dict_to_container(storage_buffer.container_buffer,
+                        dict, segment_dict_size)) {
+                    jcr.dict_num++;
+                    jcr.dict_size += segment_dict_size;
+                }
+
                 if(add_chunk_to_container(storage_buffer.container_buffer, c)){
 
                 	struct chunk* wc = new_chunk(0);
                 	memcpy(&wc->fp, &c->fp, sizeof(fingerprint));
                 	wc->id = c->id;
+                	jcr.stored_origin_size += chunk_origin_size(c);
                 	if (!CHECK_CHUNK(c, CHUNK_DUPLICATE)) {
                 		jcr.unique_chunk_num++;
                 		jcr.unique_data_size += c->size;
@@ -307,13 +328,14 @@ static void* filter_thread(void *arg) {
         		cp.id = c->id;
         		assert(cp.id>=0);
         		memcpy(&cp.fp, &c->fp, sizeof(fingerprint));
-        		cp.size = c->size;
+        		/* the recipe keeps the size before compression */
+        		cp.size = chunk_origin_size(c);
         		append_n_chunk_pointers(bv, &cp ,1);
         		r->chunknum++;
-        		r->filesize += c->size;
+        		r->filesize += cp.size;
 
     	    	jcr.chunk_num++;
-	    	    jcr.data_size += c->size;
+	    	    jcr.data_size += cp.size;
 
         	}else{
         		assert(CHECK_CHUNK(c,CHUNK_FILE_END));
@@ -403,6 +425,7 @@ static void* filter_thread(void *arg) {
         }
         write_container_async(storage_buffer.container_buffer);
     }
+    sync_queue_reader_free(input);
 
     /* All files done */
     jcr.status = JCR_STATUS_DONE;
@@ -567,14 +590,18 @@ void start_filter_phase() {
 
     if (job == DESTOR_UPDATE) {
         assert(destor.upgrade_level == UPGRADE_LFU);
+        input_queue = rewrite_queue;
         pthread_create(&filter_t, NULL, filter_thread, NULL);
     } else {
+        input_queue = compress_queue;
         pthread_create(&filter_t, NULL, filter_thread, NULL);
     }
 }
 
 void stop_filter_phase() {
     pthread_join(filter_t, NULL);
+    free(segment_dict);
+    segment_dict = NULL;
     close_har();
 	NOTICE("filter phase stops successfully!");
 
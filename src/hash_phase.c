@@ -1,48 +1,176 @@
 #include "destor.h"
 #include "jcr.h"
 #include "backup.h"
+#include "utils/hash_many.h"
 
 static pthread_t hash_t;
 static int64_t chunk_num;
 
-static void* sha1_thread(void* arg) {
-	char code[41];
-	while (1) {
-		struct chunk* c = sync_queue_pop(chunk_queue);
+/* The number of chunks hashed together by hash_many(). */
+#define HASH_BATCH 64
+/* How long to wait for a full batch, in microseconds. */
+#define HASH_BATCH_WAIT 1000
 
-		if (c == NULL) {
-			sync_queue_term(hash_queue);
-			break;
-		}
+/* A batch of chunks in stream order */
+struct hashBatch {
+	int64_t seq;
+	int n;
+	struct chunk *cks[HASH_BATCH];
+};
+
+/*
+ * With hash-threads > 1, sha1_thread cuts batches and hash workers
+ * hash them in parallel.
+ * The dedup phase needs the stream order, so each worker waits for
+ * the turn of its batch before pushing it into hash_queue.
+ */
+struct hashWorker {
+	pthread_t tid;
+	double hash_time;
+};
 
-		if (CHECK_CHUNK(c, CHUNK_FILE_START) || CHECK_CHUNK(c, CHUNK_FILE_END)) {
-			sync_queue_push(hash_queue, c);
+static struct hashWorker *hash_workers;
+static int hash_worker_alive;
+static SyncQueue *batch_queue;
+static int64_t next_seq;
+static pthread_mutex_t hash_order_mutex;
+static pthread_cond_t hash_order_cond;
+
+static void hash_chunks(struct chunk **cks, int n) {
+	struct hashJob jobs[HASH_BATCH];
+	int i, k = 0;
+	for (i = 0; i < n; i++) {
+		struct chunk *c = cks[i];
+		if (CHECK_CHUNK(c, CHUNK_FILE_START) || CHECK_CHUNK(c, CHUNK_FILE_END))
 			continue;
+		jobs[k].data = c->data;
+		jobs[k].len = c->size;
+		jobs[k].digest = c->fp;
+		k++;
+	}
+	hash_many(jobs, k, HASH_SHA1);
+}
+
+static void push_chunks(struct chunk **cks, int n) {
+	/* hash2code only if the line is logged */
+	int verbose = destor.verbosity <= DESTOR_VERBOSE;
+	char code[41];
+	int i;
+	for (i = 0; i < n; i++) {
+		struct chunk *c = cks[i];
+		if (!CHECK_CHUNK(c, CHUNK_FILE_START) && !CHECK_CHUNK(c, CHUNK_FILE_END)) {
+			if (verbose) {
+				hash2code(c->fp, code);
+				code[40] = 0;
+				VERBOSE("Hash phase: %ldth chunk identified by %s", chunk_num, code);
+			}
+			chunk_num++;
 		}
+	}
+	sync_queue_push_n(hash_queue, (void **) cks, n);
+}
+
+static void hash_batch(struct chunk **batch, int n) {
+	TIMER_DECLARE(1);
+	TIMER_BEGIN(1);
+	hash_chunks(batch, n);
+	TIMER_END(1, jcr.hash_time);
 
+	push_chunks(batch, n);
+}
+
+/*
+ * Chunks are hashed in batches so that hash_many() can interleave them.
+ * A batch is what chunk_queue holds after waiting a little for a full one.
+ */
+static void* sha1_thread(void* arg) {
+	struct chunk *batch[HASH_BATCH];
+	int n;
+	while ((n = sync_queue_pop_n(chunk_queue, (void **) batch, HASH_BATCH,
+			HASH_BATCH, HASH_BATCH_WAIT)))
+		hash_batch(batch, n);
+	sync_queue_term(hash_queue);
+	return NULL;
+}
+
+static void* sha1_worker(void* arg) {
+	struct hashWorker *w = arg;
+	struct hashBatch *b;
+	while ((b = sync_queue_pop(batch_queue))) {
 		TIMER_DECLARE(1);
 		TIMER_BEGIN(1);
-		SHA_CTX ctx;
-		SHA1_Init(&ctx);
-		SHA1_Update(&ctx, c->data, c->size);
-		SHA1_Final(c->fp, &ctx);
-		TIMER_END(1, jcr.hash_time);
+		hash_chunks(b->cks, b->n);
+		TIMER_END(1, w->hash_time);
+
+		pthread_mutex_lock(&hash_order_mutex);
+		while (b->seq != next_seq)
+			pthread_cond_wait(&hash_order_cond, &hash_order_mutex);
+		push_chunks(b->cks, b->n);
+		next_seq++;
+		pthread_cond_broadcast(&hash_order_cond);
+		pthread_mutex_unlock(&hash_order_mutex);
+		free(b);
+	}
 
-		hash2code(c->fp, code);
-		code[40] = 0;
-		VERBOSE("Hash phase: %ldth chunk identified by %s", chunk_num++, code);
+	pthread_mutex_lock(&hash_order_mutex);
+	jcr.hash_time += w->hash_time;
+	if (--hash_worker_alive == 0)
+		sync_queue_term(hash_queue);
+	pthread_mutex_unlock(&hash_order_mutex);
+	return NULL;
+}
 
-		sync_queue_push(hash_queue, c);
+/*
+ * Cut the chunk stream into numbered batches for the hash workers,
+ * as sha1_thread does.
+ */
+static void* batch_thread(void* arg) {
+	int64_t seq = 0;
+	while (1) {
+		struct hashBatch *b = malloc(sizeof(struct hashBatch));
+		b->n = sync_queue_pop_n(chunk_queue, (void **) b->cks, HASH_BATCH,
+				HASH_BATCH, HASH_BATCH_WAIT);
+		if (b->n == 0) {
+			free(b);
+			break;
+		}
+		b->seq = seq++;
+		sync_queue_push(batch_queue, b);
 	}
+	sync_queue_term(batch_queue);
 	return NULL;
 }
 
 void start_hash_phase() {
 	hash_queue = sync_queue_new(100);
-	pthread_create(&hash_t, NULL, sha1_thread, NULL);
+	if (destor.hash_threads > 1) {
+		NOTICE("hash phase: %d threads", destor.hash_threads);
+		batch_queue = sync_queue_new(destor.hash_threads * 2);
+		next_seq = 0;
+		hash_worker_alive = destor.hash_threads;
+		pthread_mutex_init(&hash_order_mutex, NULL);
+		pthread_cond_init(&hash_order_cond, NULL);
+		hash_workers = calloc(destor.hash_threads, sizeof(struct hashWorker));
+		int i;
+		for (i = 0; i < destor.hash_threads; i++)
+			pthread_create(&hash_workers[i].tid, NULL, sha1_worker, &hash_workers[i]);
+		pthread_create(&hash_t, NULL, batch_thread, NULL);
+	} else {
+		pthread_create(&hash_t, NULL, sha1_thread, NULL);
+	}
 }
 
 void stop_hash_phase() {
 	pthread_join(hash_t, NULL);
+	if (hash_workers) {
+		int i;
+		for (i = 0; i < destor.hash_threads; i++)
+			pthread_join(hash_workers[i].tid, NULL);
+		free(hash_workers);
+		hash_workers = NULL;
+		sync_queue_free(batch_queue, NULL);
+		pthread_mutex_destroy(&hash_order_mutex);
+		pthread_cond_destroy(&hash_order_cond);
+	}
 	NOTICE("hash phase stops successfully!");
 }
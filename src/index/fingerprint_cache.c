@@ -9,48 +9,113 @@
 #include "../storage/containerstore.h"
 #include "../storage/db.h"
 #include "../recipe/recipestore.h"
-#include "../utils/lru_cache.h"
 #include "fingerprint_cache.h"
 
-static struct lruCache* lru_queue;
+/* Cached containers or segments, keyed by their ids */
+static struct hashedCache* lru_queue;
+/*
+ * Map a fingerprint to the cached units holding it (GSList),
+ * the most recently prefetched one first.
+ * The key is the fingerprint in the first unit.
+ */
+static GHashTable* fp_table;
 /* defined in index.c */
 extern struct index_overhead index_overhead;
 
+static inline GHashTable* unit_map(void *unit) {
+	if (destor.index_category[1] == INDEX_CATEGORY_PHYSICAL_LOCALITY)
+		return ((struct containerMeta*) unit)->map;
+	return ((struct segmentRecipe*) unit)->kvpairs;
+}
+
+static inline int64_t* unit_id(void *unit) {
+	if (destor.index_category[1] == INDEX_CATEGORY_PHYSICAL_LOCALITY)
+		return &((struct containerMeta*) unit)->id;
+	return &((struct segmentRecipe*) unit)->id;
+}
+
+static void add_unit(void *unit) {
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, unit_map(unit));
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		GSList *units = g_hash_table_lookup(fp_table, key);
+		g_hash_table_replace(fp_table, key, g_slist_prepend(units, unit));
+	}
+}
+
+static void remove_unit(void *unit) {
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, unit_map(unit));
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		GSList *units = g_hash_table_lookup(fp_table, key);
+		units = g_slist_remove(units, unit);
+		if (!units) {
+			g_hash_table_remove(fp_table, key);
+		} else {
+			/* The key may belong to the unit, borrow one from another holder */
+			gpointer other;
+			g_hash_table_lookup_extended(unit_map(units->data), key, &other, NULL);
+			g_hash_table_replace(fp_table, other, units);
+		}
+	}
+}
+
+static void evict_unit(void *unit) {
+	remove_unit(unit);
+	if (destor.index_category[1] == INDEX_CATEGORY_PHYSICAL_LOCALITY)
+		free_container_meta(unit);
+	else
+		free_segment_recipe(unit);
+}
+
+static void insert_unit(void *unit) {
+	add_unit(unit);
+	hashed_cache_insert(lru_queue, unit, unit_id(unit), 1);
+}
+
 void init_fingerprint_cache(){
 	switch(destor.index_category[1]){
 	case INDEX_CATEGORY_PHYSICAL_LOCALITY:
-		lru_queue = new_lru_cache(destor.index_cache_size,
-				free_container_meta, lookup_fingerprint_in_container_meta);
+		lru_queue = new_hashed_cache(destor.cache_policy,
+				destor.index_cache_size, offsetof(struct containerMeta, node),
+				g_int64_hash, g_int64_equal, evict_unit);
 		break;
 	case INDEX_CATEGORY_LOGICAL_LOCALITY:
-		lru_queue = new_lru_cache(destor.index_cache_size,
-				free_segment_recipe, lookup_fingerprint_in_segment_recipe);
+		lru_queue = new_hashed_cache(destor.cache_policy,
+				destor.index_cache_size, offsetof(struct segmentRecipe, node),
+				g_int64_hash, g_int64_equal, evict_unit);
 		break;
 	default:
 		WARNING("Invalid index category!");
 		exit(1);
 	}
+	fp_table = g_hash_table_new(g_int64_hash, g_fingerprint_equal);
 }
 
 int64_t fingerprint_cache_lookup(fingerprint *fp){
+	GSList *units = g_hash_table_lookup(fp_table, fp);
+	if (!units)
+		return TEMPORARY_ID;
+
+	void *unit = units->data;
+	/* keep the recency of the unit */
+	hashed_cache_lookup(lru_queue, unit_id(unit));
+
 	switch(destor.index_category[1]){
 		case INDEX_CATEGORY_PHYSICAL_LOCALITY:{
-			struct containerMeta* cm = lru_cache_lookup(lru_queue, fp);
-			if (cm)
-				return cm->id;
-			break;
+			struct containerMeta* cm = unit;
+			return cm->id;
 		}
 		case INDEX_CATEGORY_LOGICAL_LOCALITY:{
-			struct segmentRecipe* sr = lru_cache_lookup(lru_queue, fp);
-			if(sr){
-				struct chunkPointer* cp = g_hash_table_lookup(sr->kvpairs, fp);
-				if(cp->id <= TEMPORARY_ID){
-					WARNING("expect > TEMPORARY_ID, but being %lld", cp->id);
-					assert(cp->id > TEMPORARY_ID);
-				}
-				return cp->id;
+			struct segmentRecipe* sr = unit;
+			struct chunkPointer* cp = g_hash_table_lookup(sr->kvpairs, fp);
+			if(cp->id <= TEMPORARY_ID){
+				WARNING("expect > TEMPORARY_ID, but being %lld", cp->id);
+				assert(cp->id > TEMPORARY_ID);
 			}
-			break;
+			return cp->id;
 		}
 	}
 
@@ -60,10 +125,13 @@ int64_t fingerprint_cache_lookup(fingerprint *fp){
 void fingerprint_cache_prefetch(int64_t id){
 	switch(destor.index_category[1]){
 		case INDEX_CATEGORY_PHYSICAL_LOCALITY:{
+			if (hashed_cache_lookup(lru_queue, &id))
+				/* Already in cache */
+				break;
 			struct containerMeta * cm = retrieve_container_meta_by_id(id);
 			index_overhead.read_prefetching_units++;
 			if (cm) {
-				lru_cache_insert(lru_queue, cm, NULL, NULL);
+				insert_unit(cm);
 			} else{
 				WARNING("Error! The container %lld has not been written!", id);
 				exit(1);
@@ -71,8 +139,7 @@ void fingerprint_cache_prefetch(int64_t id){
 			break;
 		}
 		case INDEX_CATEGORY_LOGICAL_LOCALITY:{
-			if (!lru_cache_hits(lru_queue, &id,
-					segment_recipe_check_id)){
+			if (!hashed_cache_lookup(lru_queue, &id)){
 				/*
 				 * If the segment we need is already in cache,
 				 * we do not need to read it.
@@ -86,9 +153,8 @@ void fingerprint_cache_prefetch(int64_t id){
 				struct segmentRecipe* sr;
 				while ((sr = g_queue_pop_tail(segments))) {
 					/* From tail to head */
-					if (!lru_cache_hits(lru_queue, &sr->id,
-							segment_recipe_check_id)) {
-						lru_cache_insert(lru_queue, sr, NULL, NULL);
+					if (!hashed_cache_lookup(lru_queue, &sr->id)) {
+						insert_unit(sr);
 					} else {
 						/* Already in cache */
 						free_segment_recipe(sr);
@@ -1,19 +1,43 @@
 #include "upgrade_cache.h"
 #include "index.h"
-#include "../utils/lru_cache.h"
 #include "../storage/containerstore.h"
 #include "../storage/rocks.h"
 #include "../jcr.h"
 
 extern struct index_overhead index_overhead;
+extern upgrade_lock_t upgrade_index_lock;
 struct index_overhead upgrade_index_overhead;
 GHashTable *upgrade_processing;
 GHashTable *upgrade_container;
 GHashTable *upgrade_storage_buffer = NULL; // 确保当前在storage_buffer中的container不会被LRU踢出
 containerid upgrade_storage_buffer_id = -1;
 
-static struct lruCache* upgrade_lru_queue;
-static lruHashMap_t *upgrade_cache;
+/* the 1D cache */
+static struct hashedCache *upgrade_cache;
+
+/*
+ * The LRU cache of 2D tables is split by container id into shards,
+ * each with its own lock and a part of index_cache_size, so dedup
+ * workers looking up different containers do not wait on each other.
+ * There is one shard, a plain LRU, without concurrent dedup workers.
+ */
+#define UPGRADE_CACHE_SHARDS 16
+
+typedef struct {
+    pthread_mutex_t mutex;
+    struct hashedCache *cache;
+    /* containers being read from the external cache by a dedup worker */
+    GHashTable *fetching;
+    pthread_cond_t fetched;
+} upgradeShard_t;
+
+static upgradeShard_t *upgrade_shards;
+static int upgrade_shard_num;
+
+static void init_upgrade_opt_cache();
+static void init_upgrade_table_cache();
+static void close_upgrade_table_cache();
+static void upgrade_opt_cache_access(containerid id);
 
 void init_upgrade_index() {
     init_upgrade_external_cache();
@@ -21,10 +45,10 @@ void init_upgrade_index() {
         init_upgrade_1D_fingerprint_cache();
         return;
     }
-	if (destor.fake_containers) {
-		upgrade_cache = new_lru_hashmap(destor.index_cache_size - 1, NULL, g_int64_hash, g_int64_equal);
+	if (destor.upgrade_cache_policy == UPGRADE_CACHE_OPT) {
+		init_upgrade_opt_cache();
 	} else {
-		upgrade_cache = new_lru_hashmap(destor.index_cache_size - 1, g_hash_table_destroy, g_int64_hash, g_int64_equal);
+		init_upgrade_table_cache();
 	}
     
     upgrade_processing = g_hash_table_new_full(g_int64_hash, g_int64_equal, free, NULL);
@@ -41,6 +65,8 @@ void close_upgrade_index() {
     assert(g_hash_table_size(upgrade_processing) == 0);
     g_hash_table_destroy(upgrade_processing);
     g_hash_table_destroy(upgrade_container);
+    if (destor.upgrade_cache_policy != UPGRADE_CACHE_OPT)
+        close_upgrade_table_cache();
 }
 
 /**
@@ -104,6 +130,105 @@ void upgrade_index_lookup_1D(struct chunk *c){
     }
 }
 
+/*
+ * Batched 1D lookup of the chunks of a recipe unit.
+ * Cache misses go to RocksDB in one multiget; a fingerprint that
+ * occurs several times in the batch is fetched once and the later
+ * occurrences count as cache hits, as in the per-chunk lookup.
+ */
+static void upgrade_index_lookup_1D_n(struct chunk *cks, int n) {
+    struct chunk **misses = malloc(n * sizeof(struct chunk *));
+    int *first = malloc(n * sizeof(int));
+    int miss_num = 0;
+    GHashTable *batch = g_hash_table_new(g_feature_hash, g_feature_equal);
+
+    TIMER_DECLARE(1);
+    TIMER_BEGIN(1);
+    for (int i = 0; i < n; i++) {
+        struct chunk *c = cks + i;
+        if (CHECK_CHUNK(c, CHUNK_FILE_START) || CHECK_CHUNK(c, CHUNK_FILE_END))
+            continue;
+        upgrade_index_overhead.index_lookup_requests++;
+        if (CHECK_CHUNK(c, CHUNK_DUPLICATE))
+            continue;
+
+        upgrade_index_value_t* v = upgrade_1D_fingerprint_cache_lookup(&c->old_fp);
+        upgrade_index_overhead.cache_lookup_requests++;
+        if (v) {
+            upgrade_index_overhead.cache_hits++;
+            c->id = v->id;
+            memcpy(&c->fp, &v->fp, sizeof(fingerprint));
+            SET_CHUNK(c, CHUNK_DUPLICATE);
+            continue;
+        }
+        gpointer prev = g_hash_table_lookup(batch, &c->old_fp);
+        /* the index of the first miss is stored +1 */
+        first[miss_num] = prev ? GPOINTER_TO_INT(prev) - 1 : -1;
+        if (!prev)
+            g_hash_table_insert(batch, &c->old_fp, GINT_TO_POINTER(miss_num + 1));
+        misses[miss_num++] = c;
+    }
+    TIMER_END(1, jcr.memory_cache_time);
+
+    TIMER_BEGIN(1);
+    int key_num = 0;
+    char **keys = malloc(miss_num * sizeof(char *));
+    size_t *keySizes = malloc(miss_num * sizeof(size_t));
+    char **values = malloc(miss_num * sizeof(char *));
+    size_t *valueSizes = malloc(miss_num * sizeof(size_t));
+    int *slot = malloc(miss_num * sizeof(int));
+    for (int i = 0; i < miss_num; i++) {
+        if (first[i] >= 0)
+            continue;
+        slot[i] = key_num;
+        keys[key_num] = (char *)&misses[i]->old_fp;
+        keySizes[key_num] = sizeof(fingerprint);
+        key_num++;
+    }
+    if (key_num > 0)
+        multiget_RocksDB(DB_UPGRADE, key_num, keys, keySizes, values, valueSizes);
+    upgrade_index_overhead.kvstore_lookup_requests += key_num;
+
+    for (int i = 0; i < miss_num; i++) {
+        struct chunk *c = misses[i];
+        upgrade_index_value_t *v;
+        if (first[i] >= 0) {
+            v = (upgrade_index_value_t *)values[slot[first[i]]];
+            if (v)
+                upgrade_index_overhead.cache_hits++;
+            else
+                upgrade_index_overhead.kvstore_lookup_requests++;
+        } else {
+            v = (upgrade_index_value_t *)values[slot[i]];
+            if (v) {
+                assert(valueSizes[slot[i]] == sizeof(upgrade_index_value_t));
+                upgrade_index_overhead.kvstore_hits++;
+                upgrade_index_overhead.read_prefetching_units++;
+                upgrade_1D_fingerprint_cache_insert(&c->old_fp, v);
+            }
+        }
+        if (v) {
+            c->id = v->id;
+            memcpy(&c->fp, &v->fp, sizeof(fingerprint));
+            SET_CHUNK(c, CHUNK_DUPLICATE);
+        } else {
+            upgrade_index_overhead.lookup_requests_for_unique++;
+            VERBOSE("upgrade_index_lookup_1D: non-existing fingerprint");
+        }
+    }
+    for (int i = 0; i < key_num; i++)
+        free(values[i]);
+    TIMER_END(1, jcr.external_cache_time);
+
+    g_hash_table_destroy(batch);
+    free(misses);
+    free(first);
+    free(keys);
+    free(keySizes);
+    free(values);
+    free(valueSizes);
+    free(slot);
+}
 
 /**
  * 2D
@@ -128,13 +253,13 @@ void _upgrade_dedup_buffer(struct chunk *c, struct index_overhead *stats) {
     if (upgrade_storage_buffer) {
         v = g_hash_table_lookup(upgrade_storage_buffer, &c->old_fp);
     }
-    if (!v) {
-        v = upgrade_fingerprint_cache_lookup(c);
-    }
-    if(v){
+    if (v) {
         stats->cache_hits++;
         copy_value_to_chunk(v, c);
         SET_CHUNK(c, CHUNK_DUPLICATE);
+    } else if (upgrade_fingerprint_cache_lookup(c)) {
+        stats->cache_hits++;
+        SET_CHUNK(c, CHUNK_DUPLICATE);
     }
 }
 
@@ -143,14 +268,13 @@ void _upgrade_dedup_external(struct chunk *c, struct index_overhead *stats) {
 
     stats->kvstore_lookup_requests++;
     int ret;
-    ret = upgrade_external_cache_prefetch(c->id);
+    ret = upgrade_external_cache_fetch(c->id);
 
     if (ret) {
         stats->kvstore_hits++;
         stats->read_prefetching_units++;
-        upgrade_index_value_t* v = upgrade_fingerprint_cache_lookup(c);
-        assert(v);
-        copy_value_to_chunk(v, c);
+        int found = upgrade_fingerprint_cache_lookup(c);
+        assert(found);
         SET_CHUNK(c, CHUNK_DUPLICATE);
     }
 }
@@ -161,6 +285,9 @@ void upgrade_index_lookup_2D(struct chunk *c, struct index_overhead *stats) {
 
     stats->index_lookup_requests++;
 
+    if (destor.upgrade_cache_policy == UPGRADE_CACHE_OPT)
+        upgrade_opt_cache_access(c->id);
+
     TIMER_DECLARE(1);
     TIMER_BEGIN(1);
     _upgrade_dedup_buffer(c, stats);
@@ -205,44 +332,435 @@ int upgrade_index_lookup(struct chunk* c) {
     return 1;
 }
 
+/*
+ * Look up the n chunks of a recipe unit.
+ * The 1D index batches its RocksDB requests; the 2D index is per chunk.
+ */
+void upgrade_index_lookup_n(struct chunk *cks, int n) {
+    if (destor.upgrade_relation_level != 1) {
+        for (int i = 0; i < n; i++)
+            upgrade_index_lookup(cks + i);
+        return;
+    }
+
+    TIMER_DECLARE(1);
+    TIMER_BEGIN(1);
+    upgrade_index_lookup_1D_n(cks, n);
+    TIMER_END(1, jcr.pre_dedup_time);
+}
+
+
+/**
+ * Per-container mapping old_fp -> (new id, new fp), in one allocation:
+ * the header, the distinct new ids, the probe slots, then the rows.
+ * A row keeps the full old_fp with the new fp, one cache line.
+ * A slot keeps the upper half of the first 8 bytes of old_fp as a check,
+ * the index of the row (+1, 0 means empty) and the index of the new id,
+ * so a lookup touches one slot and, on a hit, one row, whose old_fp is
+ * always compared in full.
+ * old_fp is a hash, so its first 8 bytes need no further mixing.
+*/
+#define UPGRADE_ROW_ALIGN 64
+
+typedef struct {
+    uint32_t check;
+    uint16_t row;
+    uint16_t idx;
+} upgradeSlot_t;
+
+typedef struct {
+    fingerprint old_fp;
+    fingerprint fp;
+} upgradeRow_t;
+
+typedef struct {
+    struct cacheNode node;
+    containerid id;
+    /* the bytes of the allocation, charged to the cache */
+    int64_t bytes;
+    uint32_t size;
+    uint32_t mask;
+    containerid *ids;
+    upgradeSlot_t *slots;
+    upgradeRow_t *rows;
+} upgradeTable_t;
+
+static void init_upgrade_table_cache() {
+    upgrade_shard_num = destor.upgrade_dedup_threads > 1
+            && upgrade_external_cache_concurrent() ? UPGRADE_CACHE_SHARDS : 1;
+    upgrade_shards = calloc(upgrade_shard_num, sizeof(upgradeShard_t));
+    for (int i = 0; i < upgrade_shard_num; i++) {
+        upgradeShard_t *s = &upgrade_shards[i];
+        pthread_mutex_init(&s->mutex, NULL);
+        pthread_cond_init(&s->fetched, NULL);
+        s->cache = new_hashed_cache(destor.cache_policy,
+                destor.index_cache_size / upgrade_shard_num,
+                offsetof(upgradeTable_t, node), g_int64_hash, g_int64_equal, free);
+        s->fetching = g_hash_table_new_full(g_int64_hash, g_int64_equal, free, NULL);
+    }
+}
+
+static void close_upgrade_table_cache() {
+    for (int i = 0; i < upgrade_shard_num; i++) {
+        upgradeShard_t *s = &upgrade_shards[i];
+        assert(g_hash_table_size(s->fetching) == 0);
+        g_hash_table_destroy(s->fetching);
+        free_hashed_cache(s->cache);
+        pthread_mutex_destroy(&s->mutex);
+        pthread_cond_destroy(&s->fetched);
+    }
+    free(upgrade_shards);
+    upgrade_shards = NULL;
+}
+
+static upgradeShard_t* upgrade_shard_of(containerid id) {
+    return &upgrade_shards[id % upgrade_shard_num];
+}
+
+static inline uint64_t upgrade_table_tag(const void *fp) {
+    uint64_t tag;
+    memcpy(&tag, fp, sizeof(uint64_t));
+    return tag;
+}
+
+static upgradeTable_t* upgrade_table_new(upgrade_index_kv_t *buf, int size) {
+    containerid *ids = malloc((size ? size : 1) * sizeof(containerid));
+    uint16_t *idx = malloc((size ? size : 1) * sizeof(uint16_t));
+    int id_num = 0;
+    for (int i = 0; i < size; i++) {
+        int k = id_num - 1;
+        /* the chunks of a container mostly go to a few new containers */
+        while (k >= 0 && ids[k] != buf[i].value.id)
+            k--;
+        if (k < 0) {
+            k = id_num;
+            ids[id_num++] = buf[i].value.id;
+        }
+        idx[i] = k;
+    }
+    assert(size < UINT16_MAX);
+    uint32_t cap = 4;
+    while (cap < (uint32_t)size * 2) // load factor <= 0.5
+        cap <<= 1;
+
+    int64_t rows_off = sizeof(upgradeTable_t) + id_num * sizeof(containerid)
+            + cap * sizeof(upgradeSlot_t);
+    rows_off = (rows_off + UPGRADE_ROW_ALIGN - 1) & ~(int64_t)(UPGRADE_ROW_ALIGN - 1);
+    int64_t bytes = rows_off + (int64_t)size * sizeof(upgradeRow_t);
+    upgradeTable_t *t;
+    if (posix_memalign((void **)&t, UPGRADE_ROW_ALIGN, bytes)) {
+        perror("Can not allocate the upgrade table");
+        exit(1);
+    }
+    t->bytes = bytes;
+    t->size = size;
+    t->mask = cap - 1;
+    t->ids = (containerid *)(t + 1);
+    t->slots = (upgradeSlot_t *)(t->ids + id_num);
+    t->rows = (upgradeRow_t *)((unsigned char *)t + rows_off);
+    memcpy(t->ids, ids, id_num * sizeof(containerid));
+    memset(t->slots, 0, cap * sizeof(upgradeSlot_t));
+
+    for (int i = 0; i < size; i++) {
+        uint64_t tag = upgrade_table_tag(buf[i].old_fp);
+        uint32_t h = tag & t->mask;
+        while (t->slots[h].row)
+            h = (h + 1) & t->mask;
+        t->slots[h].check = tag >> 32;
+        t->slots[h].row = i + 1;
+        t->slots[h].idx = idx[i];
+        memcpy(t->rows[i].old_fp, buf[i].old_fp, sizeof(fingerprint));
+        memcpy(t->rows[i].fp, buf[i].value.fp, sizeof(fingerprint));
+    }
+    free(ids);
+    free(idx);
+    return t;
+}
+
+/*
+ * Find old_fp in t and copy its new id and fingerprint into c.
+ * Return 0 if it is not in t.
+ */
+static int upgrade_table_lookup(upgradeTable_t *t, fingerprint *fp, struct chunk *c) {
+    uint64_t tag = upgrade_table_tag(fp);
+    uint32_t check = tag >> 32;
+    for (uint32_t h = tag & t->mask; t->slots[h].row; h = (h + 1) & t->mask) {
+        upgradeSlot_t *slot = &t->slots[h];
+        if (slot->check != check)
+            continue;
+        upgradeRow_t *r = &t->rows[slot->row - 1];
+        if (memcmp(r->old_fp, fp, sizeof(fingerprint)) == 0) {
+            c->id = t->ids[slot->idx];
+            memcpy(&c->fp, r->fp, sizeof(fingerprint));
+            return 1;
+        }
+    }
+    return 0;
+}
 
 /**
  * Upgrade fingerprint cache
- * LRU of GHashTable(old_fp, upgrade_index_value_t)
+ * LRU of upgradeTable_t(old_fp, upgrade_index_value_t)
 */
 
-int compare_upgrade_index_value(GHashTable **htb, fingerprint *old_fp) {
-	return g_hash_table_lookup(*htb, old_fp) != NULL;
+/**
+ * Optimal (Belady) replacement of the upgrade fingerprint cache.
+ * The recipe reader announces the container accesses of every unit
+ * before sending it (upgrade_cache_announce), and the dedup thread
+ * consumes them in the same order, so the future accesses in the
+ * window are exactly known. Consecutive accesses to the same container
+ * count once, as in optimal_restore.c.
+ * When the cache is full, the cached container whose next access is
+ * furthest away (or never in the window) is kicked.
+ * The cached containers are kept in a GSequence sorted by their next
+ * access, which is repositioned whenever that access changes, so a kick
+ * takes the last one instead of scanning the cache.
+ * The announced accesses are bounded by upgrade_opt_window_size;
+ * the reader waits while the window is full.
+ */
+typedef struct {
+    containerid id;
+    void *value;
+    int64_t size;
+    /* the sequence number of the next access, INT64_MAX if none */
+    int64_t next;
+    GSequenceIter *iter;
+} upgradeCached_t;
+
+static struct {
+    /*
+     * containerid -> upgradeCached_t, written by the dedup thread
+     * with the mutex held, since the reader updates the order
+     */
+    GHashTable *cached;
+    /* upgradeCached_t sorted by next access */
+    GSequence *order;
+    int64_t size;
+    int64_t max_size;
+
+    /* containerid -> GQueue of sequence numbers, shared with the reader */
+    GHashTable *future;
+    int64_t next_seqno;
+    int64_t buffered;
+    containerid last_announced;
+    containerid last_accessed;
+    pthread_mutex_t mutex;
+    pthread_cond_t window;
+} opt_cache;
+
+static void free_upgrade_cached(void *p) {
+    upgradeCached_t *e = p;
+    if (!destor.fake_containers)
+        free(e->value);
+    free(e);
+}
+
+static void free_future_accesses(void *q) {
+    assert(g_queue_get_length(q) == 0);
+    g_queue_free(q);
+}
+
+static gint upgrade_cached_cmp(gconstpointer a, gconstpointer b, gpointer data) {
+    const upgradeCached_t *ea = a, *eb = b;
+    if (ea->next != eb->next)
+        return ea->next < eb->next ? -1 : 1;
+    if (ea->id != eb->id)
+        return ea->id < eb->id ? -1 : 1;
+    return 0;
+}
+
+static void init_upgrade_opt_cache() {
+    opt_cache.cached = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, free_upgrade_cached);
+    opt_cache.order = g_sequence_new(NULL);
+    opt_cache.size = 0;
+    opt_cache.max_size = destor.index_cache_size;
+    opt_cache.future = g_hash_table_new_full(g_int64_hash, g_int64_equal, free, free_future_accesses);
+    opt_cache.next_seqno = 0;
+    opt_cache.buffered = 0;
+    opt_cache.last_announced = TEMPORARY_ID;
+    opt_cache.last_accessed = TEMPORARY_ID;
+    pthread_mutex_init(&opt_cache.mutex, NULL);
+    pthread_cond_init(&opt_cache.window, NULL);
+}
+
+/* The next access of container id, called with the mutex held. */
+static int64_t upgrade_opt_next_access(containerid id) {
+    GQueue *q = g_hash_table_lookup(opt_cache.future, &id);
+    return q ? (int64_t)GPOINTER_TO_SIZE(g_queue_peek_head(q)) : INT64_MAX;
+}
+
+/* Reposition container id after its next access changed, with the mutex held. */
+static void upgrade_opt_reorder(containerid id) {
+    upgradeCached_t *e = g_hash_table_lookup(opt_cache.cached, &id);
+    if (!e)
+        return;
+    e->next = upgrade_opt_next_access(id);
+    g_sequence_sort_changed(e->iter, upgrade_cached_cmp, NULL);
+}
+
+/*
+ * Called by the recipe reader before a unit is sent.
+ */
+void upgrade_cache_announce(struct chunk *cks, int n) {
+    if (destor.upgrade_cache_policy != UPGRADE_CACHE_OPT)
+        return;
+
+    pthread_mutex_lock(&opt_cache.mutex);
+    while (opt_cache.buffered >= destor.upgrade_opt_window_size)
+        pthread_cond_wait(&opt_cache.window, &opt_cache.mutex);
+    for (int i = 0; i < n; i++) {
+        containerid id = cks[i].id;
+        if (id == opt_cache.last_announced)
+            continue;
+        opt_cache.last_announced = id;
+
+        GQueue *q = g_hash_table_lookup(opt_cache.future, &id);
+        int first = !q;
+        if (!q) {
+            containerid *key = malloc(sizeof(containerid));
+            *key = id;
+            q = g_queue_new();
+            g_hash_table_insert(opt_cache.future, key, q);
+        }
+        g_queue_push_tail(q, GSIZE_TO_POINTER(opt_cache.next_seqno++));
+        opt_cache.buffered++;
+        /* the container was never accessed again in the window */
+        if (first)
+            upgrade_opt_reorder(id);
+    }
+    pthread_mutex_unlock(&opt_cache.mutex);
+}
+
+/*
+ * The window slides when the dedup thread moves to another container.
+ */
+static void upgrade_opt_cache_access(containerid id) {
+    if (id == opt_cache.last_accessed)
+        return;
+    opt_cache.last_accessed = id;
+
+    pthread_mutex_lock(&opt_cache.mutex);
+    GQueue *q = g_hash_table_lookup(opt_cache.future, &id);
+    assert(q && !g_queue_is_empty(q));
+    g_queue_pop_head(q);
+    if (g_queue_is_empty(q))
+        g_hash_table_remove(opt_cache.future, &id);
+    upgrade_opt_reorder(id);
+    if (--opt_cache.buffered < destor.upgrade_opt_window_size)
+        pthread_cond_signal(&opt_cache.window);
+    pthread_mutex_unlock(&opt_cache.mutex);
 }
 
-upgrade_index_value_t* upgrade_fingerprint_cache_lookup(struct chunk* c) {
-	GHashTable *htb = lru_hashmap_lookup(upgrade_cache, &c->id);
-	if (htb) {
-		if (destor.fake_containers) return (upgrade_index_value_t*)1;
-		
-		upgrade_index_value_t* v = g_hash_table_lookup(htb, &c->old_fp);
-		assert(v);
-		return v;
+/* Drop a cached container, with the mutex held. */
+static void upgrade_opt_cache_remove(upgradeCached_t *e) {
+    opt_cache.size -= e->size;
+    g_sequence_remove(e->iter);
+    g_hash_table_remove(opt_cache.cached, &e->id);
+}
+
+static void upgrade_opt_cache_insert(containerid id, void *value, int64_t size) {
+    pthread_mutex_lock(&opt_cache.mutex);
+    upgradeCached_t *old = g_hash_table_lookup(opt_cache.cached, &id);
+    if (old)
+        upgrade_opt_cache_remove(old);
+    /* kick the container accessed furthest in the future */
+    while (opt_cache.max_size > 0 && g_hash_table_size(opt_cache.cached) > 0
+            && opt_cache.size + size > opt_cache.max_size) {
+        GSequenceIter *last = g_sequence_iter_prev(g_sequence_get_end_iter(opt_cache.order));
+        upgrade_opt_cache_remove(g_sequence_get(last));
+    }
+
+    upgradeCached_t *e = malloc(sizeof(upgradeCached_t));
+    e->id = id;
+    e->value = value;
+    e->size = size;
+    e->next = upgrade_opt_next_access(id);
+    e->iter = g_sequence_insert_sorted(opt_cache.order, e, upgrade_cached_cmp, NULL);
+    opt_cache.size += size;
+    g_hash_table_insert(opt_cache.cached, &e->id, e);
+    pthread_mutex_unlock(&opt_cache.mutex);
+}
+
+/* Check whether container id is cached, without touching the LRU order. */
+int upgrade_fingerprint_cache_contains(containerid id) {
+	if (destor.upgrade_cache_policy == UPGRADE_CACHE_OPT)
+		return g_hash_table_contains(opt_cache.cached, &id);
+	upgradeShard_t *s = upgrade_shard_of(id);
+	pthread_mutex_lock(&s->mutex);
+	int ret = hashed_cache_peek(s->cache, &id) != NULL;
+	pthread_mutex_unlock(&s->mutex);
+	return ret;
+}
+
+/* Copy the new id and fingerprint of c from a cached table t. */
+static int upgrade_table_copy(upgradeTable_t *t, struct chunk *c) {
+	if (!t)
+		return 0;
+	if (destor.fake_containers) {
+		c->id = 1;
+		memcpy(&c->fp, &c->old_fp, sizeof(fingerprint));
+		return 1;
 	}
-	return NULL;
+	/* c came from container c->id, so a miss means its table lost c */
+	int found = upgrade_table_lookup(t, &c->old_fp, c);
+	assert(found);
+	return 1;
 }
 
-void upgrade_fingerprint_cache_insert(containerid id, GHashTable *htb) {
-    // 插入in-memory cache, 被LRU淘汰的会插入external cache
-	containerid *id_p = malloc(sizeof(containerid));
-	*id_p = id;
-    void *key = NULL, *value = NULL;
+/* Look up c in shard s, which is locked. */
+static int upgrade_shard_lookup(upgradeShard_t *s, struct chunk *c) {
+	return upgrade_table_copy(hashed_cache_lookup(s->cache, &c->id), c);
+}
+
+/*
+ * Copy the new id and fingerprint of c from the cached container c->id.
+ * Return 0 if the container is not cached.
+ */
+int upgrade_fingerprint_cache_lookup(struct chunk* c) {
+	if (destor.upgrade_cache_policy == UPGRADE_CACHE_OPT) {
+		upgradeCached_t *e = g_hash_table_lookup(opt_cache.cached, &c->id);
+		return upgrade_table_copy(e ? e->value : NULL, c);
+	}
+	upgradeShard_t *s = upgrade_shard_of(c->id);
+	pthread_mutex_lock(&s->mutex);
+	int ret = upgrade_shard_lookup(s, c);
+	pthread_mutex_unlock(&s->mutex);
+	return ret;
+}
 
-    size_t size = g_hash_table_size(htb) * UPGRADE_KV_SIZE;
+/* Insert the table of container id into shard s, which is locked. */
+static void upgrade_shard_insert(upgradeShard_t *s, containerid id, upgradeTable_t *t) {
+	int64_t size = t->bytes;
 	if (destor.fake_containers) {
-		g_hash_table_destroy(htb);
-        lru_hashmap_insert(upgrade_cache, id_p, "1", size);
-	} else {
-        lru_hashmap_insert(upgrade_cache, id_p, htb, size);
+		/* only the presence matters */
+		free(t);
+		t = upgrade_table_new(NULL, 0);
 	}
+	t->id = id;
+	hashed_cache_insert(s->cache, t, &t->id, size);
+}
+
+static void upgrade_fingerprint_cache_insert_table(containerid id, upgradeTable_t *t) {
+    // 插入in-memory cache, 被LRU淘汰的会插入external cache
+
+    // the cache is charged the bytes of the table, also when it only simulates them
+    int64_t size = t->bytes;
+	if (destor.upgrade_cache_policy == UPGRADE_CACHE_OPT) {
+		if (destor.fake_containers) {
+			free(t);
+			upgrade_opt_cache_insert(id, "1", size);
+		} else {
+			upgrade_opt_cache_insert(id, t, size);
+		}
+		return;
+	}
+	upgradeShard_t *s = upgrade_shard_of(id);
+	pthread_mutex_lock(&s->mutex);
+	upgrade_shard_insert(s, id, t);
+	pthread_mutex_unlock(&s->mutex);
 
     // 淘汰的插入external cache, 现在external是无限的, 已经用不上了
-    // 如果重新使用, 需要 lru_hashmap_insert_and_retrive(upgrade_cache, id_p, "1"/htb, &key, &value);
+    // 如果重新使用, 需要 hashed_cache_remove 淘汰的 upgradeTable_t 再插入external cache
     // assert((key && value) || (!key && !value));
     // if (key) {
     //     VERBOSE("upgrade_fingerprint_cache_insert: insert external cache %lld", *(containerid *)key);
@@ -275,40 +793,133 @@ void upgrade_fingerprint_cache_insert(containerid id, GHashTable *htb) {
     // }
 }
 
+void upgrade_fingerprint_cache_insert(containerid id, GHashTable *htb) {
+    upgrade_index_kv_t *buf = malloc(g_hash_table_size(htb) * sizeof(upgrade_index_kv_t));
+    int size = hashtable_to_buffer(htb, buf, g_hash_table_size(htb));
+    g_hash_table_destroy(htb);
+    upgrade_fingerprint_cache_insert_table(id, upgrade_table_new(buf, size));
+    free(buf);
+}
+
 void upgrade_fingerprint_cache_insert_buffer(containerid id, upgrade_index_kv_t *buf, int size) {
-	GHashTable *c = g_hash_table_new_full(g_feature_hash, g_feature_equal, free, NULL);
-	for (int i = 0; i < size; i++) {
-		upgrade_index_kv_t *kv_i = malloc(sizeof(upgrade_index_kv_t));
-		memcpy(kv_i, buf + i, sizeof(upgrade_index_kv_t));
-		g_hash_table_insert(c, &kv_i->old_fp, &kv_i->value);
-	}
-	upgrade_fingerprint_cache_insert(id, c);
+	upgrade_fingerprint_cache_insert_table(id, upgrade_table_new(buf, size));
+}
+
+
+/*
+ * 2D lookup for concurrent dedup workers, without upgrade_index_lock.
+ * Only the shard of the container is locked, for the lookup or insert.
+ * A container missing in the cache is read from the external cache
+ * by the first worker that misses it, with the shard unlocked,
+ * and the other workers missing it wait for that read.
+ */
+static void upgrade_index_lookup_concurrent(struct chunk *c, struct index_overhead *stats,
+        double *memory_time, double *external_time) {
+    if (CHECK_CHUNK(c, CHUNK_FILE_START) || CHECK_CHUNK(c, CHUNK_FILE_END))
+        return;
+
+    stats->index_lookup_requests++;
+    stats->cache_lookup_requests++;
+    /* a hit replaces c->id with the new id */
+    containerid id = c->id;
+    upgradeShard_t *s = upgrade_shard_of(id);
+
+    TIMER_DECLARE(1);
+    TIMER_BEGIN(1);
+    pthread_mutex_lock(&s->mutex);
+    int found;
+    while (!(found = upgrade_shard_lookup(s, c))
+            && g_hash_table_contains(s->fetching, &id))
+        pthread_cond_wait(&s->fetched, &s->mutex);
+    if (found) {
+        pthread_mutex_unlock(&s->mutex);
+        TIMER_END(1, *memory_time);
+        stats->cache_hits++;
+        SET_CHUNK(c, CHUNK_DUPLICATE);
+        return;
+    }
+    containerid *id_p = malloc(sizeof(containerid));
+    *id_p = id;
+    g_hash_table_add(s->fetching, id_p);
+    pthread_mutex_unlock(&s->mutex);
+    TIMER_END(1, *memory_time);
+
+    TIMER_BEGIN(1);
+    upgrade_index_kv_t *kvs;
+    int32_t count;
+    int ret = upgrade_external_cache_read(id, &kvs, &count);
+    upgradeTable_t *t = ret ? upgrade_table_new(kvs, count) : NULL;
+    if (ret)
+        free(kvs);
+
+    pthread_mutex_lock(&s->mutex);
+    if (ret) {
+        upgrade_shard_insert(s, id, t);
+        found = upgrade_shard_lookup(s, c);
+        assert(found);
+    }
+    g_hash_table_remove(s->fetching, &id);
+    pthread_cond_broadcast(&s->fetched);
+    pthread_mutex_unlock(&s->mutex);
+    TIMER_END(1, *external_time);
+
+    stats->kvstore_lookup_requests++;
+    if (ret) {
+        stats->kvstore_hits++;
+        stats->read_prefetching_units++;
+        SET_CHUNK(c, CHUNK_DUPLICATE);
+    } else {
+        stats->lookup_requests_for_unique++;
+        VERBOSE("upgrade_index_lookup_concurrent: non-existing fingerprint");
+    }
 }
 
+/*
+ * Look up the n chunks of a recipe unit on a concurrent dedup worker.
+ * The statistics of the unit are added under upgrade_index_lock at the end.
+ */
+void upgrade_index_lookup_concurrent_n(struct chunk *cks, int n) {
+    struct index_overhead stats;
+    memset(&stats, 0, sizeof(stats));
+    double memory_time = 0, external_time = 0;
+    for (int i = 0; i < n; i++)
+        upgrade_index_lookup_concurrent(cks + i, &stats, &memory_time, &external_time);
+
+    pthread_mutex_lock(&upgrade_index_lock.mutex);
+    upgrade_index_overhead.index_lookup_requests += stats.index_lookup_requests;
+    upgrade_index_overhead.cache_lookup_requests += stats.cache_lookup_requests;
+    upgrade_index_overhead.cache_hits += stats.cache_hits;
+    upgrade_index_overhead.kvstore_lookup_requests += stats.kvstore_lookup_requests;
+    upgrade_index_overhead.kvstore_hits += stats.kvstore_hits;
+    upgrade_index_overhead.read_prefetching_units += stats.read_prefetching_units;
+    upgrade_index_overhead.lookup_requests_for_unique += stats.lookup_requests_for_unique;
+    jcr.memory_cache_time += memory_time;
+    jcr.external_cache_time += external_time;
+    pthread_mutex_unlock(&upgrade_index_lock.mutex);
+}
 
 /**
  * 1D
- * LRU(upgrade_index_kv_t)
- * +
- * GHashTable(old_fp, upgrade_index_kv_t)
- * 
- * LRU free: do_nothing
- * GHashTable free: free upgrade_index_kv_t
+ * hashedCache(old_fp, upgrade_index_kv_t), one allocation per entry
 */
-GHashTable *upgrade_cache_htb;
+typedef struct {
+    struct cacheNode node;
+    upgrade_index_kv_t kv;
+} upgrade1DCached_t;
 
 void init_upgrade_1D_fingerprint_cache() {
-    upgrade_cache = new_lru_hashmap(destor.index_cache_size, NULL, g_feature_hash, g_feature_equal);
+    upgrade_cache = new_hashed_cache(destor.cache_policy, destor.index_cache_size,
+            offsetof(upgrade1DCached_t, node), g_feature_hash, g_feature_equal, free);
 }
 
 upgrade_index_value_t* upgrade_1D_fingerprint_cache_lookup(fingerprint *old_fp) {
-    return lru_hashmap_lookup(upgrade_cache, old_fp);
+    upgrade1DCached_t *e = hashed_cache_lookup(upgrade_cache, old_fp);
+    return e ? &e->kv.value : NULL;
 }
 
 void upgrade_1D_fingerprint_cache_insert(fingerprint *old_fp, upgrade_index_value_t *v) {
-    fingerprint *fp = malloc(sizeof(fingerprint));
-    memcpy(fp, old_fp, sizeof(fingerprint));
-    upgrade_index_value_t *value = malloc(sizeof(upgrade_index_value_t));
-    memcpy(value, v, sizeof(upgrade_index_value_t));
-    lru_hashmap_insert(upgrade_cache, fp, value, UPGRADE_KV_SIZE);
+    upgrade1DCached_t *e = malloc(sizeof(upgrade1DCached_t));
+    memcpy(e->kv.old_fp, old_fp, sizeof(fingerprint));
+    memcpy(&e->kv.value, v, sizeof(upgrade_index_value_t));
+    hashed_cache_insert(upgrade_cache, e, &e->kv.old_fp, UPGRADE_KV_SIZE);
 }
@@ -34,13 +34,19 @@ void init_upgrade_index();
 void close_upgrade_index();
 
 int upgrade_index_lookup(struct chunk *c);
+void upgrade_index_lookup_n(struct chunk *cks, int n);
+void upgrade_index_lookup_concurrent_n(struct chunk *cks, int n);
 void upgrade_index_update(GSequence *chunks, int64_t id);
 
 void upgrade_index_lookup_2D_filter(struct chunk *c);
 
-upgrade_index_value_t* upgrade_fingerprint_cache_lookup(struct chunk* c);
+int upgrade_fingerprint_cache_lookup(struct chunk* c);
+int upgrade_fingerprint_cache_contains(containerid id);
+void upgrade_cache_announce(struct chunk *cks, int n);
 void upgrade_fingerprint_cache_insert(containerid id, GHashTable *htb);
 void upgrade_fingerprint_cache_insert_buffer(containerid id, upgrade_index_kv_t *buf, int size);
+int hashtable_to_buffer(GHashTable *htb, upgrade_index_kv_t *buf, int size);
+int upgrade_external_cache_read(containerid id, upgrade_index_kv_t **kvs, int32_t *count);
 
 upgrade_index_value_t* upgrade_1D_fingerprint_cache_lookup(fingerprint *old_fp);
 void upgrade_1D_fingerprint_cache_insert(fingerprint *old_fp, upgrade_index_value_t *v);
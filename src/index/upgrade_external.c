@@ -1,7 +1,6 @@
 #include "upgrade_external.h"
 #include "../storage/db.h"
 #include "../storage/rocks.h"
-#include "../utils/lru_cache.h"
 #include "../storage/containerstore.h"
 #include "../jcr.h"
 
@@ -14,14 +13,91 @@
 void (*upgrade_external_cache_insert)(containerid id, GHashTable *htb);
 int (*upgrade_external_cache_prefetch)(containerid id);
 
-// 第一个留作指示size
 #define MAX_CHUNK_PER_CONTAINER 1200
 #define RELATION_CONTAINER_SIZE (MAX_CHUNK_PER_CONTAINER * sizeof(upgrade_index_kv_t))
-static lruHashMap_t *external_cache_htb;
+#define RELATION_ALIGN 4096
+/* the relation of a container in external_cache_htb */
+typedef struct {
+    struct cacheNode node;
+    containerid id;
+    GHashTable *htb;
+} externalCached_t;
+
+static struct hashedCache *external_cache_htb;
 FILE *external_cache_file = NULL;
 int external_cache_fd = -1;
 upgrade_index_kv_t *rBuffer, *wBuffer;
 
+/**
+ * The external cache file packs the relations of a container one after
+ * another, each starting at a 4KB boundary so that it can be read with
+ * O_DIRECT. relation_table[id] locates the relation of container id;
+ * it is saved to upgrade_external_cache.index for the recipe phase.
+ */
+typedef struct {
+    int64_t offset;
+    int32_t count; // -1: not written
+    int32_t pad;
+} relationLocation_t;
+
+static relationLocation_t *relation_table = NULL;
+static int64_t relation_table_size = 0;
+static int64_t relation_file_tail = 0;
+
+static void relation_table_reserve(int64_t n) {
+    if (n <= relation_table_size)
+        return;
+    int64_t size = relation_table_size ? relation_table_size : 1024;
+    while (size < n)
+        size <<= 1;
+    relation_table = realloc(relation_table, size * sizeof(relationLocation_t));
+    for (int64_t i = relation_table_size; i < size; i++)
+        relation_table[i].count = -1;
+    relation_table_size = size;
+}
+
+static sds relation_table_path() {
+    sds path = sdsdup(destor.working_directory);
+    return sdscat(path, "/upgrade_external_cache.index");
+}
+
+static void load_relation_table() {
+    sds path = relation_table_path();
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("Can not open upgrade_external_cache.index because");
+        exit(1);
+    }
+    int64_t n;
+    if (fread(&n, sizeof(n), 1, fp) != 1) {
+        perror("Fail to read upgrade_external_cache.index");
+        exit(1);
+    }
+    relation_table_reserve(n);
+    if (n && fread(relation_table, sizeof(relationLocation_t), n, fp) != n) {
+        perror("Fail to read upgrade_external_cache.index");
+        exit(1);
+    }
+    fclose(fp);
+    sdsfree(path);
+}
+
+static void save_relation_table() {
+    sds path = relation_table_path();
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror("Can not create upgrade_external_cache.index because");
+        exit(1);
+    }
+    int64_t n = relation_table_size;
+    while (n > 0 && relation_table[n - 1].count < 0)
+        n--;
+    fwrite(&n, sizeof(n), 1, fp);
+    fwrite(relation_table, sizeof(relationLocation_t), n, fp);
+    fclose(fp);
+    sdsfree(path);
+}
+
 void upgrade_external_cache_insert_htb(containerid id, GHashTable *htb);
 // void upgrade_external_cache_insert_DB(containerid id, GHashTable *htb);
 void upgrade_external_cache_insert_file(containerid id, GHashTable *htb);
@@ -34,6 +110,12 @@ int upgrade_external_cache_prefetch_htb(containerid id);
 int upgrade_external_cache_prefetch_file(containerid id);
 int upgrade_external_cache_prefetch_rocksdb(containerid id);
 
+static void free_external_cached(void *p) {
+    externalCached_t *e = p;
+    g_hash_table_destroy(e->htb);
+    free(e);
+}
+
 void init_upgrade_external_cache() {
     wBuffer = malloc(RELATION_CONTAINER_SIZE);
     int ret = posix_memalign(&rBuffer, 4096, RELATION_CONTAINER_SIZE * 2);
@@ -45,9 +127,11 @@ void init_upgrade_external_cache() {
     {
     case INDEX_KEY_VALUE_HTABLE:
         if (destor.fake_containers) {
-            external_cache_htb = new_lru_hashmap(destor.external_cache_size, NULL, g_int64_hash, g_int64_equal);
+            external_cache_htb = new_hashed_cache(CACHE_POLICY_LRU, destor.external_cache_size,
+                offsetof(externalCached_t, node), g_int64_hash, g_int64_equal, free);
         } else {
-            external_cache_htb = new_lru_hashmap(destor.external_cache_size, g_hash_table_destroy, g_int64_hash, g_int64_equal);
+            external_cache_htb = new_hashed_cache(CACHE_POLICY_LRU, destor.external_cache_size,
+                offsetof(externalCached_t, node), g_int64_hash, g_int64_equal, free_external_cached);
         }
         upgrade_external_cache_insert = upgrade_external_cache_insert_htb;
         upgrade_external_cache_prefetch = upgrade_external_cache_prefetch_htb;
@@ -67,20 +151,23 @@ void init_upgrade_external_cache() {
         switch (destor.upgrade_phase)
         {
         case 0:
-            external_cache_file = fopen(path, "w+");
-            external_cache_fd = fileno(external_cache_file);
+            external_cache_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
             break;
         case 1:
-            external_cache_file = fopen(path, "w");
+            external_cache_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
             break;
         case 2:
             external_cache_fd = open(path, O_RDONLY | __O_DIRECT);
+            load_relation_table();
             break;
         default:
             assert(0);
             break;
         }
-        assert(external_cache_file || external_cache_fd != -1);
+        if (external_cache_fd < 0) {
+            perror("Can not open upgrade_external_cache because");
+            exit(1);
+        }
         sdsfree(path);
 
         upgrade_external_cache_insert = upgrade_external_cache_insert_file;
@@ -142,11 +229,13 @@ void close_upgrade_external_cache() {
         // closeDB(DB_UPGRADE);
         break;
     case INDEX_KEY_VALUE_FILE:
-        if (external_cache_file) {
-            fclose(external_cache_file);
-        } else {
-            close(external_cache_fd);
+        if (destor.upgrade_phase != 2) {
+            save_relation_table();
         }
+        close(external_cache_fd);
+        free(relation_table);
+        relation_table = NULL;
+        relation_table_size = 0;
         break;
     case INDEX_KEY_VALUE_ROCKSDB:
         close_RocksDB(DB_UPGRADE);
@@ -184,31 +273,30 @@ int hashtable_to_buffer(GHashTable *htb, upgrade_index_kv_t *buf, int size) {
  * return 0 if not found
 */
 int upgrade_external_cache_prefetch_file(containerid id) {
-    assert(MAX_CHUNK_PER_CONTAINER > CONTAINER_META_SIZE / 28); // min sizof(struct metaEntry) = 28
-    // fseek(external_cache_file, id * RELATION_CONTAINER_SIZE, SEEK_SET);
-    // size_t read_size = fread(external_file_buffer, sizeof(upgrade_index_kv_t), MAX_CHUNK_PER_CONTAINER, external_cache_file);
-    // lseek(external_cache_fd, id * RELATION_CONTAINER_SIZE, SEEK_SET);
-    size_t addr = id * RELATION_CONTAINER_SIZE;
-    size_t floor = FLOOR(addr, 4096) * 4096;
-    lseek(external_cache_fd, floor, SEEK_SET);
-    size_t rSize = CEIL((id + 1) * RELATION_CONTAINER_SIZE, 4096) * 4096 - floor;
-    size_t read_size = read(external_cache_fd, rBuffer, rSize);
-    if (read_size == 0) {
+    if (id < 0 || id >= relation_table_size || relation_table[id].count < 0) {
         return 0;
     }
-    if (read_size == -1) {
-        perror("read external cache file");
-        exit(1);
+    int64_t offset = relation_table[id].offset;
+    int32_t count = relation_table[id].count;
+    size_t need = count * sizeof(upgrade_index_kv_t);
+    size_t rSize = CEIL(need, RELATION_ALIGN) * RELATION_ALIGN;
+    assert(rSize <= RELATION_CONTAINER_SIZE * 2);
+
+    size_t done = 0;
+    while (done < need) {
+        ssize_t n = pread(external_cache_fd, (char *)rBuffer + done, rSize - done, offset + done);
+        if (n < 0) {
+            perror("read external cache file");
+            exit(1);
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
     }
-    // assert(read_size == MAX_CHUNK_PER_CONTAINER); // 会先处理完再读, 所以一定能读到MAX_CHUNK_PER_CONTAINER
-    // fprintf(stderr, "read_size = %d\n", read_size);
-    assert(read_size <= rSize && read_size > rSize - 4096);
-    // assert(read_size == rSize);
+    assert(done >= need);
 
-    upgrade_index_kv_t *kv = (upgrade_index_kv_t *)((char *)rBuffer + (id * RELATION_CONTAINER_SIZE) % 4096);
-    assert(memcmp(&kv->old_fp, &id, sizeof(containerid)) == 0);
-    int chunk_num = kv->value.id;
-    upgrade_fingerprint_cache_insert_buffer(id, kv + 1, chunk_num);
+    upgrade_fingerprint_cache_insert_buffer(id, rBuffer, count);
     return 1;
 }
 
@@ -231,31 +319,12 @@ int upgrade_external_cache_prefetch_DB(containerid id) {
 
 int upgrade_external_cache_prefetch_htb(containerid id) {
     assert(0); // 不用从external cache中删除?
-    if (lru_hashmap_lookup(external_cache_htb, &id)) {
-        // 将external cache命中的数据(第一个)放入in-memory cache
-
-        // 从external cache中删除
-        struct lruCache *lru = external_cache_htb->lru;
-        GList* elem = g_list_first(lru->elem_queue);
-        if (lru->size == 1) {
-            assert(elem == lru->elem_queue_tail);
-            lru->elem_queue_tail = NULL;
-        }
-        lru->elem_queue = g_list_remove_link(lru->elem_queue, elem);
-
-        void **victim = (void **)elem->data;
-        g_list_free_1(elem);
-        lru->size--;
-        assert(g_hash_table_remove(external_cache_htb->map, victim[0]));
-
+    // 将external cache命中的数据放入in-memory cache, 并从external cache中删除
+    externalCached_t *e = hashed_cache_remove(external_cache_htb, &id);
+    if (e) {
         // 加入in-memory cache
-        void *key = NULL, *value = NULL;
-        // lru_hashmap_insert_and_retrive(upgrade_cache, victim[0], victim[1], &key, &value);
-        free(victim);
-        assert((key && value) || (!key && !value));
-        if (key) {
-            // lru_hashmap_insert(external_cache_htb, key, value);
-        }
+        upgrade_fingerprint_cache_insert(e->id, e->htb);
+        free(e);
         return 1;
     }
     return 0;
@@ -267,9 +336,10 @@ int upgrade_external_cache_prefetch_htb(containerid id) {
 
 void upgrade_external_cache_insert_htb(containerid id, GHashTable *htb) {
     assert(0);
-    void *key = malloc(sizeof(containerid));
-    *(containerid *)key = id;
-    // lru_hashmap_insert(external_cache_htb, key, htb);
+    externalCached_t *e = malloc(sizeof(externalCached_t));
+    e->id = id;
+    e->htb = htb;
+    hashed_cache_insert(external_cache_htb, e, &e->id, 1);
 }
 
 void upgrade_external_cache_insert_DB(containerid id, GHashTable *htb) {
@@ -289,25 +359,56 @@ void upgrade_external_cache_insert_DB(containerid id, GHashTable *htb) {
     g_hash_table_destroy(htb);
 }
 
+/**
+ * Relations are appended in the order filter_thread_container hands them
+ * over, so the file is written sequentially.
+ */
 void upgrade_external_cache_insert_file(containerid id, GHashTable *htb) {
-    assert(g_hash_table_size(htb) <= MAX_CHUNK_PER_CONTAINER - 1);
-    upgrade_index_kv_t *kv = wBuffer;
-    kv->value.id = g_hash_table_size(htb);
-    memcpy(&kv->old_fp, &id, sizeof(containerid));
-
-    hashtable_to_buffer(htb, kv + 1, g_hash_table_size(htb));
-    fseek(external_cache_file, id * RELATION_CONTAINER_SIZE, SEEK_SET);
-    fwrite(kv, sizeof(upgrade_index_kv_t), MAX_CHUNK_PER_CONTAINER, external_cache_file);
+    assert(g_hash_table_size(htb) <= MAX_CHUNK_PER_CONTAINER);
+    int count = hashtable_to_buffer(htb, wBuffer, g_hash_table_size(htb));
+    size_t size = count * sizeof(upgrade_index_kv_t);
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(external_cache_fd, (char *)wBuffer + done, size - done, relation_file_tail + done);
+        if (n < 0) {
+            perror("write external cache file");
+            exit(1);
+        }
+        done += n;
+    }
+
+    relation_table_reserve(id + 1);
+    relation_table[id].offset = relation_file_tail;
+    relation_table[id].count = count;
+    relation_file_tail += CEIL(size, RELATION_ALIGN) * RELATION_ALIGN;
     g_hash_table_destroy(htb);
 }
 
 void upgrade_external_cache_insert_rocksdb_1D(containerid id, GHashTable *htb) {
+    int n = g_hash_table_size(htb);
+    char **keys = malloc(n * sizeof(char *));
+    char **values = malloc(n * sizeof(char *));
+    size_t *keySizes = malloc(n * sizeof(size_t));
+    size_t *valueSizes = malloc(n * sizeof(size_t));
+
     GHashTableIter iter;
     gpointer k, v;
+    int i = 0;
     g_hash_table_iter_init(&iter, htb);
     while (g_hash_table_iter_next(&iter, &k, &v)) {
-        put_RocksDB(DB_UPGRADE, k, sizeof(fingerprint), v, sizeof(upgrade_index_value_t));
+        keys[i] = k;
+        keySizes[i] = sizeof(fingerprint);
+        values[i] = v;
+        valueSizes[i] = sizeof(upgrade_index_value_t);
+        i++;
     }
+    writebatch_RocksDB(DB_UPGRADE, n, keys, keySizes, values, valueSizes);
+
+    free(keys);
+    free(values);
+    free(keySizes);
+    free(valueSizes);
     g_hash_table_destroy(htb);
 }
 
@@ -381,3 +482,297 @@ int upgrade_external_cache_prefetch_rockfile(containerid id, fingerprint *fp) {
     upgrade_fingerprint_cache_insert_buffer(id, kv, count);
     return 1;
 }
+
+/**
+ * Lookahead prefetch for the recipe pass.
+ * upgrade_external_cache_stage() reads the relations of a set of containers
+ * on a pool of readers and returns them as a staged table
+ * (containerid -> stagedRelation_t). The dedup thread installs the table
+ * of the unit it is processing with upgrade_external_cache_set_staged(),
+ * and upgrade_external_cache_fetch() serves misses from it before going
+ * to the external cache.
+ * In the file store, relations of adjacent containers are contiguous,
+ * so a run of adjacent ids is fetched by one read.
+ */
+#define STAGE_RUN_MAX (1024 * 1024)
+
+typedef struct {
+    containerid id;
+    int32_t count;
+    upgrade_index_kv_t *kvs;
+} stagedRelation_t;
+
+typedef struct {
+    int first;
+    int last; // inclusive
+} stageRun_t;
+
+static struct {
+    int num;
+    pthread_t *readers;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    int stop;
+
+    stagedRelation_t *rels;
+    stageRun_t *runs;
+    int run_num;
+    int next_run;
+    int done_runs;
+} stage;
+
+/* the staged table of the unit each dedup worker is processing */
+static __thread GHashTable *staged_relations = NULL;
+
+static void free_staged_relation(void *p) {
+    stagedRelation_t *r = p;
+    free(r->kvs);
+    free(r);
+}
+
+static void stage_run_file(stagedRelation_t *rels, stageRun_t *run) {
+    relationLocation_t *first = &relation_table[rels[run->first].id];
+    relationLocation_t *last = &relation_table[rels[run->last].id];
+    int64_t begin = first->offset;
+    int64_t need = last->offset + last->count * sizeof(upgrade_index_kv_t) - begin;
+    int64_t rSize = CEIL(need, RELATION_ALIGN) * RELATION_ALIGN;
+
+    char *buf;
+    if (posix_memalign((void **)&buf, RELATION_ALIGN, rSize) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    int64_t done = 0;
+    while (done < need) {
+        ssize_t n = pread(external_cache_fd, buf + done, rSize - done, begin + done);
+        if (n < 0) {
+            perror("read external cache file");
+            exit(1);
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    assert(done >= need);
+
+    for (int i = run->first; i <= run->last; i++) {
+        relationLocation_t *loc = &relation_table[rels[i].id];
+        size_t size = loc->count * sizeof(upgrade_index_kv_t);
+        rels[i].count = loc->count;
+        rels[i].kvs = malloc(size ? size : 1);
+        memcpy(rels[i].kvs, buf + (loc->offset - begin), size);
+    }
+    free(buf);
+}
+
+static void stage_run_rocksdb(stagedRelation_t *rels, stageRun_t *run) {
+    for (int i = run->first; i <= run->last; i++) {
+        size_t valueSize;
+        upgrade_index_kv_t *kv;
+        get_RocksDB(DB_UPGRADE, (char *)&rels[i].id, sizeof(containerid), (char **)&kv, &valueSize);
+        if (!kv) {
+            continue;
+        }
+        assert(valueSize % sizeof(upgrade_index_kv_t) == 0);
+        rels[i].count = valueSize / sizeof(upgrade_index_kv_t);
+        rels[i].kvs = kv;
+    }
+}
+
+static void* stage_reader_thread(void *arg) {
+    pthread_setname_np(pthread_self(), "stage_reader");
+    while (1) {
+        pthread_mutex_lock(&stage.mutex);
+        while (!stage.stop && stage.next_run >= stage.run_num)
+            pthread_cond_wait(&stage.work, &stage.mutex);
+        if (stage.stop) {
+            pthread_mutex_unlock(&stage.mutex);
+            break;
+        }
+        stageRun_t *run = &stage.runs[stage.next_run++];
+        stagedRelation_t *rels = stage.rels;
+        pthread_mutex_unlock(&stage.mutex);
+
+        if (destor.upgrade_external_store == INDEX_KEY_VALUE_FILE) {
+            stage_run_file(rels, run);
+        } else {
+            stage_run_rocksdb(rels, run);
+        }
+
+        pthread_mutex_lock(&stage.mutex);
+        if (++stage.done_runs == stage.run_num)
+            pthread_cond_signal(&stage.done);
+        pthread_mutex_unlock(&stage.mutex);
+    }
+    return NULL;
+}
+
+/**
+ * return 1 if the external store supports staged reads
+ */
+int init_upgrade_external_stage(int readers) {
+    if (readers <= 0 || destor.upgrade_relation_level != 2)
+        return 0;
+    if (destor.upgrade_external_store != INDEX_KEY_VALUE_FILE
+            && destor.upgrade_external_store != INDEX_KEY_VALUE_ROCKSDB)
+        return 0;
+
+    memset(&stage, 0, sizeof(stage));
+    stage.num = readers;
+    pthread_mutex_init(&stage.mutex, NULL);
+    pthread_cond_init(&stage.work, NULL);
+    pthread_cond_init(&stage.done, NULL);
+    stage.readers = malloc(readers * sizeof(pthread_t));
+    for (int i = 0; i < readers; i++)
+        pthread_create(&stage.readers[i], NULL, stage_reader_thread, NULL);
+    return 1;
+}
+
+void close_upgrade_external_stage() {
+    if (!stage.readers)
+        return;
+    pthread_mutex_lock(&stage.mutex);
+    stage.stop = 1;
+    pthread_cond_broadcast(&stage.work);
+    pthread_mutex_unlock(&stage.mutex);
+    for (int i = 0; i < stage.num; i++)
+        pthread_join(stage.readers[i], NULL);
+    free(stage.readers);
+    stage.readers = NULL;
+    pthread_mutex_destroy(&stage.mutex);
+    pthread_cond_destroy(&stage.work);
+    pthread_cond_destroy(&stage.done);
+}
+
+static gint containerid_cmp(gconstpointer a, gconstpointer b) {
+    containerid x = *(const containerid *)a, y = *(const containerid *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/**
+ * Read the relations of n distinct containers.
+ * Containers that are not in the external cache are left out of the table.
+ */
+GHashTable* upgrade_external_cache_stage(containerid *ids, int n) {
+    if (n == 0)
+        return NULL;
+    qsort(ids, n, sizeof(containerid), containerid_cmp);
+
+    stagedRelation_t *rels = calloc(n, sizeof(stagedRelation_t));
+    stageRun_t *runs = malloc(n * sizeof(stageRun_t));
+    int run_num = 0, m = 0;
+    for (int i = 0; i < n; i++) {
+        if (destor.upgrade_external_store == INDEX_KEY_VALUE_FILE
+                && (ids[i] >= relation_table_size || relation_table[ids[i]].count < 0))
+            continue;
+        rels[m].id = ids[i];
+        if (run_num > 0 && destor.upgrade_external_store == INDEX_KEY_VALUE_FILE) {
+            stageRun_t *r = &runs[run_num - 1];
+            relationLocation_t *prev = &relation_table[rels[m - 1].id];
+            relationLocation_t *cur = &relation_table[ids[i]];
+            int64_t prev_end = prev->offset
+                    + CEIL(prev->count * sizeof(upgrade_index_kv_t), RELATION_ALIGN) * RELATION_ALIGN;
+            if (cur->offset == prev_end
+                    && cur->offset - relation_table[rels[r->first].id].offset < STAGE_RUN_MAX) {
+                r->last = m++;
+                continue;
+            }
+        }
+        runs[run_num].first = runs[run_num].last = m++;
+        run_num++;
+    }
+
+    if (run_num > 0) {
+        pthread_mutex_lock(&stage.mutex);
+        stage.rels = rels;
+        stage.runs = runs;
+        stage.run_num = run_num;
+        stage.next_run = 0;
+        stage.done_runs = 0;
+        pthread_cond_broadcast(&stage.work);
+        while (stage.done_runs < stage.run_num)
+            pthread_cond_wait(&stage.done, &stage.mutex);
+        stage.run_num = 0;
+        stage.next_run = 0;
+        pthread_mutex_unlock(&stage.mutex);
+    }
+
+    GHashTable *staged = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, free_staged_relation);
+    for (int i = 0; i < m; i++) {
+        if (!rels[i].kvs)
+            continue;
+        stagedRelation_t *r = malloc(sizeof(stagedRelation_t));
+        *r = rels[i];
+        g_hash_table_insert(staged, &r->id, r);
+    }
+    free(rels);
+    free(runs);
+    return staged;
+}
+
+void upgrade_external_cache_set_staged(GHashTable *staged) {
+    staged_relations = staged;
+}
+
+/**
+ * Bring the relation of container id into the fingerprint cache.
+ * return 0 if not found
+ */
+int upgrade_external_cache_fetch(containerid id) {
+    if (staged_relations) {
+        stagedRelation_t *r = g_hash_table_lookup(staged_relations, &id);
+        if (r) {
+            upgrade_fingerprint_cache_insert_buffer(id, r->kvs, r->count);
+            g_hash_table_remove(staged_relations, &id);
+            return 1;
+        }
+    }
+    return upgrade_external_cache_prefetch(id);
+}
+
+/*
+ * The file and RocksDB stores of 2D relations can be read by several
+ * dedup workers at once through upgrade_external_cache_read().
+ */
+int upgrade_external_cache_concurrent() {
+    return destor.upgrade_relation_level == 2
+            && (destor.upgrade_external_store == INDEX_KEY_VALUE_FILE
+                || destor.upgrade_external_store == INDEX_KEY_VALUE_ROCKSDB);
+}
+
+/**
+ * Read the relation of container id into a new buffer, to be freed by the caller.
+ * Unlike upgrade_external_cache_fetch(), it shares no buffer and does not
+ * insert into the fingerprint cache, so it can run without upgrade_index_lock.
+ * return 0 if not found
+ */
+int upgrade_external_cache_read(containerid id, upgrade_index_kv_t **kvs, int32_t *count) {
+    assert(upgrade_external_cache_concurrent());
+    if (staged_relations) {
+        stagedRelation_t *r = g_hash_table_lookup(staged_relations, &id);
+        if (r) {
+            *kvs = r->kvs;
+            *count = r->count;
+            r->kvs = NULL;
+            g_hash_table_remove(staged_relations, &id);
+            return 1;
+        }
+    }
+
+    stagedRelation_t rel = { id, 0, NULL };
+    stageRun_t run = { 0, 0 };
+    if (destor.upgrade_external_store == INDEX_KEY_VALUE_FILE) {
+        if (id >= relation_table_size || relation_table[id].count < 0)
+            return 0;
+        stage_run_file(&rel, &run);
+    } else {
+        stage_run_rocksdb(&rel, &run);
+    }
+    if (!rel.kvs)
+        return 0;
+    *kvs = rel.kvs;
+    *count = rel.count;
+    return 1;
+}
@@ -16,4 +16,11 @@ extern void (*upgrade_external_cache_insert)(containerid id, GHashTable *htb);
 extern int (*upgrade_external_cache_prefetch)(containerid id);
 int upgrade_external_cache_prefetch_rockfile(containerid id, fingerprint *fp);
 
+int init_upgrade_external_stage(int readers);
+void close_upgrade_external_stage();
+GHashTable* upgrade_external_cache_stage(containerid *ids, int n);
+void upgrade_external_cache_set_staged(GHashTable *staged);
+int upgrade_external_cache_fetch(containerid id);
+int upgrade_external_cache_concurrent();
+
 #endif /* UPGRADE_EXTERNAL_H */
@@ -38,6 +38,10 @@ void init_jcr(char *path) {
 	jcr.zero_chunk_size = 0;
 	jcr.rewritten_chunk_num = 0;
 	jcr.rewritten_chunk_size = 0;
+	jcr.raw_chunk_num = 0;
+	jcr.raw_chunk_size = 0;
+	jcr.dict_num = 0;
+	jcr.dict_size = 0;
 
 	jcr.sparse_container_num = 0;
 	jcr.inherited_sparse_num = 0;
@@ -52,6 +56,7 @@ void init_jcr(char *path) {
 	jcr.hash_time = 0;
 	jcr.dedup_time = 0;
 	jcr.rewrite_time = 0;
+	jcr.compress_time = 0;
 	jcr.filter_time = 0;
 	jcr.write_time = 0;
 
@@ -31,12 +31,17 @@ struct jcr{
 	int64_t origin_data_size;
 	int64_t data_size;
 	int64_t unique_data_size;
+	int64_t stored_origin_size; // size of the stored chunks before compression
 	int64_t chunk_num;
 	int32_t unique_chunk_num;
 	int32_t zero_chunk_num;
 	int64_t zero_chunk_size;
 	int32_t rewritten_chunk_num;
 	int64_t rewritten_chunk_size;
+	int32_t raw_chunk_num; // chunks stored without compression
+	int64_t raw_chunk_size;
+	int32_t dict_num; // dictionaries stored in containers
+	int64_t dict_size;
 
 	int32_t sparse_container_num;
 	int32_t inherited_sparse_num;
@@ -57,6 +62,7 @@ struct jcr{
 	double pre_dedup_time;
 	double dedup_time;
 	double rewrite_time;
+	double compress_time;
 	double filter_time;
 	double write_time;
 
@@ -69,6 +75,7 @@ struct jcr{
 	double pre_process_recipe_time;
 	double memory_cache_time;
 	double external_cache_time;
+	double external_prefetch_time;
 	uint32_t processed_container_num;
 	uint32_t container_processed;
 	double file_start_time;
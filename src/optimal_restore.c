@@ -9,7 +9,6 @@
 #include "recipe/recipestore.h"
 #include "storage/containerstore.h"
 #include "restore.h"
-#include "utils/lru_cache.h"
 
 /* Consisting of a sequence of access records with an identical ID */
 struct accessRecords {
@@ -60,8 +59,8 @@ struct {
 	/* Access records of cached containers. */
 	GSequence *sorted_records_of_cached_containers;
 
-	/* Container queue. */
-	struct lruCache *lru_queue;
+	/* Cached containers by id, the victims are chosen by their access records. */
+	struct hashedCache *lru_queue;
 
 } optimal_cache;
 
@@ -103,11 +102,13 @@ void init_optimal_cache() {
 	optimal_cache.sorted_records_of_cached_containers = g_sequence_new(NULL);
 
 	if (destor.simulation_level == SIMULATION_NO)
-		optimal_cache.lru_queue = new_lru_cache(destor.restore_cache[1],
-				free_container, lookup_fingerprint_in_container);
+		optimal_cache.lru_queue = new_hashed_cache(CACHE_POLICY_LRU,
+				destor.restore_cache[1], offsetof(struct container, meta.node),
+				g_int64_hash, g_int64_equal, free_container);
 	else
-		optimal_cache.lru_queue = new_lru_cache(destor.restore_cache[1],
-				free_container_meta, lookup_fingerprint_in_container_meta);
+		optimal_cache.lru_queue = new_hashed_cache(CACHE_POLICY_LRU,
+				destor.restore_cache[1], offsetof(struct containerMeta, node),
+				g_int64_hash, g_int64_equal, free_container_meta);
 
 	optimal_cache_window_fill();
 }
@@ -137,20 +138,15 @@ static int optimal_cache_hits(containerid id) {
 		last_id = id;
 	}
 
-	if (destor.simulation_level == SIMULATION_NO)
-		return lru_cache_hits(optimal_cache.lru_queue, &id,
-				container_check_id) == NULL ? 0 : 1;
-	else
-		return lru_cache_hits(optimal_cache.lru_queue, &id,
-				container_meta_check_id) == NULL ? 0 : 1;
+	return hashed_cache_lookup(optimal_cache.lru_queue, &id) == NULL ? 0 : 1;
 }
 
 /* The function will not be called if the simulation level >= RESTORE. */
-static struct chunk* optimal_cache_lookup(fingerprint *fp) {
+static struct chunk* optimal_cache_lookup(containerid id, fingerprint *fp) {
 
 	assert(destor.simulation_level == SIMULATION_NO);
 
-	struct container* con = lru_cache_lookup(optimal_cache.lru_queue, fp);
+	struct container* con = hashed_cache_peek(optimal_cache.lru_queue, &id);
 	struct chunk* c = get_chunk_in_container(con, fp);
 	assert(c);
 
@@ -181,7 +177,7 @@ static int find_kicked_container_meta(struct containerMeta* cm, GHashTable *ht)
 
 static void optimal_cache_insert(containerid id) {
 
-	if (lru_cache_is_full(optimal_cache.lru_queue)) {
+	if (hashed_cache_is_full(optimal_cache.lru_queue)) {
 		GHashTable* ht = g_hash_table_new(g_int64_hash, g_int64_equal);
 
 		/*
@@ -207,9 +203,9 @@ static void optimal_cache_insert(containerid id) {
 		}
 
 		if (destor.simulation_level == SIMULATION_NO)
-			lru_cache_kicks(optimal_cache.lru_queue, ht, find_kicked_container);
+			hashed_cache_kicks(optimal_cache.lru_queue, ht, find_kicked_container);
 		else
-			lru_cache_kicks(optimal_cache.lru_queue, ht,
+			hashed_cache_kicks(optimal_cache.lru_queue, ht,
 					find_kicked_container_meta);
 
 		g_hash_table_destroy(ht);
@@ -234,10 +230,10 @@ static void optimal_cache_insert(containerid id) {
 	jcr.read_container_num++;
 	if (destor.simulation_level == SIMULATION_NO) {
 		struct container* con = retrieve_container_by_id(id);
-		lru_cache_insert(optimal_cache.lru_queue, con, NULL, NULL);
+		hashed_cache_insert(optimal_cache.lru_queue, con, &con->meta.id, 1);
 	} else {
 		struct containerMeta *cm = retrieve_container_meta_by_id(id);
-		lru_cache_insert(optimal_cache.lru_queue, cm, NULL, NULL);
+		hashed_cache_insert(optimal_cache.lru_queue, cm, &cm->id, 1);
 	}
 
 	struct accessRecords* r = g_hash_table_lookup(optimal_cache.access_record_table, &id);
@@ -251,8 +247,10 @@ static void optimal_cache_insert(containerid id) {
 void* optimal_restore_thread(void *arg) {
 	init_optimal_cache();
 
+	SyncQueueReader *input = sync_queue_reader_new(restore_recipe_queue,
+			SYNC_QUEUE_READER_BATCH);
 	struct chunk* c;
-	while ((c = sync_queue_pop(restore_recipe_queue))) {
+	while ((c = sync_queue_reader_pop(input))) {
 
 		if (CHECK_CHUNK(c, CHUNK_FILE_START) || CHECK_CHUNK(c, CHUNK_FILE_END)) {
 			sync_queue_push(restore_chunk_queue, c);
@@ -268,7 +266,7 @@ void* optimal_restore_thread(void *arg) {
 		}
 
 		if (destor.simulation_level == SIMULATION_NO) {
-			struct chunk* rc = optimal_cache_lookup(&c->fp);
+			struct chunk* rc = optimal_cache_lookup(c->id, &c->fp);
 			TIMER_END(1, jcr.read_chunk_time);
 			sync_queue_push(restore_chunk_queue, rc);
 		} else {
@@ -281,5 +279,6 @@ void* optimal_restore_thread(void *arg) {
 	}
 
 	sync_queue_term(restore_chunk_queue);
+	sync_queue_reader_free(input);
 	return NULL;
 }
@@ -0,0 +1,513 @@
+/*
+ * columnar_recipe.c
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Boju Chen
+ */
+
+#include <zstd.h>
+#include "columnar_recipe.h"
+
+#define SHA1_LEN 20
+
+/* the fingerprint column is stored as is, or as a zstd frame */
+#define FP_COLUMN_RAW 0
+#define FP_COLUMN_ZSTD 1
+
+/* the largest encoded block: fp, id run and size of every chunk */
+#define BLOCK_BOUND(n) (12 + (int64_t)(n) * (sizeof(fingerprint) + 10 + 10 + 5))
+
+static inline int put_varint(unsigned char *p, uint64_t v) {
+	int n = 0;
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+static inline int get_varint(const unsigned char *p, uint64_t *v) {
+	int n = 0, shift = 0;
+	*v = 0;
+	do {
+		*v |= (uint64_t) (p[n] & 0x7f) << shift;
+		shift += 7;
+	} while (p[n++] & 0x80);
+	return n;
+}
+
+static inline uint64_t zigzag(int64_t v) {
+	return ((uint64_t) v << 1) ^ (v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static void full_pread(int fd, void *buf, int64_t size, int64_t off) {
+	int64_t got = 0;
+	while (got < size) {
+		ssize_t n = pread(fd, (char *) buf + got, size - got, off + got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			perror("Can not read the columnar recipe");
+			exit(1);
+		}
+		got += n;
+	}
+}
+
+/*
+ * Encode n records into buf, with tmp as large as buf for the fingerprints.
+ * Return the size of the block.
+ */
+static int64_t encode_block(struct recipeRecord *r, int n, unsigned char *buf,
+		unsigned char *tmp, ZSTD_CCtx *cctx) {
+	fingerprint zero;
+	memset(zero, 0, sizeof(fingerprint));
+	uint8_t fp_len = SHA1_LEN;
+	int i;
+	for (i = 0; i < n; i++)
+		if (memcmp(r[i].fp + SHA1_LEN, zero, sizeof(fingerprint) - SHA1_LEN)) {
+			fp_len = sizeof(fingerprint);
+			break;
+		}
+
+	int64_t off = 0;
+	int32_t num = n;
+	memcpy(buf, &num, sizeof(num));
+	buf[4] = fp_len;
+	buf[5] = FP_COLUMN_RAW;
+	buf[6] = buf[7] = 0;
+	off = 8;
+
+	/*
+	 * Fingerprints are random, but a recipe repeats the ones of
+	 * duplicate chunks within a version, which zstd finds.
+	 */
+	int64_t fp_size = (int64_t) n * fp_len;
+	for (i = 0; i < n; i++)
+		memcpy(tmp + (int64_t) i * fp_len, r[i].fp, fp_len);
+	size_t csize = ZSTD_compressCCtx(cctx, buf + off + sizeof(int32_t),
+			ZSTD_compressBound(fp_size), tmp, fp_size, destor.compress_level);
+	if (!ZSTD_isError(csize) && csize + sizeof(int32_t) < fp_size) {
+		int32_t size = csize;
+		buf[5] = FP_COLUMN_ZSTD;
+		memcpy(buf + off, &size, sizeof(size));
+		off += sizeof(size) + csize;
+	} else {
+		memcpy(buf + off, tmp, fp_size);
+		off += fp_size;
+	}
+
+	/* container ids as runs, chunks of a file mostly come from a few containers */
+	containerid prev = 0;
+	for (i = 0; i < n;) {
+		int j = i + 1;
+		while (j < n && r[j].id == r[i].id)
+			j++;
+		off += put_varint(buf + off, zigzag(r[i].id - prev));
+		off += put_varint(buf + off, j - i);
+		prev = r[i].id;
+		i = j;
+	}
+
+	for (i = 0; i < n; i++)
+		off += put_varint(buf + off, (uint32_t) r[i].size);
+
+	return off;
+}
+
+static void decode_block(const unsigned char *buf, struct recipeRecord *r) {
+	int32_t n;
+	memcpy(&n, buf, sizeof(n));
+	uint8_t fp_len = buf[4];
+	int64_t off = 8;
+	int i;
+
+	const unsigned char *fps = buf + off;
+	unsigned char *tmp = NULL;
+	if (buf[5] == FP_COLUMN_ZSTD) {
+		int32_t csize;
+		memcpy(&csize, buf + off, sizeof(csize));
+		off += sizeof(csize);
+		tmp = (unsigned char *) malloc((int64_t) n * fp_len);
+		size_t size = ZSTD_decompress(tmp, (int64_t) n * fp_len, buf + off, csize);
+		if (ZSTD_isError(size) || size != (int64_t) n * fp_len) {
+			fprintf(stderr, "A block of the columnar recipe is corrupted!\n");
+			exit(1);
+		}
+		fps = tmp;
+		off += csize;
+	} else {
+		off += (int64_t) n * fp_len;
+	}
+	for (i = 0; i < n; i++) {
+		memcpy(r[i].fp, fps + (int64_t) i * fp_len, fp_len);
+		memset(r[i].fp + fp_len, 0, sizeof(fingerprint) - fp_len);
+	}
+	free(tmp);
+
+	containerid prev = 0;
+	for (i = 0; i < n;) {
+		uint64_t delta, len;
+		off += get_varint(buf + off, &delta);
+		off += get_varint(buf + off, &len);
+		prev += unzigzag(delta);
+		for (; len > 0; len--)
+			r[i++].id = prev;
+	}
+
+	for (i = 0; i < n; i++) {
+		uint64_t size;
+		off += get_varint(buf + off, &size);
+		r[i].size = size;
+	}
+}
+
+/*
+ * A .crecipe being written.
+ * Chunk pointers may arrive out of order, as the recipe pass of an upgrade
+ * writes each unit at its own offset, so a block is kept until all of its
+ * chunks are there, and the blocks are written in the order they complete.
+ * A pending block keeps only the runs of records written so far. When more
+ * than COLUMNAR_PENDING_RECORDS records are pending, the runs of the largest
+ * pending blocks are spilled to a temporary file until the block completes.
+ */
+#define COLUMNAR_PENDING_RECORDS (8 * COLUMNAR_BLOCK_CHUNKS)
+
+struct columnarWriter {
+	FILE *fp;
+	int bv_num;
+	int64_t off;
+	int64_t chunk_num;
+	int64_t raw;
+
+	/* block number -> columnarPending */
+	GHashTable *pending;
+	/* the records of the pending blocks in memory */
+	int64_t resident;
+	FILE *spill;
+	int64_t spill_off;
+	struct columnarBlock *blocks;
+	int64_t block_cap;
+
+	/* a block being encoded */
+	struct recipeRecord *records;
+	unsigned char *buf;
+	unsigned char *tmp;
+	ZSTD_CCtx *cctx;
+};
+
+/* consecutive records of a pending block, in memory or spilled */
+struct columnarRun {
+	int first;
+	int n;
+	int cap;
+	/* NULL once spilled to spill_off */
+	struct recipeRecord *records;
+	int64_t spill_off;
+	struct columnarRun *next;
+};
+
+struct columnarPending {
+	int64_t block;
+	int filled;
+	int resident;
+	/* the last written run first */
+	struct columnarRun *runs;
+};
+
+/*
+ * Create bvN.crecipe of b, written by columnar_writer_put
+ * and completed by close_columnar_writer.
+ */
+struct columnarWriter* new_columnar_writer(struct backupVersion *b) {
+	sds fname = sdsdup(b->fname_prefix);
+	fname = sdscat(fname, ".crecipe");
+	FILE *fp = fopen(fname, "w");
+	sdsfree(fname);
+	if (!fp) {
+		fprintf(stderr, "Can not create bv%d.crecipe!\n", b->bv_num);
+		exit(1);
+	}
+
+	struct columnarWriter *w = (struct columnarWriter *) calloc(1,
+			sizeof(struct columnarWriter));
+	w->fp = fp;
+	w->bv_num = b->bv_num;
+	/* the header is written last */
+	w->off = sizeof(struct columnarHeader);
+	fseek(fp, w->off, SEEK_SET);
+	w->pending = g_hash_table_new(g_int64_hash, g_int64_equal);
+	w->records = (struct recipeRecord *) malloc(
+			sizeof(struct recipeRecord) * COLUMNAR_BLOCK_CHUNKS);
+	w->buf = (unsigned char *) malloc(BLOCK_BOUND(COLUMNAR_BLOCK_CHUNKS));
+	w->tmp = (unsigned char *) malloc(BLOCK_BOUND(COLUMNAR_BLOCK_CHUNKS));
+	w->cctx = ZSTD_createCCtx();
+	return w;
+}
+
+/* Append the m records r at i of block p, to its last run if they follow it. */
+static void pending_append(struct columnarWriter *w, struct columnarPending *p,
+		int i, struct recipeRecord *r, int m) {
+	struct columnarRun *run = p->runs;
+	if (!run || (run->n && !run->records) || run->first + run->n != i) {
+		run = (struct columnarRun *) calloc(1, sizeof(struct columnarRun));
+		run->first = i;
+		run->next = p->runs;
+		p->runs = run;
+	}
+	if (run->n + m > run->cap) {
+		run->cap = MAX(run->n + m, MAX(2 * run->cap, 64));
+		run->cap = MIN(run->cap, COLUMNAR_BLOCK_CHUNKS - run->first);
+		run->records = (struct recipeRecord *) realloc(run->records,
+				sizeof(struct recipeRecord) * run->cap);
+	}
+	memcpy(&run->records[run->n], r, sizeof(struct recipeRecord) * m);
+	run->n += m;
+	p->resident += m;
+	w->resident += m;
+}
+
+/* Move the runs of p in memory to the spill file. */
+static void pending_spill(struct columnarWriter *w, struct columnarPending *p) {
+	if (!w->spill && !(w->spill = tmpfile())) {
+		perror("Can not create the spill file of the columnar recipe");
+		exit(1);
+	}
+	struct columnarRun *run;
+	for (run = p->runs; run; run = run->next) {
+		if (!run->records)
+			continue;
+		if (fwrite(run->records, sizeof(struct recipeRecord), run->n, w->spill) != run->n) {
+			perror("Can not write the spill file of the columnar recipe");
+			exit(1);
+		}
+		run->spill_off = w->spill_off;
+		w->spill_off += sizeof(struct recipeRecord) * run->n;
+		free(run->records);
+		run->records = NULL;
+		run->cap = 0;
+	}
+	w->resident -= p->resident;
+	p->resident = 0;
+}
+
+/* Spill the largest pending blocks until the cap is met. */
+static void pending_limit(struct columnarWriter *w) {
+	while (w->resident > COLUMNAR_PENDING_RECORDS) {
+		GHashTableIter iter;
+		gpointer key, value;
+		struct columnarPending *largest = NULL;
+		g_hash_table_iter_init(&iter, w->pending);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			struct columnarPending *p = value;
+			if (!largest || p->resident > largest->resident)
+				largest = p;
+		}
+		pending_spill(w, largest);
+	}
+}
+
+static void write_block(struct columnarWriter *w, struct columnarPending *p, int n) {
+	if (p->block >= w->block_cap) {
+		int64_t cap = w->block_cap ? w->block_cap : 64;
+		while (cap <= p->block)
+			cap *= 2;
+		w->blocks = (struct columnarBlock *) realloc(w->blocks,
+				sizeof(struct columnarBlock) * cap);
+		memset(w->blocks + w->block_cap, 0,
+				sizeof(struct columnarBlock) * (cap - w->block_cap));
+		w->block_cap = cap;
+	}
+
+	int flushed = 0;
+	struct columnarRun *run = p->runs;
+	while (run) {
+		struct columnarRun *next = run->next;
+		if (run->records) {
+			memcpy(&w->records[run->first], run->records,
+					sizeof(struct recipeRecord) * run->n);
+		} else {
+			if (!flushed) {
+				fflush(w->spill);
+				flushed = 1;
+			}
+			full_pread(fileno(w->spill), &w->records[run->first],
+					sizeof(struct recipeRecord) * run->n, run->spill_off);
+		}
+		free(run->records);
+		free(run);
+		run = next;
+	}
+	w->resident -= p->resident;
+
+	int64_t size = encode_block(w->records, n, w->buf, w->tmp, w->cctx);
+	fwrite(w->buf, size, 1, w->fp);
+	w->blocks[p->block].off = w->off;
+	w->blocks[p->block].size = size;
+	w->blocks[p->block].chunk_num = n;
+	w->off += size;
+	w->raw += (int64_t) n * RECIPE_RECORD_SIZE;
+
+	g_hash_table_remove(w->pending, &p->block);
+	free(p);
+}
+
+/*
+ * Put the n records of the chunks from first on.
+ */
+void columnar_writer_put(struct columnarWriter *w, int64_t first,
+		struct recipeRecord *r, int n) {
+	int k = 0;
+	while (k < n) {
+		int64_t block = (first + k) / COLUMNAR_BLOCK_CHUNKS;
+		struct columnarPending *p = g_hash_table_lookup(w->pending, &block);
+		if (!p) {
+			p = (struct columnarPending *) calloc(1, sizeof(struct columnarPending));
+			p->block = block;
+			g_hash_table_insert(w->pending, &p->block, p);
+		}
+		int i = (first + k) % COLUMNAR_BLOCK_CHUNKS;
+		int m = MIN(n - k, COLUMNAR_BLOCK_CHUNKS - i);
+		pending_append(w, p, i, &r[k], m);
+		p->filled += m;
+		k += m;
+		if (p->filled == COLUMNAR_BLOCK_CHUNKS)
+			write_block(w, p, COLUMNAR_BLOCK_CHUNKS);
+	}
+	w->chunk_num = MAX(w->chunk_num, first + n);
+	pending_limit(w);
+}
+
+/*
+ * Write the last block, the block index and the header, and close the .crecipe.
+ */
+void close_columnar_writer(struct columnarWriter *w) {
+	struct columnarHeader h;
+	memset(&h, 0, sizeof(h));
+	h.magic = COLUMNAR_MAGIC;
+	h.block_chunks = COLUMNAR_BLOCK_CHUNKS;
+	h.chunk_num = w->chunk_num;
+	h.block_num = (w->chunk_num + COLUMNAR_BLOCK_CHUNKS - 1) / COLUMNAR_BLOCK_CHUNKS;
+
+	/* only the last block can be short, the others must have been complete */
+	assert(g_hash_table_size(w->pending) <= 1);
+	if (g_hash_table_size(w->pending) == 1) {
+		int64_t last = h.block_num - 1;
+		struct columnarPending *p = g_hash_table_lookup(w->pending, &last);
+		assert(p && p->filled == h.chunk_num - last * COLUMNAR_BLOCK_CHUNKS);
+		write_block(w, p, p->filled);
+	}
+
+	h.block_index_off = w->off;
+	if (h.block_num > 0)
+		fwrite(w->blocks, sizeof(struct columnarBlock), h.block_num, w->fp);
+	int64_t size = w->off + sizeof(struct columnarBlock) * h.block_num;
+
+	fseek(w->fp, 0, SEEK_SET);
+	fwrite(&h, sizeof(h), 1, w->fp);
+	fclose(w->fp);
+
+	NOTICE("bv%d.crecipe: %" PRId64 " chunks, %" PRId64 " bytes of %" PRId64,
+			w->bv_num, h.chunk_num, size, w->raw);
+
+	g_hash_table_destroy(w->pending);
+	if (w->spill)
+		fclose(w->spill);
+	ZSTD_freeCCtx(w->cctx);
+	free(w->blocks);
+	free(w->records);
+	free(w->buf);
+	free(w->tmp);
+	free(w);
+}
+
+/*
+ * Open bvN.crecipe of b, or return NULL if it does not exist.
+ */
+struct columnarRecipe* open_columnar_recipe(struct backupVersion *b) {
+	sds fname = sdsdup(b->fname_prefix);
+	fname = sdscat(fname, ".crecipe");
+	int fd = open(fname, O_RDONLY);
+	sdsfree(fname);
+	if (fd < 0)
+		return NULL;
+
+	struct columnarRecipe *c = (struct columnarRecipe *) calloc(1,
+			sizeof(struct columnarRecipe));
+	c->fd = fd;
+	full_pread(fd, &c->header, sizeof(c->header), 0);
+	if (c->header.magic != COLUMNAR_MAGIC
+			|| c->header.chunk_num != b->number_of_chunks) {
+		WARNING("bv%d.crecipe is invalid, use bv%d.recipe", b->bv_num, b->bv_num);
+		close(fd);
+		free(c);
+		return NULL;
+	}
+
+	struct columnarHeader *h = &c->header;
+	c->blocks = (struct columnarBlock *) malloc(
+			sizeof(struct columnarBlock) * h->block_num);
+	full_pread(fd, c->blocks, sizeof(struct columnarBlock) * h->block_num,
+			h->block_index_off);
+
+	pthread_mutex_init(&c->mutex, NULL);
+	c->cached_block = -1;
+	c->records = (struct recipeRecord *) malloc(
+			sizeof(struct recipeRecord) * h->block_chunks);
+
+	posix_fadvise(fd, 0, h->block_index_off, POSIX_FADV_SEQUENTIAL);
+	return c;
+}
+
+void close_columnar_recipe(struct columnarRecipe *c) {
+	close(c->fd);
+	pthread_mutex_destroy(&c->mutex);
+	free(c->blocks);
+	free(c->records);
+	free(c);
+}
+
+/*
+ * Decode a block into out, which holds block_chunks records.
+ * Return the number of records, or 0 past the last block.
+ */
+int columnar_recipe_read_block(struct columnarRecipe *c, int64_t block,
+		struct recipeRecord *out) {
+	if (block >= c->header.block_num)
+		return 0;
+	struct columnarBlock *bl = &c->blocks[block];
+	unsigned char *buf = (unsigned char *) malloc(bl->size);
+	full_pread(c->fd, buf, bl->size, bl->off);
+	decode_block(buf, out);
+	free(buf);
+	return bl->chunk_num;
+}
+
+/*
+ * Read n chunk pointers starting at chunk first.
+ */
+void columnar_recipe_read(struct columnarRecipe *c, int64_t first, int n,
+		struct chunkPointer *cp) {
+	assert(first + n <= c->header.chunk_num);
+	pthread_mutex_lock(&c->mutex);
+	int k = 0;
+	while (k < n) {
+		int64_t block = (first + k) / c->header.block_chunks;
+		if (block != c->cached_block) {
+			c->cached_num = columnar_recipe_read_block(c, block, c->records);
+			c->cached_block = block;
+		}
+		int i = (first + k) % c->header.block_chunks;
+		for (; i < c->cached_num && k < n; i++, k++) {
+			memcpy(&cp[k].fp, &c->records[i].fp, sizeof(fingerprint));
+			cp[k].id = c->records[i].id;
+			cp[k].size = c->records[i].size;
+		}
+	}
+	pthread_mutex_unlock(&c->mutex);
+}
@@ -0,0 +1,62 @@
+/*
+ * columnar_recipe.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Boju Chen
+ *
+ * Recipe format v2 (.crecipe), written instead of the flat .recipe of a
+ * backup version when recipe-format is 2, as the chunk pointers arrive.
+ * Chunk pointers are stored in blocks of COLUMNAR_BLOCK_CHUNKS chunks,
+ * each block holding three columns:
+ *   fingerprints, 20 bytes each if all of them are zero-padded SHA-1,
+ *     zstd-compressed if that makes them smaller,
+ *   container ids as runs of (zigzag varint delta, varint length),
+ *   sizes as varints.
+ * A block index gives the offset of every block, so chunk i is found
+ * with one seek.
+ */
+
+#ifndef COLUMNAR_RECIPE_H_
+#define COLUMNAR_RECIPE_H_
+
+#include "recipestore.h"
+
+#define COLUMNAR_MAGIC 0x32524344 /* "DCR2" */
+#define COLUMNAR_BLOCK_CHUNKS 8192
+
+struct columnarHeader {
+	uint32_t magic;
+	uint32_t block_chunks;
+	int64_t chunk_num;
+	int64_t block_num;
+	int64_t block_index_off;
+};
+
+struct columnarBlock {
+	int64_t off;
+	int32_t size;
+	int32_t chunk_num;
+};
+
+struct columnarRecipe {
+	int fd;
+	struct columnarHeader header;
+	struct columnarBlock *blocks;
+
+	/* the last block decoded by columnar_recipe_read */
+	pthread_mutex_t mutex;
+	int64_t cached_block;
+	int cached_num;
+	struct recipeRecord *records;
+};
+
+struct columnarWriter* new_columnar_writer(struct backupVersion *b);
+void columnar_writer_put(struct columnarWriter *w, int64_t first,
+		struct recipeRecord *r, int n);
+void close_columnar_writer(struct columnarWriter *w);
+struct columnarRecipe* open_columnar_recipe(struct backupVersion *b);
+void close_columnar_recipe(struct columnarRecipe *c);
+int columnar_recipe_read_block(struct columnarRecipe *c, int64_t block, struct recipeRecord *out);
+void columnar_recipe_read(struct columnarRecipe *c, int64_t first, int n, struct chunkPointer *cp);
+
+#endif /* COLUMNAR_RECIPE_H_ */
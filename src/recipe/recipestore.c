@@ -5,12 +5,24 @@
  *      Author: fumin
  */
 
+#include <sys/mman.h>
+#include <fnmatch.h>
 #include "recipestore.h"
+#include "columnar_recipe.h"
 #include "../jcr.h"
 
 static int32_t backup_version_count;
 static sds recipepath;
 
+/*
+ * With recipe-format 2, the flat .recipe is only needed
+ * for the segment recipes of logical locality.
+ */
+static int flat_recipe_needed() {
+	return destor.recipe_format == 1
+			|| destor.index_category[1] == INDEX_CATEGORY_LOGICAL_LOCALITY;
+}
+
 void init_recipe_store() {
 	recipepath = sdsdup(destor.working_directory);
 	recipepath = sdscat(recipepath, "/recipes/");
@@ -136,6 +148,9 @@ struct backupVersion* create_backup_version(const char *path) {
 		exit(1);
 	}
 
+	if (destor.recipe_format == 2 && !destor.fake_containers)
+		b->columnar_writer = new_columnar_writer(b);
+
 	sdsfree(fname);
 
 	return b;
@@ -227,6 +242,9 @@ struct backupVersion* open_backup_version(int number) {
 	b->recordbuf = 0;
 	b->recordbufoff = 0;
 
+	/* also with recipe-format 1, as the .recipe may be empty then */
+	b->columnar = open_columnar_recipe(b);
+
 	sdsfree(fname);
 
 	return b;
@@ -234,6 +252,8 @@ struct backupVersion* open_backup_version(int number) {
 
 static containerid access_record = TEMPORARY_ID;
 
+static void write_file_index(struct backupVersion *b);
+
 /*
  * Update the metadata after a backup run is finished.
  */
@@ -265,6 +285,13 @@ void update_backup_version(struct backupVersion *b) {
 	/* An indication of end. */
 	access_record = TEMPORARY_ID;
 	fwrite(&access_record, sizeof(access_record), 1, b->record_fp);
+
+	if (b->columnar_writer) {
+		close_columnar_writer(b->columnar_writer);
+		b->columnar_writer = NULL;
+	}
+	if (!b->deleted && !destor.fake_containers)
+		write_file_index(b);
 }
 
 /*
@@ -288,6 +315,8 @@ void free_backup_version(struct backupVersion *b) {
 		fclose(b->record_fp);
 
 	b->metadata_fp = b->recipe_fp = b->record_fp = 0;
+	if (b->columnar)
+		close_columnar_recipe(b->columnar);
 	sdsfree(b->path);
 	sdsfree(b->fname_prefix);
 	free(b);
@@ -334,6 +363,13 @@ void upgrade_recipe_meta(struct backupVersion* b1, struct backupVersion* b2) {
 	fseek(fp, 0, SEEK_SET);
 	fwrite(&b2->bv_num, sizeof(b2->bv_num), 1, fp);
 	fclose(fp);
+
+	if (b2->columnar_writer) {
+		close_columnar_writer(b2->columnar_writer);
+		b2->columnar_writer = NULL;
+	}
+	if (!destor.fake_containers)
+		write_file_index(b2);
 }
 
 /*
@@ -369,7 +405,7 @@ segmentid append_segment_flag(struct backupVersion* b, int flag, int segment_siz
 	fseek(b->recipe_fp, 0, SEEK_END);
 	int64_t off = ftell(b->recipe_fp);
 
-	if(flag == CHUNK_SEGMENT_START){
+	if(flag == CHUNK_SEGMENT_START && flat_recipe_needed()){
 		/* Two flags and many chunk pointers */
 		b->segmentlen = (sizeof(fingerprint) + sizeof(containerid) + sizeof(int32_t))*segment_size; // * 2
 				// + segment_size * (sizeof(fingerprint) + sizeof(containerid) + sizeof(int32_t));
@@ -384,7 +420,7 @@ segmentid append_segment_flag(struct backupVersion* b, int flag, int segment_siz
 	// memcpy(b->segmentbuf + b->segmentbufoff, &cp.size, sizeof(int32_t));
 	// b->segmentbufoff += sizeof(int32_t);
 
-	if(flag == CHUNK_SEGMENT_END){
+	if(flag == CHUNK_SEGMENT_END && b->segmentbuf){
 		VERBOSE("Filter phase: write a segment start at offset %lld!", off);
 		fwrite(b->segmentbuf, b->segmentlen, 1, b->recipe_fp);
 		free(b->segmentbuf);
@@ -420,12 +456,22 @@ void append_n_chunk_pointers(struct backupVersion* b,
 		access_record = bcp.id;
 		assert(bcp.id != TEMPORARY_ID);
 
-		memcpy(b->segmentbuf + b->segmentbufoff, &bcp.fp, sizeof(fingerprint));
-		b->segmentbufoff += sizeof(fingerprint);
-		memcpy(b->segmentbuf + b->segmentbufoff, &(bcp.id), sizeof(containerid));
-		b->segmentbufoff += sizeof(containerid);
-		memcpy(b->segmentbuf + b->segmentbufoff, &(bcp.size), sizeof(int32_t));
-		b->segmentbufoff += sizeof(int32_t);
+		if (b->segmentbuf) {
+			memcpy(b->segmentbuf + b->segmentbufoff, &bcp.fp, sizeof(fingerprint));
+			b->segmentbufoff += sizeof(fingerprint);
+			memcpy(b->segmentbuf + b->segmentbufoff, &(bcp.id), sizeof(containerid));
+			b->segmentbufoff += sizeof(containerid);
+			memcpy(b->segmentbuf + b->segmentbufoff, &(bcp.size), sizeof(int32_t));
+			b->segmentbufoff += sizeof(int32_t);
+		}
+
+		if (b->columnar_writer) {
+			struct recipeRecord r;
+			memcpy(&r.fp, &bcp.fp, sizeof(fingerprint));
+			r.id = bcp.id;
+			r.size = bcp.size;
+			columnar_writer_put(b->columnar_writer, b->number_of_chunks, &r, 1);
+		}
 
 		b->number_of_chunks++;
 	}
@@ -450,32 +496,73 @@ void write_n_chunks(struct backupVersion* b, struct chunk* cks, int n, int64_t o
 		b->number_of_chunks++;
 		jcr.data_size += bcp.size;
 	}
-	fseek(b->recipe_fp, off, SEEK_SET);
-	fwrite(buf, buf_off, 1, b->recipe_fp);
+	if (flat_recipe_needed()) {
+		fseek(b->recipe_fp, off, SEEK_SET);
+		fwrite(buf, buf_off, 1, b->recipe_fp);
+	}
+	/* no segment boundaries, so the offset is a chunk index */
+	if (b->columnar_writer)
+		columnar_writer_put(b->columnar_writer, off / RECIPE_RECORD_SIZE,
+				(struct recipeRecord *) buf, n);
 	free(buf);
 }
 
+static struct fileRecipeMeta* read_file_recipe_meta(FILE *fp) {
+	int len;
+	fread(&len, sizeof(len), 1, fp);
+	char filename[len + 1];
+	fread(filename, len, 1, fp);
+	filename[len] = 0;
+
+	struct fileRecipeMeta* r = new_file_recipe_meta(filename);
+
+	fread(&r->chunknum, sizeof(r->chunknum), 1, fp);
+	fread(&r->filesize, sizeof(r->filesize), 1, fp);
+
+	return r;
+}
+
 struct fileRecipeMeta* read_next_file_recipe_meta(struct backupVersion* b) {
 
 	static int read_file_num;
 
 	assert(read_file_num <= b->number_of_files);
 
-	int len;
-	fread(&len, sizeof(len), 1, b->metadata_fp);
-	char filename[len + 1];
+	struct fileRecipeMeta* r = read_file_recipe_meta(b->metadata_fp);
 
-	fread(filename, len, 1, b->metadata_fp);
-	filename[len] = 0;
+	read_file_num++;
 
-	struct fileRecipeMeta* r = new_file_recipe_meta(filename);
+	return r;
+}
 
-	fread(&r->chunknum, sizeof(r->chunknum), 1, b->metadata_fp);
-	fread(&r->filesize, sizeof(r->filesize), 1, b->metadata_fp);
+/*
+ * Read the file recipe meta at off of the .meta file, see fileIndexEntry.
+ */
+struct fileRecipeMeta* read_file_recipe_meta_at(struct backupVersion* b, int64_t off) {
+	fseek(b->metadata_fp, off, SEEK_SET);
+	return read_file_recipe_meta(b->metadata_fp);
+}
 
-	read_file_num++;
+static inline int is_segment_boundary(containerid id) {
+	return id == 0 - CHUNK_SEGMENT_START || id == 0 - CHUNK_SEGMENT_END;
+}
 
-	return r;
+/*
+ * Unpack n records into cp, dropping segment boundaries.
+ * Return the number of chunk pointers.
+ */
+static int unpack_chunk_pointers(char *buf, int n, struct chunkPointer *cp) {
+	int k = 0;
+	for (int i = 0; i < n; i++) {
+		struct recipeRecord *r = (struct recipeRecord *) (buf + i * RECIPE_RECORD_SIZE);
+		if (is_segment_boundary(r->id))
+			continue;
+		memcpy(&cp[k].fp, &r->fp, sizeof(fingerprint));
+		cp[k].id = r->id;
+		cp[k].size = r->size;
+		k++;
+	}
+	return k;
 }
 
 /*
@@ -496,19 +583,32 @@ struct chunkPointer* read_next_n_chunk_pointers(struct backupVersion* b, int n,
 	}
 
 	int num = (b->number_of_chunks - read_chunk_num) > n ?
-					n : (b->number_of_chunks - read_chunk_num), i;
+					n : (b->number_of_chunks - read_chunk_num);
 
 	struct chunkPointer *cp = (struct chunkPointer *) malloc(
 			sizeof(struct chunkPointer) * num);
 
-	for (i = 0; i < num; i++) {
-		fread(&(cp[i].fp), sizeof(fingerprint), 1, b->recipe_fp);
-		fread(&(cp[i].id), sizeof(containerid), 1, b->recipe_fp);
-		fread(&(cp[i].size), sizeof(int32_t), 1, b->recipe_fp);
-		/* Ignore segment boundaries */
-		if(cp[i].id == 0 - CHUNK_SEGMENT_START || cp[i].id == 0 - CHUNK_SEGMENT_END)
-			i--;
+	if (b->columnar) {
+		/* keep the stream in step, read_one_file takes chunk offsets from it */
+		int64_t off = ftell(b->recipe_fp);
+		columnar_recipe_read(b->columnar, off / RECIPE_RECORD_SIZE, num, cp);
+		fseek(b->recipe_fp, off + (int64_t) num * RECIPE_RECORD_SIZE, SEEK_SET);
+		*k = num;
+		read_chunk_num += num;
+		return cp;
+	}
+
+	char *buf = (char *) malloc(RECIPE_RECORD_SIZE * num);
+
+	/* Ignore segment boundaries, and read more records in their place */
+	int got = 0;
+	while (got < num) {
+		int want = num - got;
+		int r = fread(buf, RECIPE_RECORD_SIZE, want, b->recipe_fp);
+		assert(r == want);
+		got += unpack_chunk_pointers(buf, r, cp + got);
 	}
+	free(buf);
 
 	*k = num;
 
@@ -519,22 +619,101 @@ struct chunkPointer* read_next_n_chunk_pointers(struct backupVersion* b, int n,
 }
 
 struct chunkPointer* read_n_chunk_pointers(struct backupVersion* b, off_t off, int n) {
-	fseek(b->recipe_fp, off, SEEK_SET);
 	struct chunkPointer *cp = (struct chunkPointer *) malloc(
 			sizeof(struct chunkPointer) * n);
+	if (b->columnar) {
+		/* no segment boundaries, so the offset is a chunk index */
+		columnar_recipe_read(b->columnar, off / RECIPE_RECORD_SIZE, n, cp);
+		return cp;
+	}
 
-	for (int i = 0; i < n; i++) {
-		assert(fread(&(cp[i].fp), sizeof(fingerprint), 1, b->recipe_fp) == 1);
-		assert(fread(&(cp[i].id), sizeof(containerid), 1, b->recipe_fp) == 1);
-		assert(fread(&(cp[i].size), sizeof(int32_t), 1, b->recipe_fp) == 1);
-		/* Ignore segment boundaries */
-		if(cp[i].id == 0 - CHUNK_SEGMENT_START || cp[i].id == 0 - CHUNK_SEGMENT_END) {
-			WARNING("ignore %d %d", i, n);
-			assert(0); // segment boundary will lead to incorrect CDC recipe offset
+	fseek(b->recipe_fp, off, SEEK_SET);
+	char *buf = (char *) malloc(RECIPE_RECORD_SIZE * n);
+
+	int r = fread(buf, RECIPE_RECORD_SIZE, n, b->recipe_fp);
+	assert(r == n);
+	/* segment boundary will lead to incorrect CDC recipe offset */
+	r = unpack_chunk_pointers(buf, n, cp);
+	assert(r == n);
+
+	free(buf);
+	return cp;
+}
+
+#define RECIPE_CURSOR_RECORDS 8192
+
+/*
+ * The cursor starts at the current position of the recipe stream
+ * and reads with pread, so the stream itself does not move.
+ * From the start of the recipe it decodes the .crecipe if there is one.
+ */
+struct recipeCursor* new_recipe_cursor(struct backupVersion* b) {
+	assert(sizeof(struct recipeRecord) == RECIPE_RECORD_SIZE);
+	struct recipeCursor *c = (struct recipeCursor *) malloc(sizeof(struct recipeCursor));
+	c->fd = fileno(b->recipe_fp);
+	c->off = ftell(b->recipe_fp);
+	c->buf = (char *) malloc(RECIPE_CURSOR_RECORDS * RECIPE_RECORD_SIZE);
+	c->num = 0;
+	c->next = 0;
+	c->columnar = b->columnar;
+	c->block = 0;
+	c->skip = 0;
+	if (c->columnar) {
+		assert(c->columnar->header.block_chunks <= RECIPE_CURSOR_RECORDS);
+		/* no segment boundaries, so the offset is a chunk index */
+		c->block = c->off / RECIPE_RECORD_SIZE / c->columnar->header.block_chunks;
+		c->skip = c->off / RECIPE_RECORD_SIZE % c->columnar->header.block_chunks;
+	} else
+		posix_fadvise(c->fd, c->off, 0, POSIX_FADV_SEQUENTIAL);
+	return c;
+}
+
+void free_recipe_cursor(struct recipeCursor* c) {
+	free(c->buf);
+	free(c);
+}
+
+static int recipe_cursor_fill(struct recipeCursor* c) {
+	if (c->columnar) {
+		c->num = columnar_recipe_read_block(c->columnar, c->block++,
+				(struct recipeRecord *) c->buf);
+		c->next = MIN(c->skip, c->num);
+		c->skip = 0;
+		return c->num > c->next;
+	}
+
+	int64_t want = RECIPE_CURSOR_RECORDS * RECIPE_RECORD_SIZE, got = 0;
+	while (got < want) {
+		ssize_t n = pread(c->fd, c->buf + got, want - got, c->off + got);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Can not read the recipe");
+			exit(1);
 		}
+		if (n == 0)
+			break;
+		got += n;
 	}
+	c->num = got / RECIPE_RECORD_SIZE;
+	c->next = 0;
+	c->off += c->num * RECIPE_RECORD_SIZE;
+	return c->num;
+}
 
-	return cp;
+/*
+ * Return the next chunk pointer, skipping segment boundaries,
+ * or NULL at the end of the recipe.
+ * It points into the buffer of the cursor and is valid until the next call.
+ */
+struct recipeRecord* recipe_cursor_next(struct recipeCursor* c) {
+	while (1) {
+		if (c->next == c->num && !recipe_cursor_fill(c))
+			return NULL;
+		struct recipeRecord *r = (struct recipeRecord *) (c->buf + c->next++ * RECIPE_RECORD_SIZE);
+		if (!is_segment_boundary(r->id))
+			return r;
+	}
 }
 
 containerid* read_next_n_records(struct backupVersion* b, int n, int *k) {
@@ -557,6 +736,367 @@ containerid* read_next_n_records(struct backupVersion* b, int n, int *k) {
 	return ids;
 }
 
+static char* map_whole_file(FILE *fp, int64_t *size) {
+	struct stat st;
+	if (fstat(fileno(fp), &st) != 0) {
+		perror("Can not stat the recipe");
+		exit(1);
+	}
+	*size = st.st_size;
+	if (*size == 0)
+		return NULL;
+	char *p = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if (p == MAP_FAILED) {
+		perror("Can not map the recipe");
+		exit(1);
+	}
+	madvise(p, *size, MADV_SEQUENTIAL);
+	return p;
+}
+
+/*
+ * Map the file recipe metas that have not been read yet and their chunk pointers,
+ * for readers that process file recipes in parallel.
+ * The file boundaries are found by one pass over the metas.
+ * The positions of the streams of b are not changed.
+ */
+struct recipeMap* open_recipe_map(struct backupVersion* b) {
+	struct recipeMap *m = (struct recipeMap *) calloc(1, sizeof(struct recipeMap));
+	fflush(b->metadata_fp);
+	m->meta = map_whole_file(b->metadata_fp, &m->meta_size);
+	if (b->columnar) {
+		struct columnarRecipe *c = b->columnar;
+		m->columnar = c;
+		m->recipe_size = c->header.chunk_num * RECIPE_RECORD_SIZE;
+		pthread_mutex_init(&m->mutex, NULL);
+		for (int k = 0; k < RECIPE_MAP_BLOCKS; k++)
+			m->blocks[k].block = -1;
+	} else {
+		m->recipe = map_whole_file(b->recipe_fp, &m->recipe_size);
+	}
+
+	int64_t meta_off = ftell(b->metadata_fp);
+	int64_t chunk_off = ftell(b->recipe_fp);
+	int64_t n = b->number_of_files;
+	m->meta_off = (int64_t *) malloc(sizeof(int64_t) * (n + 1));
+	m->chunk_off = (int64_t *) malloc(sizeof(int64_t) * (n + 1));
+
+	int64_t i;
+	for (i = 0; i < n && meta_off < m->meta_size; i++) {
+		m->meta_off[i] = meta_off;
+		m->chunk_off[i] = chunk_off;
+
+		int len;
+		int64_t chunknum;
+		memcpy(&len, m->meta + meta_off, sizeof(len));
+		meta_off += sizeof(len) + len;
+		memcpy(&chunknum, m->meta + meta_off, sizeof(chunknum));
+		meta_off += sizeof(chunknum) + sizeof(int64_t);
+		chunk_off += chunknum * (sizeof(fingerprint) + sizeof(containerid) + sizeof(int32_t));
+	}
+	assert(meta_off <= m->meta_size);
+	assert(chunk_off <= m->recipe_size);
+	m->number_of_files = i;
+	m->meta_off[i] = meta_off;
+	m->chunk_off[i] = chunk_off;
+	return m;
+}
+
+void close_recipe_map(struct recipeMap* m) {
+	if (m->meta)
+		munmap(m->meta, m->meta_size);
+	if (m->columnar) {
+		pthread_mutex_destroy(&m->mutex);
+		for (int k = 0; k < RECIPE_MAP_BLOCKS; k++)
+			free(m->blocks[k].records);
+	} else if (m->recipe) {
+		munmap(m->recipe, m->recipe_size);
+	}
+	free(m->meta_off);
+	free(m->chunk_off);
+	free(m);
+}
+
+struct fileRecipeMeta* recipe_map_file_meta(struct recipeMap* m, int64_t i) {
+	assert(i < m->number_of_files);
+	char *p = m->meta + m->meta_off[i];
+
+	int len;
+	memcpy(&len, p, sizeof(len));
+	p += sizeof(len);
+	char filename[len + 1];
+	memcpy(filename, p, len);
+	filename[len] = 0;
+	p += len;
+
+	struct fileRecipeMeta* r = new_file_recipe_meta(filename);
+	memcpy(&r->chunknum, p, sizeof(r->chunknum));
+	p += sizeof(r->chunknum);
+	memcpy(&r->filesize, p, sizeof(r->filesize));
+	return r;
+}
+
+/*
+ * Copy the chunk pointers of m from chunk first on in block into cp,
+ * decoding the block if it is not kept.
+ * The block is decoded without the lock, so the readers decode in parallel.
+ * Return the number of chunk pointers copied.
+ */
+static int recipe_map_read_block(struct recipeMap* m, int64_t block,
+		int64_t first, int n, struct chunkPointer *cp) {
+	struct columnarRecipe *c = m->columnar;
+	struct recipeRecord *records = NULL;
+	int num = 0;
+	while (1) {
+		pthread_mutex_lock(&m->mutex);
+		struct recipeMapBlock *b = NULL, *lru = &m->blocks[0];
+		for (int k = 0; k < RECIPE_MAP_BLOCKS; k++) {
+			if (m->blocks[k].block == block)
+				b = &m->blocks[k];
+			if (m->blocks[k].used < lru->used)
+				lru = &m->blocks[k];
+		}
+		if (!b && records) {
+			/* replace the least recently used block */
+			b = lru;
+			free(b->records);
+			b->block = block;
+			b->num = num;
+			b->records = records;
+			records = NULL;
+		}
+		if (b) {
+			b->used = ++m->clock;
+			int i = first % c->header.block_chunks, k = 0;
+			for (; i < b->num && k < n; i++, k++) {
+				memcpy(&cp[k].fp, &b->records[i].fp, sizeof(fingerprint));
+				cp[k].id = b->records[i].id;
+				cp[k].size = b->records[i].size;
+			}
+			pthread_mutex_unlock(&m->mutex);
+			/* another reader decoded the block meanwhile */
+			free(records);
+			return k;
+		}
+		pthread_mutex_unlock(&m->mutex);
+
+		records = (struct recipeRecord *) malloc(
+				sizeof(struct recipeRecord) * c->header.block_chunks);
+		num = columnar_recipe_read_block(c, block, records);
+	}
+}
+
+/*
+ * n chunk pointers starting at off of the .recipe file.
+ * As in read_n_chunk_pointers, there must be no segment boundary.
+ */
+struct chunkPointer* recipe_map_chunk_pointers(struct recipeMap* m, int64_t off, int n) {
+	assert(off + n * (sizeof(fingerprint) + sizeof(containerid) + sizeof(int32_t)) <= m->recipe_size);
+	struct chunkPointer *cp = (struct chunkPointer *) malloc(
+			sizeof(struct chunkPointer) * n);
+	if (m->columnar) {
+		int64_t first = off / RECIPE_RECORD_SIZE;
+		int k = 0;
+		while (k < n) {
+			int64_t block = (first + k) / m->columnar->header.block_chunks;
+			k += recipe_map_read_block(m, block, first + k, n - k, cp + k);
+		}
+		return cp;
+	}
+	char *p = m->recipe + off;
+	for (int i = 0; i < n; i++) {
+		memcpy(&cp[i].fp, p, sizeof(fingerprint));
+		p += sizeof(fingerprint);
+		memcpy(&cp[i].id, p, sizeof(containerid));
+		p += sizeof(containerid);
+		memcpy(&cp[i].size, p, sizeof(int32_t));
+		p += sizeof(int32_t);
+		assert(cp[i].id != 0 - CHUNK_SEGMENT_START && cp[i].id != 0 - CHUNK_SEGMENT_END);
+	}
+	return cp;
+}
+
+#define FILE_INDEX_MAGIC 0x58444946 /* "FIDX" */
+#define FILE_INDEX_HEADER_SIZE (3 * sizeof(int64_t))
+
+static char *sort_names;
+
+static int compare_names(const char *a, int alen, const char *b, int blen) {
+	int c = memcmp(a, b, alen < blen ? alen : blen);
+	return c ? c : alen - blen;
+}
+
+static int compare_entries_by_name(const void *a, const void *b) {
+	const struct fileIndexEntry *x = a, *y = b;
+	return compare_names(sort_names + x->name_off, x->name_len,
+			sort_names + y->name_off, y->name_len);
+}
+
+static int compare_entries_by_recipe(const void *a, const void *b) {
+	const struct fileIndexEntry *x = *(struct fileIndexEntry **) a;
+	const struct fileIndexEntry *y = *(struct fileIndexEntry **) b;
+	return x->recipe_off < y->recipe_off ? -1 : x->recipe_off > y->recipe_off;
+}
+
+/*
+ * Write bvN.findex from the complete .meta of b.
+ * The recipe of a file starts where the recipes of the files before it end,
+ * as segment boundaries are not written.
+ */
+static void write_file_index(struct backupVersion *b) {
+	if (b->metadata_fp)
+		fflush(b->metadata_fp);
+
+	sds fname = sdsdup(b->fname_prefix);
+	fname = sdscat(fname, ".meta");
+	FILE *meta = fopen(fname, "r");
+	if (!meta) {
+		fprintf(stderr, "Can not open bv%d.meta!\n", b->bv_num);
+		exit(1);
+	}
+
+	int64_t number_of_files;
+	int pathlen;
+	fseek(meta, sizeof(int32_t) + sizeof(int), SEEK_SET);
+	fread(&number_of_files, sizeof(number_of_files), 1, meta);
+	fseek(meta, sizeof(int64_t), SEEK_CUR);
+	fread(&pathlen, sizeof(pathlen), 1, meta);
+	fseek(meta, pathlen, SEEK_CUR);
+
+	struct fileIndexEntry *entries = (struct fileIndexEntry *) calloc(
+			number_of_files, sizeof(struct fileIndexEntry));
+	sds names = sdsempty();
+	int64_t i, recipe_off = 0;
+	for (i = 0; i < number_of_files; i++) {
+		entries[i].meta_off = ftell(meta);
+		struct fileRecipeMeta *r = read_file_recipe_meta(meta);
+		entries[i].recipe_off = recipe_off;
+		entries[i].chunknum = r->chunknum;
+		entries[i].name_off = sdslen(names);
+		entries[i].name_len = sdslen(r->filename);
+		names = sdscatlen(names, r->filename, sdslen(r->filename));
+		recipe_off += r->chunknum * RECIPE_RECORD_SIZE;
+		free_file_recipe_meta(r);
+	}
+	fclose(meta);
+
+	sort_names = names;
+	qsort(entries, number_of_files, sizeof(struct fileIndexEntry),
+			compare_entries_by_name);
+
+	fname = sdscpy(fname, b->fname_prefix);
+	fname = sdscat(fname, ".findex");
+	FILE *fp = fopen(fname, "w");
+	if (!fp) {
+		fprintf(stderr, "Can not create bv%d.findex!\n", b->bv_num);
+		exit(1);
+	}
+	int64_t magic = FILE_INDEX_MAGIC, names_size = sdslen(names);
+	fwrite(&magic, sizeof(magic), 1, fp);
+	fwrite(&number_of_files, sizeof(number_of_files), 1, fp);
+	fwrite(&names_size, sizeof(names_size), 1, fp);
+	fwrite(entries, sizeof(struct fileIndexEntry), number_of_files, fp);
+	fwrite(names, names_size, 1, fp);
+	fclose(fp);
+
+	free(entries);
+	sdsfree(names);
+	sdsfree(fname);
+}
+
+/*
+ * Map bvN.findex of b, or return NULL if it does not exist.
+ */
+struct fileIndex* open_file_index(struct backupVersion* b) {
+	sds fname = sdsdup(b->fname_prefix);
+	fname = sdscat(fname, ".findex");
+	FILE *fp = fopen(fname, "r");
+	sdsfree(fname);
+	if (!fp)
+		return NULL;
+
+	struct fileIndex *fi = (struct fileIndex *) calloc(1, sizeof(struct fileIndex));
+	fi->map = map_whole_file(fp, &fi->map_size);
+	fclose(fp);
+	if (fi->map_size < FILE_INDEX_HEADER_SIZE
+			|| ((int64_t *) fi->map)[0] != FILE_INDEX_MAGIC
+			|| ((int64_t *) fi->map)[1] != b->number_of_files) {
+		WARNING("bv%d.findex is invalid", b->bv_num);
+		close_file_index(fi);
+		return NULL;
+	}
+	/* binary searches touch a few pages only */
+	madvise(fi->map, fi->map_size, MADV_RANDOM);
+
+	fi->number_of_files = ((int64_t *) fi->map)[1];
+	fi->entries = (struct fileIndexEntry *) (fi->map + FILE_INDEX_HEADER_SIZE);
+	fi->names = (char *) (fi->entries + fi->number_of_files);
+	return fi;
+}
+
+void close_file_index(struct fileIndex* fi) {
+	if (fi->map)
+		munmap(fi->map, fi->map_size);
+	free(fi);
+}
+
+/*
+ * Return the entries of the files matching pattern, in recipe order.
+ * A pattern without wildcards matches the file of that name and,
+ * as a directory, every file under it.
+ * A pattern with wildcards matches as a shell glob, * does not cross a /.
+ * Only the files sharing the literal prefix of the pattern are examined.
+ */
+struct fileIndexEntry** file_index_match(struct fileIndex* fi, const char *pattern, int64_t *n) {
+	int plen = strcspn(pattern, "*?[\\");
+	int wildcard = pattern[plen] != 0;
+
+	/* the first name not less than the prefix */
+	int64_t lo = 0, hi = fi->number_of_files;
+	while (lo < hi) {
+		int64_t mid = lo + (hi - lo) / 2;
+		struct fileIndexEntry *e = &fi->entries[mid];
+		if (compare_names(fi->names + e->name_off, e->name_len, pattern, plen) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	int64_t size = 16;
+	struct fileIndexEntry **matches = (struct fileIndexEntry **) malloc(
+			sizeof(struct fileIndexEntry *) * size);
+	*n = 0;
+	for (; lo < fi->number_of_files; lo++) {
+		struct fileIndexEntry *e = &fi->entries[lo];
+		char *name = fi->names + e->name_off;
+		if (e->name_len < plen || memcmp(name, pattern, plen) != 0)
+			break;
+
+		int match;
+		if (wildcard) {
+			char s[e->name_len + 1];
+			memcpy(s, name, e->name_len);
+			s[e->name_len] = 0;
+			match = fnmatch(pattern, s, FNM_PATHNAME) == 0;
+		} else {
+			match = plen == 0 || e->name_len == plen
+					|| pattern[plen - 1] == '/' || name[plen] == '/';
+		}
+		if (!match)
+			continue;
+
+		if (*n == size) {
+			size *= 2;
+			matches = (struct fileIndexEntry **) realloc(matches,
+					sizeof(struct fileIndexEntry *) * size);
+		}
+		matches[(*n)++] = e;
+	}
+
+	qsort(matches, *n, sizeof(struct fileIndexEntry *), compare_entries_by_recipe);
+	return matches;
+}
+
 struct fileRecipeMeta* new_file_recipe_meta(char* name) {
 	struct fileRecipeMeta* r = (struct fileRecipeMeta*) malloc(sizeof(struct fileRecipeMeta));
 	r->filename = sdsnew(name);
@@ -698,13 +1238,19 @@ struct segmentRecipe* read_next_segment(struct backupVersion *bv){
 	struct segmentRecipe* sr = new_segment_recipe();
 	sr->id = make_segment_id(bv->bv_num, current_off, flag.size);
 
+	/* the chunk pointers and the end flag in one read */
+	char *buf = (char *) malloc(RECIPE_RECORD_SIZE * (flag.size + 1));
+	ret = fread(buf, RECIPE_RECORD_SIZE, flag.size + 1, bv->recipe_fp);
+	assert(ret == flag.size + 1);
+
 	int i;
 	for (i = 0; i < flag.size; i++) {
+		struct recipeRecord *r = (struct recipeRecord *) (buf + i * RECIPE_RECORD_SIZE);
 		struct chunkPointer* cp = (struct chunkPointer*) malloc(
 				sizeof(struct chunkPointer));
-		fread(&cp->fp, sizeof(cp->fp), 1, bv->recipe_fp);
-		fread(&cp->id, sizeof(cp->id), 1, bv->recipe_fp);
-		fread(&cp->size, sizeof(cp->size), 1, bv->recipe_fp);
+		memcpy(&cp->fp, &r->fp, sizeof(cp->fp));
+		cp->id = r->id;
+		cp->size = r->size;
 		if(cp->id <= TEMPORARY_ID){
 			WARNING("expect > 0, but being %lld", cp->id);
 			assert(cp->id > TEMPORARY_ID);
@@ -712,10 +1258,9 @@ struct segmentRecipe* read_next_segment(struct backupVersion *bv){
 		g_hash_table_replace(sr->kvpairs, &cp->fp, cp);
 	}
 
-	fread(&flag.fp, sizeof(flag.fp), 1, bv->recipe_fp);
-	fread(&flag.id, sizeof(flag.id), 1, bv->recipe_fp);
-	fread(&flag.size, sizeof(flag.size), 1, bv->recipe_fp);
-	assert(flag.id == 0 - CHUNK_SEGMENT_END);
+	struct recipeRecord *end = (struct recipeRecord *) (buf + flag.size * RECIPE_RECORD_SIZE);
+	assert(end->id == 0 - CHUNK_SEGMENT_END);
+	free(buf);
 
 	return sr;
 }
@@ -49,6 +49,15 @@ struct backupVersion {
 	char* segmentbuf;
 	int segmentlen;
 	int segmentbufoff;
+
+	/*
+	 * The .crecipe of the version, if it has one, see columnar_recipe.h.
+	 * Then the .recipe is only written if segment recipes are read from it,
+	 * and is otherwise empty. Its stream position is still kept in step
+	 * as the offset of the next chunk pointer.
+	 */
+	struct columnarRecipe *columnar;
+	struct columnarWriter *columnar_writer;
 };
 
 /* Point to the meta of a file recipe */
@@ -67,6 +76,9 @@ struct segmentRecipe {
 	segmentid id;
 	/* Map fingerprints in the segment to their container IDs.*/
 	GHashTable *kvpairs;
+
+	/* for a hashedCache keyed by id */
+	struct cacheNode node;
 };
 
 /*
@@ -81,6 +93,88 @@ struct chunkPointer {
 	int32_t size;
 };
 
+/* A chunk pointer as stored in the .recipe file */
+struct recipeRecord {
+	fingerprint fp;
+	containerid id;
+	int32_t size;
+} __attribute__((packed));
+
+#define RECIPE_RECORD_SIZE (sizeof(fingerprint) + sizeof(containerid) + sizeof(int32_t))
+
+/*
+ * A sequential reader of the .recipe file.
+ * It reads large blocks of records and returns pointers into its buffer.
+ */
+struct recipeCursor {
+	int fd;
+	int64_t off; /* file offset of the next block */
+	char *buf;
+	int num; /* records in buf */
+	int next; /* the next record in buf */
+
+	/* decode blocks of the .crecipe instead, if set */
+	struct columnarRecipe *columnar;
+	int64_t block;
+	int skip; /* records to skip in the first block */
+};
+
+/*
+ * A read-only mapping of the remaining file recipe metas and their chunk pointers.
+ * The meta of file i is at meta + meta_off[i], and its chunk pointers
+ * start at chunk_off[i] in the .recipe file.
+ * With a .crecipe, the chunk pointers are decoded a block at a time instead,
+ * and the last RECIPE_MAP_BLOCKS blocks are kept for the readers.
+ */
+#define RECIPE_MAP_BLOCKS 16
+
+struct recipeMapBlock {
+	int64_t block;
+	int num;
+	int64_t used;
+	struct recipeRecord *records;
+};
+
+struct recipeMap {
+	char *meta;
+	int64_t meta_size;
+	char *recipe;
+	int64_t recipe_size;
+
+	struct columnarRecipe *columnar;
+	pthread_mutex_t mutex;
+	int64_t clock;
+	struct recipeMapBlock blocks[RECIPE_MAP_BLOCKS];
+
+	int64_t number_of_files;
+	int64_t *meta_off;
+	int64_t *chunk_off;
+};
+
+/*
+ * The file index of a backup version (.findex), sorted by file name.
+ * An entry locates the meta of a file in the .meta file
+ * and its chunk pointers in the .recipe file,
+ * so a few files can be restored without reading the recipes before them.
+ */
+struct fileIndexEntry {
+	int64_t meta_off;
+	int64_t recipe_off;
+	int64_t chunknum;
+	int64_t name_off;
+	int32_t name_len;
+	int32_t pad;
+};
+
+struct fileIndex {
+	char *map;
+	int64_t map_size;
+
+	int64_t number_of_files;
+	struct fileIndexEntry *entries;
+	char *names;
+};
+
 void init_recipe_store();
 void close_recipe_store();
 
@@ -96,10 +190,21 @@ void append_n_chunk_pointers(struct backupVersion* b,
 		struct chunkPointer* cp, int n);
 void write_n_chunks(struct backupVersion* b, struct chunk* cks, int n, int64_t off);
 struct fileRecipeMeta* read_next_file_recipe_meta(struct backupVersion* b);
+struct fileRecipeMeta* read_file_recipe_meta_at(struct backupVersion* b, int64_t off);
 struct chunkPointer* read_next_n_chunk_pointers(struct backupVersion* b, int n,
 		int *k);
 struct chunkPointer* read_n_chunk_pointers(struct backupVersion* b, off_t off, int n);
 containerid* read_next_n_records(struct backupVersion* b, int n, int *k);
+struct recipeCursor* new_recipe_cursor(struct backupVersion* b);
+void free_recipe_cursor(struct recipeCursor* c);
+struct recipeRecord* recipe_cursor_next(struct recipeCursor* c);
+struct recipeMap* open_recipe_map(struct backupVersion* b);
+void close_recipe_map(struct recipeMap* m);
+struct fileRecipeMeta* recipe_map_file_meta(struct recipeMap* m, int64_t i);
+struct chunkPointer* recipe_map_chunk_pointers(struct recipeMap* m, int64_t off, int n);
+struct fileIndex* open_file_index(struct backupVersion* b);
+void close_file_index(struct fileIndex* fi);
+struct fileIndexEntry** file_index_match(struct fileIndex* fi, const char *pattern, int64_t *n);
 struct fileRecipeMeta* new_file_recipe_meta(char* name);
 struct fileRecipeMeta* copy_file_recipe_meta(struct fileRecipeMeta* r);
 void free_file_recipe_meta(struct fileRecipeMeta* r);
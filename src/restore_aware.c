@@ -7,7 +7,6 @@
  */
 #include "rewrite_phase.h"
 #include "storage/containerstore.h"
-#include "utils/lru_cache.h"
 
 struct {
 	int64_t total_size;
@@ -16,13 +15,14 @@ struct {
 	int ccf;
 	double cfl; //ocf/ccf
 
-	struct lruCache *cache;
+	struct hashedCache *cache;
 } monitor;
 
-static int container_record_check_id(struct containerRecord* a,
-		containerid *id){
-	return a->cid == *id ? 1 : 0;
-}
+/* A container in the simulated restore cache */
+struct cachedContainer {
+	containerid cid;
+	struct cacheNode node;
+};
 
 /*static int container_record_equal(struct containerRecord* a,
 		struct containerRecord* b) {
@@ -35,8 +35,9 @@ void init_restore_aware() {
 	monitor.ccf = 0;
 	monitor.ocf = 0;
 	monitor.cfl = 0;
-	monitor.cache = new_lru_cache(destor.restore_cache[1], free,
-			container_record_check_id);
+	monitor.cache = new_hashed_cache(CACHE_POLICY_LRU, destor.restore_cache[1],
+			offsetof(struct cachedContainer, node), g_int64_hash, g_int64_equal,
+			free);
 }
 
 /*
@@ -45,12 +46,12 @@ void init_restore_aware() {
 void restore_aware_update(containerid id, int32_t chunklen) {
 	monitor.total_size += chunklen + CONTAINER_META_ENTRY;
 
-	struct containerRecord* record = lru_cache_lookup(monitor.cache, &id);
+	struct cachedContainer* record = hashed_cache_lookup(monitor.cache, &id);
 	if (!record) {
-		record = (struct containerRecord*) malloc(
-				sizeof(struct containerRecord));
+		record = (struct cachedContainer*) malloc(
+				sizeof(struct cachedContainer));
 		record->cid = id;
-		lru_cache_insert(monitor.cache, record, NULL, NULL);
+		hashed_cache_insert(monitor.cache, record, &record->cid, 1);
 
 		monitor.ccf++;
 	}
@@ -60,7 +61,7 @@ void restore_aware_update(containerid id, int32_t chunklen) {
 }
 
 int restore_aware_contains(containerid id) {
-	return lru_cache_lookup_without_update(monitor.cache, &id) ? 1 : 0;
+	return hashed_cache_peek(monitor.cache, &id) ? 1 : 0;
 }
 
 double restore_aware_get_cfl() {
@@ -108,22 +108,26 @@ struct chunk* rewrite_buffer_pop() {
  * If rewrite is disable.
  */
 static void* no_rewrite(void* arg) {
-	while (1) {
-		struct chunk* c = sync_queue_pop(dedup_queue);
-
-		if (c == NULL)
-			break;
-
-		sync_queue_push(rewrite_queue, c);
+	struct chunk* cks[SYNC_QUEUE_READER_BATCH];
+	int n, i;
+	/* forward the chunks in batches */
+	while ((n = sync_queue_pop_n(dedup_queue, (void **) cks,
+			SYNC_QUEUE_READER_BATCH, 1, -1))) {
+
+		/* History-Aware Rewriting */
+		if (destor.rewrite_enable_har) {
+			for (i = 0; i < n; i++) {
+				if (CHECK_CHUNK(cks[i], CHUNK_DUPLICATE))
+					har_check(cks[i]);
+			}
+		}
 
-        /* History-Aware Rewriting */
-        if (destor.rewrite_enable_har && CHECK_CHUNK(c, CHUNK_DUPLICATE))
-            har_check(c);
-    }
+		sync_queue_push_n(rewrite_queue, (void **) cks, n);
+	}
 
-    sync_queue_term(rewrite_queue);
+	sync_queue_term(rewrite_queue);
 
-    return NULL;
+	return NULL;
 }
 
 void start_rewrite_phase() {
@@ -3,7 +3,6 @@
 #include "jcr.h"
 #include "update.h"
 #include "utils/cache.h"
-#include "utils/lru_cache.h"
 #include "utils/sync_queue.h"
 #include "index/upgrade_cache.h"
 
@@ -194,16 +193,13 @@ void free_featureList(gpointer data) {
 	free(list);
 }
 
-int compare_container_id(void *a, void *b) {
-	return *(containerid*) a == *(containerid*) b;
-}
-
 static void feature_table_insert(GHashTable *featureTable[FEATURE_NUM], feature features[FEATURE_NUM], containerid recipeID) {
 	for (int i = 0; i < FEATURE_NUM; i++) {
 		assert(features[i] != ULONG_MAX);
 		struct featureList *list = g_hash_table_lookup(featureTable[i], &features[i]);
 		if (!list) {
 			list = malloc(sizeof(struct featureList));
+			list->head = 0;
 			list->count = 0;
 			list->max_count = 1;
 			list->recipeIDList = malloc(sizeof(containerid) * list->max_count);
@@ -217,18 +213,29 @@ static void feature_table_insert(GHashTable *featureTable[FEATURE_NUM], feature
 	}
 }
 
+static void calculate_features(struct chunkPointer *cp, int64_t n, feature features[FEATURE_NUM]) {
+	for (int k = 0; k < FEATURE_NUM; k++) {
+		features[k] = ULONG_MAX;
+	}
+	for (int64_t j = 0; j < n; j++) {
+		for (int k = 0; k < FEATURE_NUM; k++) {
+			if (destor.upgrade_cdc_level == UPGRADE_CDC_CHUNK) {
+				features[k] = MIN(features[k], CALC_FEATURE(*(containerid *)(cp[j].fp), k));
+			} else {
+				features[k] = MIN(features[k], CALC_FEATURE(cp[j].id, k));
+			}
+		}
+	}
+}
+
 static recipeUnit_t *read_one_file(feature features[FEATURE_NUM]) {
 	static int file_num = 0;
 	if (file_num >= jcr.bv->number_of_files) {
 		return NULL;
 	}
 
-	int i, j, k;
-	for (i = 0; i < FEATURE_NUM; i++) {
-		features[i] = ULONG_MAX;
-	}
-
 	recipeUnit_t *unit = malloc(sizeof(recipeUnit_t));
+	unit->staged = NULL;
 	unit->chunk_off = ftell(jcr.bv->recipe_fp);
 	assert(unit->chunk_off % (sizeof(fingerprint) + sizeof(containerid) + sizeof(int32_t)) == 0);
 
@@ -243,17 +250,7 @@ static recipeUnit_t *read_one_file(feature features[FEATURE_NUM]) {
 	unit->sub_id = 0;
 	unit->total_num = 1;
 	unit->chunk_num = r->chunknum;
-	
-	// calculate features
-	for (j = 0; j < r->chunknum; j++) {
-		for (k = 0; k < FEATURE_NUM; k++) {
-			if (destor.upgrade_cdc_level == UPGRADE_CDC_CHUNK) {
-				features[k] = MIN(features[k], CALC_FEATURE(*(containerid *)(cp[j].fp), k));
-			} else {
-				features[k] = MIN(features[k], CALC_FEATURE(cp[j].id, k));
-			}
-		}
-	}
+	calculate_features(cp, r->chunknum, features);
 
 	file_num++;
 	jcr.pre_process_file_num++;
@@ -278,8 +275,27 @@ static int calculate_unique_container(recipeUnit_t *u, GHashTable *htb) {
 	return size;
 }
 
-static void CDC_recipe(DynamicArray *array, GHashTable *featureTable[FEATURE_NUM], recipeUnit_t *u) {
+/*
+ * The units of one file recipe and their features,
+ * produced by a pre-processing worker and merged in file order.
+ */
+typedef struct {
+	DynamicArray *units;
+	DynamicArray *features; // feature[FEATURE_NUM] of each unit
+	int physical_unique;
+	int logic_unique;
+} preprocessResult_t;
+
+static void preprocess_result_add(preprocessResult_t *res, recipeUnit_t *u, feature features[FEATURE_NUM]) {
+	feature *f = malloc(sizeof(feature) * FEATURE_NUM);
+	memcpy(f, features, sizeof(feature) * FEATURE_NUM);
+	dynamic_array_add(res->units, u);
+	dynamic_array_add(res->features, f);
+}
+
+static void CDC_recipe(preprocessResult_t *res, recipeUnit_t *u) {
 	assert(destor.CDC_exp_size - destor.CDC_min_size > 0);
+	DynamicArray *array = res->units;
 	int64_t currentSubID = 0, startArrayIndex = array->size, startChunkIndex = 0;
 	GHashTable *cdcTable = g_hash_table_new_full(g_int64_hash, g_int64_equal, free, NULL);
 	for (int i = 0; i < u->recipe->chunknum;) {
@@ -292,6 +308,7 @@ static void CDC_recipe(DynamicArray *array, GHashTable *featureTable[FEATURE_NUM
 		recipeUnit_t *sub = malloc(sizeof(recipeUnit_t));
 		sub->recipe = copy_file_recipe_meta(u->recipe);
 		sub->next = NULL;
+		sub->staged = NULL;
 		sub->sub_id = currentSubID++;
 		startChunkIndex = i;
 
@@ -337,10 +354,9 @@ static void CDC_recipe(DynamicArray *array, GHashTable *featureTable[FEATURE_NUM
 		assert(u->chunk_off % (sizeof(fingerprint) + sizeof(containerid) + sizeof(int32_t)) == 0);
 		sub->chunk_off = u->chunk_off + startChunkIndex * (sizeof(fingerprint) + sizeof(containerid) + sizeof(int32_t));
 
-		feature_table_insert(featureTable, subFeatures, array->size);
-		dynamic_array_add(array, sub);
+		preprocess_result_add(res, sub, subFeatures);
 		NOTICE("Sub recipe %d, chunk num %d unique %d %s", sub->sub_id, sub->chunk_num, g_hash_table_size(cdcTable), u->recipe->filename);
-		jcr.logic_recipe_unique_container += g_hash_table_size(cdcTable);
+		res->logic_unique += g_hash_table_size(cdcTable);
 	}
 	int total = 0;
 	for (int i = startArrayIndex; i < array->size; i++) {
@@ -351,99 +367,133 @@ static void CDC_recipe(DynamicArray *array, GHashTable *featureTable[FEATURE_NUM
 }
 
 recipeUnit_t **recipeList = NULL;
+/* the features of every recipe in recipeList */
+feature **recipeFeatures = NULL;
 // list [ hashtable [ feature -> featureList[ recipe id ] ] ]
 GHashTable *featureTable[FEATURE_NUM];
 int recipe_num = 0;
 
-static int process_recipe(recipeUnit_t ***recipeList, GHashTable *featureTable[FEATURE_NUM]) {
-	// assert(destor.CDC_max_size >= 2 * destor.CDC_min_size); // 确保两个小文件合并后不会超过最大容量
-	DynamicArray *array = dynamic_array_new();
-	GHashTable *cacheTable = g_hash_table_new_full(g_int64_hash, g_int64_equal, free, NULL);
-	recipeUnit_t *cacheListHead = NULL;
-	recipeUnit_t *cacheListTail = NULL;
-	feature cacheFeatures[FEATURE_NUM];
-	int merge_unique_num;
-	
-	while (1) {
-		feature features[FEATURE_NUM];
-		recipeUnit_t *u = read_one_file(features);
-		if (!u) break;
-
-		int unique_num = calculate_unique_container(u, NULL);
-		jcr.physical_recipe_unique_container += unique_num;
-		// 基础版不进行切分合并
-		if (!destor.upgrade_do_split_merge) {
-			NOTICE("file %s num: %d Unique num %d", u->recipe->filename, u->chunk_num, unique_num);
-			feature_table_insert(featureTable, features, array->size);
-			dynamic_array_add(array, u);
-			free(u->chunks);
-			u->chunks = NULL;
-			continue;
-		}
+/*
+ * Pre-process the file recipe i: compute its features and, with split/merge,
+ * split it into sub recipes by CDC over its containers.
+ */
+static void preprocess_one_file(struct recipeMap *m, int64_t i, preprocessResult_t *res) {
+	feature features[FEATURE_NUM];
+	recipeUnit_t *u = malloc(sizeof(recipeUnit_t));
+	u->staged = NULL;
+	u->recipe = recipe_map_file_meta(m, i);
+	u->chunk_off = m->chunk_off[i];
+	assert(u->chunk_off % (sizeof(fingerprint) + sizeof(containerid) + sizeof(int32_t)) == 0);
+	u->chunks = recipe_map_chunk_pointers(m, u->chunk_off, u->recipe->chunknum);
+	u->cks = NULL;
+	u->next = NULL;
+	u->sub_id = 0;
+	u->total_num = 1;
+	u->chunk_num = u->recipe->chunknum;
+	calculate_features(u->chunks, u->chunk_num, features);
+
+	res->units = dynamic_array_new_size(1);
+	res->features = dynamic_array_new_size(1);
+	res->logic_unique = 0;
+
+	int unique_num = calculate_unique_container(u, NULL);
+	res->physical_unique = unique_num;
+	// 基础版不进行切分合并
+	if (!destor.upgrade_do_split_merge) {
+		NOTICE("file %s num: %d Unique num %d", u->recipe->filename, u->chunk_num, unique_num);
+		preprocess_result_add(res, u, features);
+		free(u->chunks);
+		u->chunks = NULL;
+	} else if (unique_num > destor.CDC_max_size) {
+		NOTICE("file %s Unique num %d exceed max size %d", u->recipe->filename, unique_num, destor.CDC_max_size);
+		CDC_recipe(res, u);
+		free_file_recipe_meta(u->recipe);
+		free(u->chunks);
+		free(u);
+	} else {
+		NOTICE("file %s Unique num %d", u->recipe->filename, unique_num);
+		preprocess_result_add(res, u, features);
+		res->logic_unique += unique_num;
+		free(u->chunks);
+		u->chunks = NULL;
+	}
+}
 
-		if (unique_num < destor.CDC_min_size && 0) {
-			assert(0); // 1D not supported
-			// merge files
-			if (!cacheListHead) {
-				cacheListHead = u;
-				cacheListTail = u;
-			} else {
-				cacheListTail->next = u;
-				cacheListTail = u;
-			}
-			for (int i = 0; i < FEATURE_NUM; i++) {
-				cacheFeatures[i] = MIN(cacheFeatures[i], features[i]);
-			}
-			
-			merge_unique_num = calculate_unique_container(u, cacheTable);
-			free(u->chunks);
-			u->chunks = NULL;
-			assert(merge_unique_num <= destor.CDC_max_size);
-			// 如果合并后的文件仍然小于最小容量, 则继续等待合并
-			if (merge_unique_num < destor.CDC_min_size) {
-				NOTICE("Merge file %s unique_num: %d, merge_unique_num: %d", cacheListHead->recipe->filename, unique_num, merge_unique_num);
-				continue;
-			}
-			NOTICE("Merge end %s unique_num: %d, merge_unique_num: %d", cacheListHead->recipe->filename, unique_num, merge_unique_num);
+#define PREPROCESS_BATCH 64
 
-			// add to recipeList
-			feature_table_insert(featureTable, cacheFeatures, array->size);
-			dynamic_array_add(array, cacheListHead);
-			
-			// reset cache
-			g_hash_table_remove_all(cacheTable);
-			cacheListHead = NULL;
-			cacheListTail = NULL;
-			for (int i = 0; i < FEATURE_NUM; i++) {
-				cacheFeatures[i] = ULONG_MAX;
-			}
-			jcr.logic_recipe_unique_container += merge_unique_num;
-		} else if (unique_num > destor.CDC_max_size) {
-			NOTICE("file %s Unique num %d exceed max size %d", u->recipe->filename, unique_num, destor.CDC_max_size);
-			CDC_recipe(array, featureTable, u);
-			free_file_recipe_meta(u->recipe);
-			free(u->chunks);
-			free(u);
-		} else {
-			NOTICE("file %s Unique num %d", u->recipe->filename, unique_num);
-			feature_table_insert(featureTable, features, array->size);
-			dynamic_array_add(array, u);
-			jcr.logic_recipe_unique_container += unique_num;
-			free(u->chunks);
-			u->chunks = NULL;
+static struct {
+	struct recipeMap *map;
+	preprocessResult_t *results;
+	int64_t next_file;
+	pthread_mutex_t mutex;
+} preprocess;
+
+static void* preprocess_recipe_worker(void *arg) {
+	pthread_setname_np(pthread_self(), "process_recipe");
+	while (1) {
+		pthread_mutex_lock(&preprocess.mutex);
+		int64_t begin = preprocess.next_file;
+		preprocess.next_file += PREPROCESS_BATCH;
+		pthread_mutex_unlock(&preprocess.mutex);
+		if (begin >= preprocess.map->number_of_files)
+			break;
+
+		int64_t end = MIN(begin + PREPROCESS_BATCH, preprocess.map->number_of_files);
+		for (int64_t i = begin; i < end; i++) {
+			preprocess_one_file(preprocess.map, i, &preprocess.results[i]);
 		}
+
+		pthread_mutex_lock(&preprocess.mutex);
+		jcr.pre_process_file_num += end - begin;
+		pthread_mutex_unlock(&preprocess.mutex);
 	}
+	return NULL;
+}
 
-	// add the last cache
-	if (cacheListHead) {
-		feature_table_insert(featureTable, cacheFeatures, array->size);
-		dynamic_array_add(array, cacheListHead);
-		jcr.logic_recipe_unique_container += merge_unique_num;
+/*
+ * The file recipes are mapped and pre-processed by upgrade_preprocess_threads
+ * workers. Their units are then merged in file order, so the recipe ids
+ * and the feature tables are the same as with one worker.
+ */
+static int process_recipe(recipeUnit_t ***recipeList, feature ***recipeFeatures,
+		GHashTable *featureTable[FEATURE_NUM]) {
+	preprocess.map = open_recipe_map(jcr.bv);
+	int64_t file_num = preprocess.map->number_of_files;
+	preprocess.results = malloc(sizeof(preprocessResult_t) * file_num);
+	preprocess.next_file = 0;
+	pthread_mutex_init(&preprocess.mutex, NULL);
+
+	int worker_num = destor.upgrade_preprocess_threads > 0 ? destor.upgrade_preprocess_threads : 1;
+	pthread_t *workers = malloc(sizeof(pthread_t) * worker_num);
+	for (int i = 0; i < worker_num; i++)
+		pthread_create(&workers[i], NULL, preprocess_recipe_worker, NULL);
+	for (int i = 0; i < worker_num; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	pthread_mutex_destroy(&preprocess.mutex);
+	close_recipe_map(preprocess.map);
+
+	DynamicArray *array = dynamic_array_new();
+	DynamicArray *features = dynamic_array_new();
+	for (int64_t i = 0; i < file_num; i++) {
+		preprocessResult_t *res = &preprocess.results[i];
+		for (int k = 0; k < res->units->size; k++) {
+			feature_table_insert(featureTable, res->features->data[k], array->size);
+			dynamic_array_add(array, res->units->data[k]);
+			dynamic_array_add(features, res->features->data[k]);
+		}
+		jcr.physical_recipe_unique_container += res->physical_unique;
+		jcr.logic_recipe_unique_container += res->logic_unique;
+		dynamic_array_free(res->features);
+		dynamic_array_free(res->units);
 	}
+	free(preprocess.results);
 
-	*recipeList = array->data;
+	*recipeList = (recipeUnit_t **)array->data;
+	*recipeFeatures = (feature **)features->data;
 	int size = array->size;
 	free(array);
+	free(features);
 	return size;
 }
 
@@ -459,12 +509,12 @@ void* pre_process_recipe_thread(void *arg) {
 	for (int i = 0; i < FEATURE_NUM; i++) {
 		featureTable[i] = g_hash_table_new_full(g_int64_hash, g_int64_equal, free_featureList, NULL);
 	}
-	recipe_num = process_recipe(&recipeList, featureTable);
+	recipe_num = process_recipe(&recipeList, &recipeFeatures, featureTable);
 	TIMER_END(1, jcr.pre_process_recipe_time);
 	return NULL;
 }
 
-static void send_one_recipe(SyncQueue *queue, recipeUnit_t *unit, feature featuresInLRU[FEATURE_NUM], struct lruCache *lru) {
+static void send_one_recipe(SyncQueue *queue, recipeUnit_t *unit, feature featuresInLRU[FEATURE_NUM]) {
 	
 	TIMER_DECLARE(1);
 	TIMER_BEGIN(1);
@@ -486,10 +536,11 @@ static void send_one_recipe(SyncQueue *queue, recipeUnit_t *unit, feature featur
 	}
 	free(cps);
 	TIMER_END(1, jcr.read_recipe_time);
+	upgrade_cache_announce(unit->cks, unit->chunk_num);
 	sync_queue_push(queue, unit);
 }
 
-void send_recipe_unit(SyncQueue *queue, recipeUnit_t *unit, feature featuresInLRU[FEATURE_NUM], struct lruCache *lru) {
+void send_recipe_unit(SyncQueue *queue, recipeUnit_t *unit, feature featuresInLRU[FEATURE_NUM]) {
 
 	for (int k = 0; k < FEATURE_NUM; k++) {
 		featuresInLRU[k] = ULONG_MAX;
@@ -499,7 +550,7 @@ void send_recipe_unit(SyncQueue *queue, recipeUnit_t *unit, feature featuresInLR
 		WARNING("Send merge recipe start");
 		while (unit) {
 			WARNING("Send %s %ld/%ld", unit->recipe->filename, unit->sub_id + 1, unit->total_num);
-			send_one_recipe(queue, unit, featuresInLRU, lru);
+			send_one_recipe(queue, unit, featuresInLRU);
 			// recipeUnit_t *temp = unit;
 			unit = unit->next;
 			// free(temp);
@@ -507,14 +558,80 @@ void send_recipe_unit(SyncQueue *queue, recipeUnit_t *unit, feature featuresInLR
 		WARNING("Send merge recipe end");
 	} else {
 		NOTICE("Send %s %ld/%ld", unit->recipe->filename, unit->sub_id + 1, unit->total_num);
-		send_one_recipe(queue, unit, featuresInLRU, lru);
+		send_one_recipe(queue, unit, featuresInLRU);
 		// free(unit);
 	}
 }
 
+/*
+ * Pick the unsent recipe sharing the most features with the last sent one.
+ * The feature lists are walked from the shortest, and a recipe is scored
+ * on its first visit by comparing its own features with the wanted ones.
+ * A recipe first met in the i-th list shares at most FEATURE_NUM - i
+ * features, so the walk stops once the best recipe has that many.
+ * Sent recipes are dropped from a list when a walk meets them,
+ * keeping the order of the others.
+ * return -1 if no recipe shares a feature
+ */
+static containerid pick_similar_recipe(feature featuresInLRU[FEATURE_NUM], char *sent,
+		int64_t *bestRef) {
+	struct featureList *lists[FEATURE_NUM];
+	int feat[FEATURE_NUM];
+	int n = 0;
+	for (int j = 0; j < FEATURE_NUM; j++) {
+		feature f = featuresInLRU[j];
+		assert(f != ULONG_MAX);
+		struct featureList *list = g_hash_table_lookup(featureTable[j], &f);
+		assert(list);
+		if (!list) continue;
+		assert(list->feature == f);
+		// insertion sort by the number of entries left
+		int i = n++;
+		for (; i > 0 && lists[i - 1]->count - lists[i - 1]->head > list->count - list->head; i--) {
+			lists[i] = lists[i - 1];
+			feat[i] = feat[i - 1];
+		}
+		lists[i] = list;
+		feat[i] = j;
+	}
+
+	containerid best = -1;
+	for (int i = 0; i < n && *bestRef < FEATURE_NUM - i; i++) {
+		struct featureList *list = lists[i];
+		containerid *ids = list->recipeIDList;
+		size_t w = list->head, k;
+		for (k = list->head; k < list->count; k++) {
+			containerid rid = ids[k];
+			if (sent[rid]) continue;
+			ids[w++] = rid;
+			feature *rf = recipeFeatures[rid];
+			int seen = 0;
+			for (int p = 0; p < i && !seen; p++)
+				seen = rf[feat[p]] == featuresInLRU[feat[p]];
+			if (seen) continue;
+			int64_t ref = 0;
+			for (int j = 0; j < FEATURE_NUM; j++)
+				ref += rf[j] == featuresInLRU[j];
+			if (ref > *bestRef) {
+				*bestRef = ref;
+				best = rid;
+				if (*bestRef >= FEATURE_NUM - i) {
+					k++;
+					break;
+				}
+			}
+		}
+		// move the kept entries next to the part not walked
+		size_t kept = w - list->head;
+		memmove(ids + k - kept, ids + list->head, kept * sizeof(containerid));
+		list->head = k - kept;
+	}
+	return best;
+}
+
 void* read_similarity_recipe_thread(void *arg) {
 	pthread_setname_np(pthread_self(), "sim_recipe");
-	int i, j, k;
+	int i;
 	TIMER_DECLARE(1);
 	if (!arg) {
 		TIMER_BEGIN(1);
@@ -523,78 +640,43 @@ void* read_similarity_recipe_thread(void *arg) {
 	}
 
 	// send recipes
-	struct lruCache *lru = new_lru_cache(destor.index_cache_size, free, compare_container_id);
 	feature featuresInLRU[FEATURE_NUM] = { ULONG_MAX, ULONG_MAX, ULONG_MAX, ULONG_MAX };
-	GHashTable *sendedRecipe = g_hash_table_new_full(g_int64_hash, g_int64_equal, free, NULL);
+	char *sent = calloc(recipe_num, sizeof(char));
+	containerid nextUnsent = 0;
 	for (i = 0; i < recipe_num; i++) {
 		// 选择一个与当前缓存最相似的recipe
-		// 使用新的htb记录recipe的引用次数
-		// containerid recipeID -> int64_t ref
 		TIMER_BEGIN(1);
-		GHashTable *recipeRef = g_hash_table_new_full(g_int64_hash, g_int64_equal, free, free);
 		containerid bestRecipeID = -1;
 		int64_t bestRecipeRef = 0;
-		for (j = 0; j < FEATURE_NUM && bestRecipeRef < FEATURE_NUM && i != 0; j++) {
-			feature f = featuresInLRU[j];
-			assert(f != ULONG_MAX);
-			struct featureList *list = g_hash_table_lookup(featureTable[j], &f);
-			assert(list);
-			if (!list) continue;
-			assert(list->feature == f);
-			for (k = 0; k < list->count; k++) {
-				containerid rid = list->recipeIDList[k];
-				// 跳过已发送的recipe
-				if (g_hash_table_lookup(sendedRecipe, &rid)) continue;
-				// recipe引用次数+1
-				int64_t *ref_p = (int64_t*)g_hash_table_lookup(recipeRef, &rid);
-				if (ref_p) {
-					(*ref_p)++;
-				} else {
-					containerid *id_p = malloc(sizeof(containerid));
-					*id_p = rid;
-					ref_p = malloc(sizeof(int64_t));
-					*ref_p = 1;
-					g_hash_table_insert(recipeRef, id_p, ref_p);
-				}
-				// 更新最佳recipe
-				if (*ref_p > bestRecipeRef) {
-					bestRecipeRef = *ref_p;
-					bestRecipeID = rid;
-					assert(bestRecipeRef <= FEATURE_NUM);
-					if (bestRecipeRef == FEATURE_NUM) break;
-				}
-			}
+		if (i != 0) {
+			bestRecipeID = pick_similar_recipe(featuresInLRU, sent, &bestRecipeRef);
 		}
-		g_hash_table_destroy(recipeRef);
 		NOTICE("recipe similarity %ld", bestRecipeRef);
 		// 如果没有找到任何相似的recipe, 选择第一个未发送的recipe
 		if (bestRecipeID == -1) {
-			for (containerid id = 0; id < recipe_num; id++) {
-				if (!g_hash_table_lookup(sendedRecipe, &id)) {
-					bestRecipeID = id;
-					break;
-				}
-			}
+			while (sent[nextUnsent]) nextUnsent++;
+			bestRecipeID = nextUnsent;
 		}
-		assert(bestRecipeID >= 0);
+		assert(bestRecipeID >= 0 && bestRecipeID < recipe_num);
 
-		// 使用htb标记recipe是否已经发送
-		containerid *recipeID_p = malloc(sizeof(containerid));
-		*recipeID_p = bestRecipeID;
-		g_hash_table_insert(sendedRecipe, recipeID_p, "1");
+		// 标记recipe已经发送
+		sent[bestRecipeID] = 1;
 		TIMER_END(1, jcr.read_recipe_time);
 
 		// 发送recipe
 		recipeUnit_t *unit = recipeList[bestRecipeID];
-		send_recipe_unit(upgrade_recipe_queue, unit, featuresInLRU, lru);
+		send_recipe_unit(upgrade_recipe_queue, unit, featuresInLRU);
 	}
 
 	sync_queue_term(upgrade_recipe_queue);
-	free_lru_cache(lru);
-	g_hash_table_destroy(sendedRecipe);
+	free(sent);
 	for (i = 0; i < FEATURE_NUM; i++) {
 		g_hash_table_destroy(featureTable[i]);
 	}
+	for (i = 0; i < recipe_num; i++) {
+		free(recipeFeatures[i]);
+	}
+	free(recipeFeatures);
 	free(recipeList);
 	return NULL;
 }
@@ -622,6 +704,7 @@ void* read_recipe_batch_thread(void *arg) {
 
 		TIMER_END(1, jcr.read_recipe_time);
 		NOTICE("Send recipe %s", r->filename);
+		upgrade_cache_announce(unit->cks, unit->chunk_num);
 		sync_queue_push(upgrade_recipe_queue, unit);
 	}
 
@@ -14,6 +14,7 @@
 typedef uint64_t feature;
 struct featureList {
 	feature feature;
+	size_t head; // the entries before head are dropped
 	size_t count;
 	size_t max_count;
 	containerid *recipeIDList;
@@ -29,6 +30,8 @@ typedef struct recipeUnit {
 	containerid total_num;
 	containerid chunk_num;
 
+	GHashTable *staged; // relations staged by the lookahead prefetcher
+
 	struct recipeUnit *next;
 } recipeUnit_t;
 
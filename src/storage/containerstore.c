@@ -4,11 +4,16 @@
 #include "../jcr.h"
 #include "../destor.h"
 #include "db.h"
+#include <zstd.h>
+#include <zdict.h>
 
 static int64_t container_count = 0;
-static FILE *old_fp, *new_fp;
-/* Control the concurrent accesses to fp. */
-static pthread_mutex_t old_mutex, new_mutex;
+/*
+ * Containers are read and written with pread()/pwrite() at their own
+ * offsets, so readers and the append thread never share a file position
+ * and need no lock.
+ */
+static int old_fd = -1, new_fd = -1;
 
 static pthread_t append_t;
 
@@ -18,8 +23,24 @@ struct metaEntry {
 	int32_t off;
 	int32_t len;
 	fingerprint fp;
+	int32_t raw; // the chunk is stored without compression
 };
 
+/*
+ * A chunk is shorter than a container,
+ * so the serialized len keeps the raw flag in its top bit.
+ */
+#define META_ENTRY_RAW (1U << 31)
+
+static inline int32_t ser_entry_len(struct metaEntry *me) {
+	return me->raw ? (int32_t) (me->len | META_ENTRY_RAW) : me->len;
+}
+
+static inline void unser_entry_len(struct metaEntry *me, int32_t len) {
+	me->raw = ((uint32_t) len & META_ENTRY_RAW) ? 1 : 0;
+	me->len = (uint32_t) len & ~META_ENTRY_RAW;
+}
+
 /*
  * We must ensure a container is either in the buffer or written to disks.
  */
@@ -46,6 +67,39 @@ static void* append_thread(void *arg) {
 	return NULL;
 }
 
+static void read_full(int fd, void *buf, int64_t len, int64_t off) {
+	int64_t done = 0;
+	while (done < len) {
+		ssize_t n = pread(fd, (unsigned char *)buf + done, len - done, off + done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Fail to read a container in container store.");
+			exit(1);
+		}
+		if (n == 0) {
+			/* beyond the end of the pool */
+			memset((unsigned char *)buf + done, 0, len - done);
+			break;
+		}
+		done += n;
+	}
+}
+
+static void write_full(int fd, const void *buf, int64_t len, int64_t off) {
+	int64_t done = 0;
+	while (done < len) {
+		ssize_t n = pwrite(fd, (const unsigned char *)buf + done, len - done, off + done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Fail to write a container in container store.");
+			exit(1);
+		}
+		done += n;
+	}
+}
+
 void init_container_store() {
 	/**
 	 * DESTOR_UPDATE: read container.pool, open container.pool_new
@@ -61,23 +115,23 @@ void init_container_store() {
 
 	if (job == DESTOR_UPDATE) {
 		// 确保不修改原始文件
-		old_fp = fopen(containerfile, "r");
-		assert(old_fp);
-		fread(&container_count, 8, 1, old_fp);
+		old_fd = open(containerfile, O_RDONLY);
+		assert(old_fd >= 0);
+		read_full(old_fd, &container_count, 8, 0);
 	} else {
-		if ((old_fp = fopen(containerfile, "r+"))) {
-			fread(&container_count, 8, 1, old_fp);
-		} else if (!(old_fp = fopen(containerfile, "w+"))) {
+		if ((old_fd = open(containerfile, O_RDWR)) >= 0) {
+			read_full(old_fd, &container_count, 8, 0);
+		} else if ((old_fd = open(containerfile, O_RDWR | O_CREAT, 0644)) < 0) {
 			perror("Can not create container.pool for read and write because");
 			exit(1);
 		}
 	}
-	assert(!posix_fadvise(fileno(old_fp), 0, 0, POSIX_FADV_SEQUENTIAL));
+	assert(!posix_fadvise(old_fd, 0, 0, POSIX_FADV_SEQUENTIAL));
 
 	if (job == DESTOR_UPDATE) {
 		containerfile = sdscat(containerfile, "_new");
 		container_count = 0;
-		if (!(new_fp = fopen(containerfile, "w+"))) {
+		if ((new_fd = open(containerfile, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
 			perror("Can not create container.pool_new for read and write because");
 			exit(1);
 		}
@@ -87,9 +141,6 @@ void init_container_store() {
 
 	container_buffer = sync_queue_new(25);
 
-	pthread_mutex_init(&old_mutex, NULL);
-	pthread_mutex_init(&new_mutex, NULL);
-
 	pthread_create(&append_t, NULL, append_thread, NULL);
 
 	init_upgrade_index_store();
@@ -99,12 +150,11 @@ void init_container_store() {
 void wait_append_thread() {
 	sync_queue_term(container_buffer);
 	pthread_join(append_t, NULL);
-	fflush(new_fp);
-	fsync(fileno(new_fp));
+	fsync(new_fd);
 }
 
 void close_container_store() {
-	FILE *fp = job == DESTOR_UPDATE ? new_fp : old_fp;
+	int fd = job == DESTOR_UPDATE ? new_fd : old_fd;
 
 	if (!destor.upgrade_reorder) {
 		sync_queue_term(container_buffer);
@@ -113,17 +163,13 @@ void close_container_store() {
 
 	NOTICE("append phase stops successfully!");
 
-	fseek(fp, 0, SEEK_SET);
-	fwrite(&container_count, sizeof(container_count), 1, fp);
+	write_full(fd, &container_count, sizeof(container_count), 0);
 
-	fclose(fp);
+	close(fd);
 	if (job == DESTOR_UPDATE) {
-		fclose(old_fp);
+		close(old_fd);
 	}
-	fp = NULL;
-
-	pthread_mutex_destroy(&old_mutex);
-	pthread_mutex_destroy(&new_mutex);
+	old_fd = new_fd = -1;
 
 	close_upgrade_index_store();
 }
@@ -172,12 +218,82 @@ void write_container_async(struct container* c) {
 	sync_queue_push(container_buffer, c);
 }
 
+/*
+ * The dictionaries follow the meta entries.
+ * An old container has zeros there, no dictionary.
+ */
+static void ser_dicts(uint8_t **ptr, struct container *c) {
+	uint8_t *ser_ptr = *ptr;
+	ser_int32(c->dict_num);
+	int i;
+	for (i = 0; i < c->dict_num; i++) {
+		ser_uint32(c->dicts[i].id);
+		ser_int32(c->dicts[i].off);
+		ser_int32(c->dicts[i].len);
+	}
+	*ptr = ser_ptr;
+}
+
+static void unser_dicts(uint8_t *ser_ptr, struct container *c) {
+	unser_int32(c->dict_num);
+	if (c->dict_num == 0)
+		return;
+	c->dicts = calloc(c->dict_num, sizeof(struct containerDict));
+	if (destor.simulation_level < SIMULATION_RESTORE)
+		c->dctx = ZSTD_createDCtx();
+	int i;
+	for (i = 0; i < c->dict_num; i++) {
+		struct containerDict *d = &c->dicts[i];
+		unser_uint32(d->id);
+		unser_int32(d->off);
+		unser_int32(d->len);
+		if (destor.simulation_level < SIMULATION_RESTORE) {
+			d->ddict = ZSTD_createDDict(c->data + d->off, d->len);
+			assert(d->ddict);
+		}
+	}
+}
+
+/*
+ * Copy the data of a chunk in a read container.
+ * A chunk compressed with a dictionary of the container is decompressed,
+ * and marked CHUNK_RAW, since the dictionary does not go with it.
+ */
+static void read_chunk_data(struct container *c, struct metaEntry *me,
+		struct chunk *ck) {
+	unsigned char *src = c->data + me->off;
+	unsigned dict_id = me->raw ? 0 : ZSTD_getDictID_fromFrame(src, me->len);
+	if (dict_id == 0) {
+		memcpy(ck->data, src, me->len);
+		return;
+	}
+
+	int i;
+	for (i = 0; i < c->dict_num && c->dicts[i].id != dict_id; i++)
+		;
+	if (i == c->dict_num) {
+		WARNING("Container %lld misses dictionary %u", c->meta.id, dict_id);
+		exit(1);
+	}
+
+	unsigned long long size = ZSTD_getFrameContentSize(src, me->len);
+	assert(size != ZSTD_CONTENTSIZE_UNKNOWN && size != ZSTD_CONTENTSIZE_ERROR);
+	ck->data = realloc(ck->data, size);
+	size_t len = ZSTD_decompress_usingDDict(c->dctx, ck->data, size, src,
+			me->len, c->dicts[i].ddict);
+	if (ZSTD_isError(len)) {
+		WARNING("ZSTD decompression error: %s", ZSTD_getErrorName(len));
+		exit(1);
+	}
+	ck->size = len;
+	SET_CHUNK(ck, CHUNK_RAW);
+}
+
 /*
  * Called by Append phase
  */
 void write_container(struct container* c) {
-	FILE *fp = job == DESTOR_UPDATE ? new_fp : old_fp;
-	pthread_mutex_t *mutex = job == DESTOR_UPDATE ? &new_mutex : &old_mutex;
+	int fd = job == DESTOR_UPDATE ? new_fd : old_fd;
 
 	assert(c->meta.chunk_num == g_hash_table_size(c->meta.map));
 
@@ -207,25 +323,16 @@ void write_container(struct container* c) {
 		g_hash_table_iter_init(&iter, c->meta.map);
 		while (g_hash_table_iter_next(&iter, &key, &value)) {
 			struct metaEntry *me = (struct metaEntry *) value;
+			int32_t len = ser_entry_len(me);
 			ser_bytes(&me->fp, c->fp_size);
-			ser_bytes(&me->len, sizeof(int32_t));
+			ser_bytes(&len, sizeof(int32_t));
 			ser_bytes(&me->off, sizeof(int32_t));
 		}
+		ser_dicts(&ser_ptr, c);
 
 		ser_end(cur, CONTAINER_META_SIZE);
 
-		pthread_mutex_lock(mutex);
-
-		if (fseek(fp, c->meta.id * CONTAINER_SIZE + 8, SEEK_SET) != 0) {
-			perror("Fail seek in container store.");
-			exit(1);
-		}
-		if(fwrite(c->data, CONTAINER_SIZE, 1, fp) != 1){
-			perror("Fail to write a container in container store.");
-			exit(1);
-		}
-
-		pthread_mutex_unlock(mutex);
+		write_full(fd, c->data, CONTAINER_SIZE, c->meta.id * CONTAINER_SIZE + 8);
 	} else {
 		char buf[CONTAINER_META_SIZE];
 		memset(buf, 0, CONTAINER_META_SIZE);
@@ -241,27 +348,18 @@ void write_container(struct container* c) {
 		g_hash_table_iter_init(&iter, c->meta.map);
 		while (g_hash_table_iter_next(&iter, &key, &value)) {
 			struct metaEntry *me = (struct metaEntry *) value;
+			int32_t len = ser_entry_len(me);
 			ser_bytes(&me->fp, c->fp_size);
-			ser_bytes(&me->len, sizeof(int32_t));
+			ser_bytes(&len, sizeof(int32_t));
 			ser_bytes(&me->off, sizeof(int32_t));
 		}
+		ser_dicts(&ser_ptr, c);
 
 		ser_end(buf, CONTAINER_META_SIZE);
 
-		pthread_mutex_lock(mutex);
-
-		if(fseek(fp, c->meta.id * CONTAINER_META_SIZE + 8, SEEK_SET) != 0){
-			perror("Fail seek in container store.");
-			exit(1);
-		}
-		if(fwrite(buf, CONTAINER_META_SIZE, 1, fp) != 1){
-			perror("Fail to write a container in container store.");
-			exit(1);
-		}
-
-		pthread_mutex_unlock(mutex);
+		write_full(fd, buf, CONTAINER_META_SIZE, c->meta.id * CONTAINER_META_SIZE + 8);
 	}
-	assert(!posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_DONTNEED));
+	assert(!posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED));
 }
 
 void unser_container(struct container *c, unsigned char *cur, containerid id) {
@@ -278,24 +376,30 @@ void unser_container(struct container *c, unsigned char *cur, containerid id) {
 		assert(c->meta.id == id);
 	}
 
+	unser_dicts(ser_ptr + c->meta.chunk_num * (c->fp_size + 2 * sizeof(int32_t)), c);
+
 	c->chunks = (struct chunk *)calloc(c->meta.chunk_num, sizeof(struct chunk));
 	int i;
 	for (i = 0; i < c->meta.chunk_num; i++) {
 		struct metaEntry* me = (struct metaEntry*) malloc(
 				sizeof(struct metaEntry));
 		memset(&me->fp, 0, sizeof(fingerprint));
+		int32_t len;
 		unser_bytes(&me->fp, c->fp_size);
-		unser_bytes(&me->len, sizeof(int32_t));
+		unser_bytes(&len, sizeof(int32_t));
 		unser_bytes(&me->off, sizeof(int32_t));
+		unser_entry_len(me, len);
 		g_hash_table_insert(c->meta.map, &me->fp, me);
 
 		struct chunk *ck = c->chunks + i;
 		ck->id = c->meta.id;
 		ck->size = me->len;
+		if (me->raw)
+			SET_CHUNK(ck, CHUNK_RAW);
 		memcpy(&ck->old_fp, &me->fp, sizeof(fingerprint));
 		if (destor.simulation_level < SIMULATION_RESTORE) {
 			ck->data = malloc(me->len);
-			memcpy(ck->data, c->data + me->off, me->len);
+			read_chunk_data(c, me, ck);
 		} else {
 			ck->data = NULL;
 		}
@@ -309,10 +413,20 @@ void unser_container(struct container *c, unsigned char *cur, containerid id) {
 	}
 }
 
-struct container* _retrieve_container_by_id(containerid id, FILE *fp) {
-	pthread_mutex_t *mutex = fp == new_fp ? &new_mutex : &old_mutex;
+/*
+ * During an upgrade the pages of container.pool are read exactly once,
+ * so they are dropped from the page cache after the read.
+ */
+static void read_container_area(int fd, unsigned char *buf, int64_t len, int64_t off) {
+	read_full(fd, buf, len, off);
+	if (job == DESTOR_UPDATE) {
+		assert(!posix_fadvise(fd, off, len, POSIX_FADV_DONTNEED));
+	}
+}
+
+struct container* _retrieve_container_by_id(containerid id, int fd) {
 	struct container *c = (struct container*) calloc(1, sizeof(struct container));
-	c->fp_size = fp == new_fp ? sizeof(fingerprint) : READ_CONTAINER_SZ;
+	c->fp_size = fd == new_fd ? sizeof(fingerprint) : READ_CONTAINER_SZ;
 
 	init_container_meta(&c->meta);
 
@@ -320,44 +434,31 @@ struct container* _retrieve_container_by_id(containerid id, FILE *fp) {
 	if (destor.simulation_level >= SIMULATION_RESTORE) {
 		c->data = malloc(CONTAINER_META_SIZE);
 
-		pthread_mutex_lock(mutex);
-
 		if (destor.simulation_level >= SIMULATION_APPEND)
-			fseek(fp, id * CONTAINER_META_SIZE + 8, SEEK_SET);
+			read_container_area(fd, c->data, CONTAINER_META_SIZE,
+					id * CONTAINER_META_SIZE + 8);
 		else
-			fseek(fp, (id + 1) * CONTAINER_SIZE - CONTAINER_META_SIZE + 8,
-			SEEK_SET);
-
-		fread(c->data, CONTAINER_META_SIZE, 1, fp);
-
-		pthread_mutex_unlock(mutex);
+			read_container_area(fd, c->data, CONTAINER_META_SIZE,
+					(id + 1) * CONTAINER_SIZE - CONTAINER_META_SIZE + 8);
 
 		cur = c->data;
 	} else {
 		c->data = malloc(CONTAINER_SIZE);
 
-		pthread_mutex_lock(mutex);
-
-		fseek(fp, id * CONTAINER_SIZE + 8, SEEK_SET);
-		fread(c->data, CONTAINER_SIZE, 1, fp);
-
-		pthread_mutex_unlock(mutex);
+		read_container_area(fd, c->data, CONTAINER_SIZE, id * CONTAINER_SIZE + 8);
 
 		cur = &c->data[CONTAINER_SIZE - CONTAINER_META_SIZE];
 	}
-	if (job == DESTOR_UPDATE) {
-		assert(!posix_fadvise(fileno(fp), 0, ftell(fp), POSIX_FADV_DONTNEED));
-	}
 	unser_container(c, cur, id);
 	return c;
 }
 
 struct container* retrieve_container_by_id(containerid id) {
-	return _retrieve_container_by_id(id, old_fp);
+	return _retrieve_container_by_id(id, old_fd);
 }
 
 struct container* retrieve_new_container_by_id(containerid id) {
-	return _retrieve_container_by_id(id, new_fp);
+	return _retrieve_container_by_id(id, new_fd);
 }
 
 static struct containerMeta* container_meta_duplicate(struct container *c) {
@@ -383,8 +484,7 @@ static struct containerMeta* container_meta_duplicate(struct container *c) {
 }
 
 struct containerMeta* retrieve_container_meta_by_id(containerid id) {
-	FILE *fp = job == DESTOR_UPDATE ? new_fp : old_fp;
-	pthread_mutex_t *mutex = fp == new_fp ? &new_mutex : &old_mutex;
+	int fd = job == DESTOR_UPDATE ? new_fd : old_fd;
 	struct containerMeta* cm = NULL;
 
 	/* First, we find it in the buffer */
@@ -399,17 +499,11 @@ struct containerMeta* retrieve_container_meta_by_id(containerid id) {
 
 	unsigned char buf[CONTAINER_META_SIZE];
 
-	pthread_mutex_lock(mutex);
-
 	if (destor.simulation_level >= SIMULATION_APPEND)
-		fseek(fp, id * CONTAINER_META_SIZE + 8, SEEK_SET);
+		read_full(fd, buf, CONTAINER_META_SIZE, id * CONTAINER_META_SIZE + 8);
 	else
-		fseek(fp, (id + 1) * CONTAINER_SIZE - CONTAINER_META_SIZE + 8,
-		SEEK_SET);
-
-	fread(buf, CONTAINER_META_SIZE, 1, fp);
-
-	pthread_mutex_unlock(mutex);
+		read_full(fd, buf, CONTAINER_META_SIZE,
+				(id + 1) * CONTAINER_SIZE - CONTAINER_META_SIZE + 8);
 
 	unser_declare;
 	unser_begin(buf, CONTAINER_META_SIZE);
@@ -429,9 +523,11 @@ struct containerMeta* retrieve_container_meta_by_id(containerid id) {
 		struct metaEntry* me = (struct metaEntry*) malloc(
 				sizeof(struct metaEntry));
 		memset(&me->fp, 0, sizeof(fingerprint));
+		int32_t len;
 		unser_bytes(&me->fp, READ_FP_META_SZ);
-		unser_bytes(&me->len, sizeof(int32_t));
+		unser_bytes(&len, sizeof(int32_t));
 		unser_bytes(&me->off, sizeof(int32_t));
+		unser_entry_len(me, len);
 		g_hash_table_insert(cm->map, &me->fp, me);
 	}
 
@@ -450,29 +546,80 @@ struct chunk* get_chunk_in_container(struct container* c, fingerprint *fp) {
 
 	struct chunk* ck = new_chunk(me->len);
 
-	if (destor.simulation_level < SIMULATION_RESTORE)
-		memcpy(ck->data, c->data + me->off, me->len);
-
 	ck->size = me->len;
 	ck->id = c->meta.id;
+	if (me->raw)
+		SET_CHUNK(ck, CHUNK_RAW);
+
+	if (destor.simulation_level < SIMULATION_RESTORE)
+		read_chunk_data(c, me, ck);
 	memcpy(&ck->fp, fp, sizeof(fingerprint));
 
 	return ck;
 }
 
-int container_overflow(struct container* c, int32_t size) {
+static int overflow(struct container* c, int32_t size, int32_t dict_num) {
 	assert(c->fp_size == 20 || c->fp_size == 32);
 	if (c->meta.data_size + size > CONTAINER_SIZE - CONTAINER_META_SIZE)
 		return 1;
 	/*
 	 * 28 is the size of metaEntry.
 	 * 16 is in struct metaEntry, see write_container
+	 * then the number of dictionaries and 12 bytes of each.
 	 */
-	if ((c->meta.chunk_num + 1) * (sizeof(struct metaEntry) - sizeof(fingerprint) + c->fp_size) + 16 > CONTAINER_META_SIZE)
+	if ((c->meta.chunk_num + 1) * (2 * sizeof(int32_t) + c->fp_size) + 16
+			+ sizeof(int32_t) + dict_num * 3 * sizeof(int32_t) > CONTAINER_META_SIZE)
 		return 1;
 	return 0;
 }
 
+int container_overflow(struct container* c, int32_t size) {
+	return overflow(c, size, c->dict_num);
+}
+
+static int find_dict(struct container* c, uint32_t id) {
+	int i;
+	for (i = 0; i < c->dict_num; i++)
+		if (c->dicts[i].id == id)
+			return i;
+	return -1;
+}
+
+/*
+ * Whether a chunk compressed with dict overflows the container,
+ * which has to store the dictionary too if it does not have it.
+ */
+int container_dict_overflow(struct container* c, int32_t size,
+		unsigned char *dict, int32_t dict_size) {
+	if (dict == NULL || find_dict(c, ZDICT_getDictID(dict, dict_size)) >= 0)
+		return container_overflow(c, size);
+	return overflow(c, size + dict_size, c->dict_num + 1);
+}
+
+/*
+ * Store a dictionary in the data area,
+ * return 0 if the container already has it.
+ */
+int add_dict_to_container(struct container* c, unsigned char *dict,
+		int32_t dict_size) {
+	uint32_t id = ZDICT_getDictID(dict, dict_size);
+	if (find_dict(c, id) >= 0)
+		return 0;
+	assert(!overflow(c, dict_size, c->dict_num + 1));
+
+	c->dicts = realloc(c->dicts, sizeof(struct containerDict) * (c->dict_num + 1));
+	struct containerDict *d = &c->dicts[c->dict_num++];
+	d->id = id;
+	d->off = c->meta.data_size;
+	d->len = dict_size;
+	d->ddict = NULL;
+
+	if (destor.simulation_level < SIMULATION_APPEND)
+		memcpy(c->data + c->meta.data_size, dict, dict_size);
+	c->meta.data_size += dict_size;
+	return 1;
+}
+
 /*
  * For backup.
  * return 1 indicates success.
@@ -490,6 +637,7 @@ int add_chunk_to_container(struct container* c, struct chunk* ck) {
 	memcpy(&me->fp, &ck->fp, sizeof(fingerprint));
 	me->len = ck->size;
 	me->off = c->meta.data_size;
+	me->raw = CHECK_CHUNK(ck, CHUNK_RAW) ? 1 : 0;
 
 	g_hash_table_insert(c->meta.map, &me->fp, me);
 	c->meta.chunk_num++;
@@ -511,6 +659,13 @@ void free_container_meta(struct containerMeta* cm) {
 
 void free_container(struct container* c) {
 	g_hash_table_destroy(c->meta.map);
+	int i;
+	for (i = 0; i < c->dict_num; i++)
+		if (c->dicts[i].ddict)
+			ZSTD_freeDDict(c->dicts[i].ddict);
+	free(c->dicts);
+	if (c->dctx)
+		ZSTD_freeDCtx(c->dctx);
 	if (c->data)
 		free(c->data);
 	if (c->chunks) {
@@ -593,9 +748,6 @@ GHashTable* retrieve_upgrade_index_container_by_id(int64_t id) {
 
 int64_t get_container_count() {
 	int64_t count = 0;
-	pthread_mutex_lock(&old_mutex);
-	fseek(old_fp, 0, SEEK_SET);
-	fread(&count, 8, 1, old_fp);
-	pthread_mutex_unlock(&old_mutex);
+	read_full(old_fd, &count, 8, 0);
 	return count;
 }
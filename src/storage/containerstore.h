@@ -23,6 +23,20 @@ struct containerMeta {
 
 	/* Map fingerprints to chunk offsets. */
 	GHashTable *map;
+
+	/* for a hashedCache keyed by id */
+	struct cacheNode node;
+};
+
+/*
+ * A ZSTD dictionary stored in the data area of a container.
+ * Chunks compressed with it are decompressed when read from the container.
+ */
+struct containerDict {
+	uint32_t id;
+	int32_t off;
+	int32_t len;
+	void *ddict; // ZSTD_DDict, only in a read container
 };
 
 struct container {
@@ -30,6 +44,9 @@ struct container {
 	unsigned char *data;
 	uint32_t fp_size;
 	struct chunk *chunks;
+	struct containerDict *dicts;
+	int32_t dict_num;
+	void *dctx; // ZSTD_DCtx decompressing with the dictionaries
 };
 
 void init_container_store();
@@ -48,6 +65,10 @@ struct containerMeta* retrieve_container_meta_by_id_async(containerid);
 struct chunk* get_chunk_in_container(struct container*, fingerprint*);
 int add_chunk_to_container(struct container*, struct chunk*);
 int container_overflow(struct container*, int32_t size);
+int container_dict_overflow(struct container*, int32_t size,
+		unsigned char *dict, int32_t dict_size);
+int add_dict_to_container(struct container*, unsigned char *dict,
+		int32_t dict_size);
 void free_container(struct container*);
 void free_container_meta(struct containerMeta*);
 containerid get_container_id(struct container* c);
@@ -88,3 +88,40 @@ void get_RocksDB(int index, char *key, size_t keySize, char **value, size_t *val
     }
     pthread_mutex_unlock(&dbLock[index]);
 }
+
+/*
+ * Look up n keys under one lock acquisition.
+ * values[i] is NULL if keys[i] is not found, otherwise it must be freed by the caller.
+ */
+void multiget_RocksDB(int index, int n, char **keys, size_t *keySizes, char **values, size_t *valueSizes) {
+    char **errs = malloc(n * sizeof(char *));
+    pthread_mutex_lock(&dbLock[index]);
+    rocksdb_multi_get(dbList[index], readoptions, n, (const char* const*)keys, keySizes, values, valueSizes, errs);
+    pthread_mutex_unlock(&dbLock[index]);
+    for (int i = 0; i < n; i++) {
+        if (errs[i]) {
+            fprintf(stderr, "rocksdb_multi_get error: %s\n", errs[i]);
+            assert(0);
+        }
+    }
+    free(errs);
+}
+
+/*
+ * Write n key-value pairs in one batch under one lock acquisition.
+ */
+void writebatch_RocksDB(int index, int n, char **keys, size_t *keySizes, char **values, size_t *valueSizes) {
+    rocksdb_writebatch_t *batch = rocksdb_writebatch_create();
+    for (int i = 0; i < n; i++) {
+        rocksdb_writebatch_put(batch, keys[i], keySizes[i], values[i], valueSizes[i]);
+    }
+    pthread_mutex_lock(&dbLock[index]);
+    char *err = NULL;
+    rocksdb_write(dbList[index], writeoptions, batch, &err);
+    if (err) {
+        fprintf(stderr, "rocksdb_write error: %s\n", err);
+        assert(0);
+    }
+    pthread_mutex_unlock(&dbLock[index]);
+    rocksdb_writebatch_destroy(batch);
+}
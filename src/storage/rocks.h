@@ -7,5 +7,7 @@ void init_RocksDB(int index);
 void close_RocksDB(int index);
 void put_RocksDB(int index, char *key, size_t keySize, char *value, size_t valueSize);
 void get_RocksDB(int index, char *key, size_t keySize, char **value, size_t *valueSize);
+void multiget_RocksDB(int index, int n, char **keys, size_t *keySizes, char **values, size_t *valueSizes);
+void writebatch_RocksDB(int index, int n, char **keys, size_t *keySizes, char **values, size_t *valueSizes);
 
 #endif /* ROCKS_H_ */
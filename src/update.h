@@ -11,6 +11,7 @@
 #include "utils/sync_queue.h"
 
 SyncQueue *upgrade_recipe_queue;
+SyncQueue *upgrade_prefetch_queue;
 SyncQueue *upgrade_chunk_queue;
 SyncQueue *pre_dedup_queue;
 
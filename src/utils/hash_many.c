@@ -0,0 +1,521 @@
+/*
+ * hash_many.c
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Boju Chen
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/sha.h>
+#include "hash_many.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HASH_MANY_X86 1
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+#define BLOCK_SIZE 64
+#define LANES 8
+
+static const uint32_t sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha1_iv[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t load_be32(const unsigned char *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+			| ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static inline void store_be32(unsigned char *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline uint32_t rotl32(uint32_t x, int n) {
+	return (x << n) | (x >> (32 - n));
+}
+
+static inline uint32_t rotr32(uint32_t x, int n) {
+	return (x >> n) | (x << (32 - n));
+}
+
+/*
+ * Scalar compression functions.
+ * They finish the lanes left over by the multi-buffer kernel,
+ * which may be in the middle of a message.
+ */
+static void sha256_block(uint32_t st[8], const unsigned char *blk) {
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+	for (i = 0; i < 16; i++)
+		w[i] = load_be32(blk + 4 * i);
+	for (; i < 64; i++) {
+		uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+	a = st[0]; b = st[1]; c = st[2]; d = st[3];
+	e = st[4]; f = st[5]; g = st[6]; h = st[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25))
+				+ ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22))
+				+ ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	st[0] += a; st[1] += b; st[2] += c; st[3] += d;
+	st[4] += e; st[5] += f; st[6] += g; st[7] += h;
+}
+
+static void sha1_block(uint32_t st[5], const unsigned char *blk) {
+	uint32_t w[80], a, b, c, d, e, t;
+	int i;
+	for (i = 0; i < 16; i++)
+		w[i] = load_be32(blk + 4 * i);
+	for (; i < 80; i++)
+		w[i] = rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	a = st[0]; b = st[1]; c = st[2]; d = st[3]; e = st[4];
+	for (i = 0; i < 80; i++) {
+		if (i < 20)
+			t = ((b & c) | (~b & d)) + 0x5a827999;
+		else if (i < 40)
+			t = (b ^ c ^ d) + 0x6ed9eba1;
+		else if (i < 60)
+			t = ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc;
+		else
+			t = (b ^ c ^ d) + 0xca62c1d6;
+		t += rotl32(a, 5) + e + w[i];
+		e = d; d = c; c = rotl32(b, 30); b = a; a = t;
+	}
+	st[0] += a; st[1] += b; st[2] += c; st[3] += d; st[4] += e;
+}
+
+static void hash_one(struct hashJob *job, int algo) {
+	if (algo == HASH_SHA1)
+		SHA1(job->data, job->len, job->digest);
+	else
+		SHA256(job->data, job->len, job->digest);
+}
+
+#ifdef HASH_MANY_X86
+
+/*
+ * A lane walks the full blocks of its buffer, then one or two
+ * padding blocks built in tail.
+ */
+struct lane {
+	struct hashJob *job;
+	const unsigned char *next;
+	int64_t full_blocks;
+	int tail_blocks;
+	int tail_off;
+	unsigned char tail[2 * BLOCK_SIZE];
+};
+
+static void lane_init(struct lane *l, struct hashJob *job) {
+	int64_t rem = job->len % BLOCK_SIZE;
+	uint64_t bits = (uint64_t) job->len << 3;
+
+	l->job = job;
+	l->next = job->data;
+	l->full_blocks = job->len / BLOCK_SIZE;
+	l->tail_blocks = rem + 9 <= BLOCK_SIZE ? 1 : 2;
+	l->tail_off = 0;
+
+	memset(l->tail, 0, sizeof(l->tail));
+	if (rem)
+		memcpy(l->tail, job->data + job->len - rem, rem);
+	l->tail[rem] = 0x80;
+	unsigned char *end = l->tail + l->tail_blocks * BLOCK_SIZE;
+	store_be32(end - 8, bits >> 32);
+	store_be32(end - 4, bits);
+}
+
+static const unsigned char* lane_next_block(struct lane *l) {
+	const unsigned char *blk;
+	if (l->full_blocks > 0) {
+		blk = l->next;
+		l->next += BLOCK_SIZE;
+		l->full_blocks--;
+	} else {
+		blk = l->tail + l->tail_off;
+		l->tail_off += BLOCK_SIZE;
+		l->tail_blocks--;
+	}
+	return blk;
+}
+
+static inline int lane_done(struct lane *l) {
+	return l->full_blocks == 0 && l->tail_blocks == 0;
+}
+
+/* Load word i (i < 16) of 8 blocks into 16 vectors, one block per lane. */
+__attribute__((target("avx2")))
+static inline void load_words_x8(__m256i w[16], const unsigned char *blk[LANES]) {
+	const __m256i bswap = _mm256_set_epi8(
+			12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+			12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	int half, j;
+	for (half = 0; half < 2; half++) {
+		__m256i r[LANES], t[LANES], u[LANES];
+		for (j = 0; j < LANES; j++)
+			r[j] = _mm256_shuffle_epi8(_mm256_loadu_si256(
+					(const __m256i *) (blk[j] + 32 * half)), bswap);
+
+		/* 8x8 transpose of 32-bit words */
+		for (j = 0; j < LANES; j += 2) {
+			t[j] = _mm256_unpacklo_epi32(r[j], r[j + 1]);
+			t[j + 1] = _mm256_unpackhi_epi32(r[j], r[j + 1]);
+		}
+		for (j = 0; j < LANES; j += 4) {
+			u[j] = _mm256_unpacklo_epi64(t[j], t[j + 2]);
+			u[j + 1] = _mm256_unpackhi_epi64(t[j], t[j + 2]);
+			u[j + 2] = _mm256_unpacklo_epi64(t[j + 1], t[j + 3]);
+			u[j + 3] = _mm256_unpackhi_epi64(t[j + 1], t[j + 3]);
+		}
+		for (j = 0; j < 4; j++) {
+			w[8 * half + j] = _mm256_permute2x128_si256(u[j], u[j + 4], 0x20);
+			w[8 * half + j + 4] = _mm256_permute2x128_si256(u[j], u[j + 4], 0x31);
+		}
+	}
+}
+
+#define ROTR8(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+#define ROTL8(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+#define ADD8(x, y) _mm256_add_epi32(x, y)
+#define XOR8(x, y) _mm256_xor_si256(x, y)
+#define AND8(x, y) _mm256_and_si256(x, y)
+#define OR8(x, y) _mm256_or_si256(x, y)
+#define ANDNOT8(x, y) _mm256_andnot_si256(x, y)
+
+/* st[i] holds state word i of all 8 lanes. */
+__attribute__((target("avx2")))
+static void sha256_block_x8(uint32_t st[8][LANES], const unsigned char *blk[LANES]) {
+	__m256i w[16], s[8], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	load_words_x8(w, blk);
+	for (i = 0; i < 8; i++)
+		s[i] = _mm256_loadu_si256((const __m256i *) st[i]);
+	a = s[0]; b = s[1]; c = s[2]; d = s[3];
+	e = s[4]; f = s[5]; g = s[6]; h = s[7];
+
+#pragma GCC unroll 64
+	for (i = 0; i < 64; i++) {
+		__m256i wi;
+		if (i < 16) {
+			wi = w[i];
+		} else {
+			__m256i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+			__m256i s0 = XOR8(XOR8(ROTR8(w15, 7), ROTR8(w15, 18)),
+					_mm256_srli_epi32(w15, 3));
+			__m256i s1 = XOR8(XOR8(ROTR8(w2, 17), ROTR8(w2, 19)),
+					_mm256_srli_epi32(w2, 10));
+			wi = ADD8(ADD8(w[i & 15], s0), ADD8(w[(i - 7) & 15], s1));
+			w[i & 15] = wi;
+		}
+		t1 = ADD8(h, XOR8(XOR8(ROTR8(e, 6), ROTR8(e, 11)), ROTR8(e, 25)));
+		t1 = ADD8(t1, XOR8(AND8(e, f), ANDNOT8(e, g)));
+		t1 = ADD8(t1, ADD8(_mm256_set1_epi32(sha256_k[i]), wi));
+		t2 = ADD8(XOR8(XOR8(ROTR8(a, 2), ROTR8(a, 13)), ROTR8(a, 22)),
+				XOR8(XOR8(AND8(a, b), AND8(a, c)), AND8(b, c)));
+		h = g; g = f; f = e; e = ADD8(d, t1);
+		d = c; c = b; b = a; a = ADD8(t1, t2);
+	}
+
+	s[0] = ADD8(s[0], a); s[1] = ADD8(s[1], b);
+	s[2] = ADD8(s[2], c); s[3] = ADD8(s[3], d);
+	s[4] = ADD8(s[4], e); s[5] = ADD8(s[5], f);
+	s[6] = ADD8(s[6], g); s[7] = ADD8(s[7], h);
+	for (i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i *) st[i], s[i]);
+}
+
+__attribute__((target("avx2")))
+static void sha1_block_x8(uint32_t st[8][LANES], const unsigned char *blk[LANES]) {
+	__m256i w[16], s[5], a, b, c, d, e, f, k, t;
+	int i;
+
+	load_words_x8(w, blk);
+	for (i = 0; i < 5; i++)
+		s[i] = _mm256_loadu_si256((const __m256i *) st[i]);
+	a = s[0]; b = s[1]; c = s[2]; d = s[3]; e = s[4];
+
+#pragma GCC unroll 80
+	for (i = 0; i < 80; i++) {
+		__m256i wi;
+		if (i < 16) {
+			wi = w[i];
+		} else {
+			wi = XOR8(XOR8(w[(i - 3) & 15], w[(i - 8) & 15]),
+					XOR8(w[(i - 14) & 15], w[i & 15]));
+			wi = ROTL8(wi, 1);
+			w[i & 15] = wi;
+		}
+		if (i < 20) {
+			f = OR8(AND8(b, c), ANDNOT8(b, d));
+			k = _mm256_set1_epi32(0x5a827999);
+		} else if (i < 40) {
+			f = XOR8(XOR8(b, c), d);
+			k = _mm256_set1_epi32(0x6ed9eba1);
+		} else if (i < 60) {
+			f = OR8(AND8(b, c), AND8(d, OR8(b, c)));
+			k = _mm256_set1_epi32(0x8f1bbcdc);
+		} else {
+			f = XOR8(XOR8(b, c), d);
+			k = _mm256_set1_epi32(0xca62c1d6);
+		}
+		t = ADD8(ADD8(ROTL8(a, 5), f), ADD8(ADD8(e, k), wi));
+		e = d; d = c; c = ROTL8(b, 30); b = a; a = t;
+	}
+
+	s[0] = ADD8(s[0], a); s[1] = ADD8(s[1], b); s[2] = ADD8(s[2], c);
+	s[3] = ADD8(s[3], d); s[4] = ADD8(s[4], e);
+	for (i = 0; i < 5; i++)
+		_mm256_storeu_si256((__m256i *) st[i], s[i]);
+}
+
+/*
+ * SHA-NI kernels, two lanes interleaved.
+ * A single message keeps the SHA units waiting on the latency of
+ * sha256rnds2/sha1rnds4; two independent messages fill the gaps.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_block_x2(uint32_t st[8][LANES], const unsigned char *blk[LANES]) {
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i abef[2], cdgh[2], abef_save[2], cdgh_save[2], w[2][4], msg, tmp;
+	int i, j;
+
+	for (j = 0; j < 2; j++) {
+		tmp = _mm_shuffle_epi32(_mm_set_epi32(st[3][j], st[2][j], st[1][j], st[0][j]), 0xB1);
+		cdgh[j] = _mm_shuffle_epi32(_mm_set_epi32(st[7][j], st[6][j], st[5][j], st[4][j]), 0x1B);
+		abef[j] = _mm_alignr_epi8(tmp, cdgh[j], 8);
+		cdgh[j] = _mm_blend_epi16(cdgh[j], tmp, 0xF0);
+		abef_save[j] = abef[j];
+		cdgh_save[j] = cdgh[j];
+	}
+
+#pragma GCC unroll 16
+	for (i = 0; i < 16; i++) {
+#pragma GCC unroll 2
+		for (j = 0; j < 2; j++) {
+			__m128i *x = w[j];
+			if (i < 4) {
+				x[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+						(const __m128i *) (blk[j] + 16 * i)), mask);
+			} else {
+				tmp = _mm_add_epi32(_mm_sha256msg1_epu32(x[i & 3], x[(i + 1) & 3]),
+						_mm_alignr_epi8(x[(i + 3) & 3], x[(i + 2) & 3], 4));
+				x[i & 3] = _mm_sha256msg2_epu32(tmp, x[(i + 3) & 3]);
+			}
+			msg = _mm_add_epi32(x[i & 3], _mm_loadu_si128((const __m128i *) &sha256_k[4 * i]));
+			cdgh[j] = _mm_sha256rnds2_epu32(cdgh[j], abef[j], msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			abef[j] = _mm_sha256rnds2_epu32(abef[j], cdgh[j], msg);
+		}
+	}
+
+	for (j = 0; j < 2; j++) {
+		uint32_t out[8];
+		abef[j] = _mm_add_epi32(abef[j], abef_save[j]);
+		cdgh[j] = _mm_add_epi32(cdgh[j], cdgh_save[j]);
+		tmp = _mm_shuffle_epi32(abef[j], 0x1B);
+		cdgh[j] = _mm_shuffle_epi32(cdgh[j], 0xB1);
+		_mm_storeu_si128((__m128i *) out, _mm_blend_epi16(tmp, cdgh[j], 0xF0));
+		_mm_storeu_si128((__m128i *) (out + 4), _mm_alignr_epi8(cdgh[j], tmp, 8));
+		for (i = 0; i < 8; i++)
+			st[i][j] = out[i];
+	}
+}
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_block_x2(uint32_t st[8][LANES], const unsigned char *blk[LANES]) {
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd[2], abcd_save[2], e0[2], e_save[2], prev[2], w[2][4], e;
+	int i, j;
+
+	for (j = 0; j < 2; j++) {
+		abcd[j] = _mm_set_epi32(st[0][j], st[1][j], st[2][j], st[3][j]);
+		e0[j] = _mm_set_epi32(st[4][j], 0, 0, 0);
+		abcd_save[j] = abcd[j];
+		e_save[j] = e0[j];
+	}
+
+#pragma GCC unroll 20
+	for (i = 0; i < 20; i++) {
+#pragma GCC unroll 2
+		for (j = 0; j < 2; j++) {
+			__m128i *x = w[j];
+			if (i < 4) {
+				x[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+						(const __m128i *) (blk[j] + 16 * i)), mask);
+			} else {
+				x[i & 3] = _mm_sha1msg2_epu32(_mm_xor_si128(
+						_mm_sha1msg1_epu32(x[i & 3], x[(i + 1) & 3]), x[(i + 2) & 3]),
+						x[(i + 3) & 3]);
+			}
+			e = i == 0 ? _mm_add_epi32(e0[j], x[0]) : _mm_sha1nexte_epu32(prev[j], x[i & 3]);
+			prev[j] = abcd[j];
+			switch (i / 5) {
+			case 0: abcd[j] = _mm_sha1rnds4_epu32(abcd[j], e, 0); break;
+			case 1: abcd[j] = _mm_sha1rnds4_epu32(abcd[j], e, 1); break;
+			case 2: abcd[j] = _mm_sha1rnds4_epu32(abcd[j], e, 2); break;
+			default: abcd[j] = _mm_sha1rnds4_epu32(abcd[j], e, 3); break;
+			}
+		}
+	}
+
+	for (j = 0; j < 2; j++) {
+		uint32_t out[4];
+		e = _mm_sha1nexte_epu32(prev[j], e_save[j]);
+		abcd[j] = _mm_shuffle_epi32(_mm_add_epi32(abcd[j], abcd_save[j]), 0x1B);
+		_mm_storeu_si128((__m128i *) out, abcd[j]);
+		for (i = 0; i < 4; i++)
+			st[i][j] = out[i];
+		st[4][j] = _mm_extract_epi32(e, 3);
+	}
+}
+
+typedef void (*block_fn)(uint32_t st[8][LANES], const unsigned char *blk[LANES]);
+
+/*
+ * Keep the lanes of a kernel busy: a lane takes the next job as soon as
+ * its buffer is consumed. Once the queue is drained and fewer than
+ * min_active lanes are still busy, the rest is finished by the scalar
+ * compression instead of feeding idle blocks to the kernel.
+ */
+static void hash_many_lanes(struct hashJob *jobs, int n, int algo,
+		block_fn kernel, int width, int min_active) {
+	static const unsigned char idle_block[BLOCK_SIZE];
+	int words = algo == HASH_SHA1 ? 5 : 8;
+	const uint32_t *iv = algo == HASH_SHA1 ? sha1_iv : sha256_iv;
+	uint32_t st[8][LANES] __attribute__((aligned(32)));
+	struct lane lanes[LANES];
+	const unsigned char *blk[LANES];
+	int active = 0, next = 0, i, j;
+
+	for (j = 0; j < width; j++) {
+		lanes[j].job = NULL;
+		if (next < n) {
+			lane_init(&lanes[j], &jobs[next++]);
+			for (i = 0; i < words; i++)
+				st[i][j] = iv[i];
+			active++;
+		}
+	}
+
+	while (active > 0 && (next < n || active >= min_active)) {
+		for (j = 0; j < width; j++)
+			blk[j] = lanes[j].job ? lane_next_block(&lanes[j]) : idle_block;
+
+		kernel(st, blk);
+
+		for (j = 0; j < width; j++) {
+			if (!lanes[j].job || !lane_done(&lanes[j]))
+				continue;
+			for (i = 0; i < words; i++)
+				store_be32(lanes[j].job->digest + 4 * i, st[i][j]);
+			lanes[j].job = NULL;
+			active--;
+			if (next < n) {
+				lane_init(&lanes[j], &jobs[next++]);
+				for (i = 0; i < words; i++)
+					st[i][j] = iv[i];
+				active++;
+			}
+		}
+	}
+
+	for (j = 0; j < width; j++) {
+		if (!lanes[j].job)
+			continue;
+		uint32_t s[8];
+		for (i = 0; i < words; i++)
+			s[i] = st[i][j];
+		while (!lane_done(&lanes[j])) {
+			if (algo == HASH_SHA1)
+				sha1_block(s, lane_next_block(&lanes[j]));
+			else
+				sha256_block(s, lane_next_block(&lanes[j]));
+		}
+		for (i = 0; i < words; i++)
+			store_be32(lanes[j].job->digest + 4 * i, s[i]);
+	}
+}
+
+#endif /* HASH_MANY_X86 */
+
+static int has_avx2, has_shani;
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+
+static void select_engine() {
+#ifdef HASH_MANY_X86
+	unsigned int eax, ebx, ecx, edx;
+	__builtin_cpu_init();
+	has_avx2 = __builtin_cpu_supports("avx2");
+	/* CPUID.(EAX=7,ECX=0):EBX[29] */
+	has_shani = __builtin_cpu_supports("sse4.1")
+			&& __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)
+			&& (ebx & (1 << 29));
+#endif
+}
+
+/*
+ * SHA-256 prefers the SHA-NI kernel, while SHA-1 is faster on 8 AVX2
+ * lanes than on 2 SHA-NI lanes.
+ */
+const char* hash_many_engine(int algo) {
+	pthread_once(&engine_once, select_engine);
+	if (algo == HASH_SHA1)
+		return has_avx2 ? "avx2-x8" : (has_shani ? "sha-ni-x2" : "scalar");
+	return has_shani ? "sha-ni-x2" : (has_avx2 ? "avx2-x8" : "scalar");
+}
+
+/*
+ * Hash n independent buffers with SHA-1 or SHA-256.
+ * A single buffer is not worth a multi-buffer pass.
+ */
+void hash_many(struct hashJob *jobs, int n, int algo) {
+	pthread_once(&engine_once, select_engine);
+
+#ifdef HASH_MANY_X86
+	if (n > 1) {
+		int shani = has_shani && (algo == HASH_SHA256 || !has_avx2);
+		if (shani) {
+			hash_many_lanes(jobs, n, algo,
+					algo == HASH_SHA1 ? sha1_block_x2 : sha256_block_x2, 2, 1);
+			return;
+		}
+		if (has_avx2) {
+			hash_many_lanes(jobs, n, algo,
+					algo == HASH_SHA1 ? sha1_block_x8 : sha256_block_x8, 8, 4);
+			return;
+		}
+	}
+#endif
+
+	for (int i = 0; i < n; i++)
+		hash_one(&jobs[i], algo);
+}
@@ -0,0 +1,31 @@
+/*
+ * hash_many.h
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Boju Chen
+ *
+ * Hash many independent buffers at once.
+ * On x86-64 the buffers are interleaved in a multi-buffer kernel,
+ * 2 lanes with SHA-NI or 8 lanes with AVX2, selected at runtime;
+ * otherwise each buffer is hashed by OpenSSL.
+ */
+
+#ifndef HASH_MANY_H_
+#define HASH_MANY_H_
+
+#include <stdint.h>
+
+#define HASH_SHA1 1
+#define HASH_SHA256 2
+
+struct hashJob {
+	const unsigned char *data;
+	int64_t len;
+	/* 20 bytes for SHA-1, 32 bytes for SHA-256 */
+	unsigned char *digest;
+};
+
+void hash_many(struct hashJob *jobs, int n, int algo);
+const char* hash_many_engine(int algo);
+
+#endif /* HASH_MANY_H_ */
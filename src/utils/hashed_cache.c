@@ -0,0 +1,226 @@
+/*
+ * hashed_cache.c
+ *
+ *  Created on: Oct 17, 2026
+ *      Author: Boju Chen
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include "hashed_cache.h"
+
+#define NODE_OF(c, elem) ((struct cacheNode *) ((char *) (elem) + (c)->node_offset))
+#define ELEM_OF(c, node) ((void *) ((char *) (node) - (c)->node_offset))
+
+#define QUEUE_MAIN 0
+#define QUEUE_IN 1
+
+static void list_push_head(struct cacheList *l, struct cacheNode *n) {
+	n->prev = NULL;
+	n->next = l->head;
+	if (l->head)
+		l->head->prev = n;
+	else
+		l->tail = n;
+	l->head = n;
+	l->size += n->size;
+}
+
+static void list_unlink(struct cacheList *l, struct cacheNode *n) {
+	if (n->prev)
+		n->prev->next = n->next;
+	else
+		l->head = n->next;
+	if (n->next)
+		n->next->prev = n->prev;
+	else
+		l->tail = n->prev;
+	n->prev = n->next = NULL;
+	l->size -= n->size;
+}
+
+static inline struct cacheList* list_of(struct hashedCache *c,
+		struct cacheNode *n) {
+	return n->queue == QUEUE_IN ? &c->in : &c->main;
+}
+
+struct hashedCache* new_hashed_cache(int policy, int64_t max_size,
+		size_t node_offset, GHashFunc hash, GEqualFunc equal,
+		void (*free_elem)(void *)) {
+	struct hashedCache *c = (struct hashedCache *) calloc(1,
+			sizeof(struct hashedCache));
+	c->policy = policy;
+	c->node_offset = node_offset;
+	c->map = g_hash_table_new(hash, equal);
+	c->max_size = max_size;
+	c->free_elem = free_elem;
+	return c;
+}
+
+static void free_list(struct hashedCache *c, struct cacheList *l) {
+	struct cacheNode *n = l->head;
+	while (n) {
+		struct cacheNode *next = n->next;
+		if (c->free_elem)
+			c->free_elem(ELEM_OF(c, n));
+		n = next;
+	}
+}
+
+void free_hashed_cache(struct hashedCache *c) {
+	free_list(c, &c->in);
+	free_list(c, &c->main);
+	g_hash_table_destroy(c->map);
+	free(c);
+}
+
+static void touch(struct hashedCache *c, struct cacheNode *n) {
+	switch (c->policy) {
+	case CACHE_POLICY_CLOCK:
+		n->referenced = 1;
+		break;
+	case CACHE_POLICY_2Q:
+		if (n->queue == QUEUE_IN) {
+			list_unlink(&c->in, n);
+			n->queue = QUEUE_MAIN;
+			list_push_head(&c->main, n);
+			break;
+		}
+		/* no break */
+	default:
+		if (c->main.head != n) {
+			list_unlink(&c->main, n);
+			list_push_head(&c->main, n);
+		}
+		break;
+	}
+}
+
+/* Find the element of key and count a hit or a miss. */
+void* hashed_cache_lookup(struct hashedCache *c, void *key) {
+	struct cacheNode *n = g_hash_table_lookup(c->map, key);
+	if (!n) {
+		c->miss_count++;
+		return NULL;
+	}
+	c->hit_count++;
+	touch(c, n);
+	return ELEM_OF(c, n);
+}
+
+/* Find the element of key without touching the eviction order. */
+void* hashed_cache_peek(struct hashedCache *c, void *key) {
+	struct cacheNode *n = g_hash_table_lookup(c->map, key);
+	return n ? ELEM_OF(c, n) : NULL;
+}
+
+static void detach(struct hashedCache *c, struct cacheNode *n) {
+	list_unlink(list_of(c, n), n);
+	g_hash_table_remove(c->map, n->key);
+	c->size -= n->size;
+	c->count--;
+}
+
+/* The next victim of the policy. */
+static struct cacheNode* victim(struct hashedCache *c) {
+	switch (c->policy) {
+	case CACHE_POLICY_CLOCK:
+		while (c->main.tail->referenced) {
+			struct cacheNode *n = c->main.tail;
+			n->referenced = 0;
+			list_unlink(&c->main, n);
+			list_push_head(&c->main, n);
+		}
+		return c->main.tail;
+	case CACHE_POLICY_2Q:
+		if (c->in.tail && (c->in.size * 4 > c->max_size || !c->main.tail))
+			return c->in.tail;
+		return c->main.tail ? c->main.tail : c->in.tail;
+	default:
+		return c->main.tail;
+	}
+}
+
+/*
+ * Insert an element, evicting others to make room.
+ * A cached element of the same key is replaced and freed.
+ */
+void hashed_cache_insert(struct hashedCache *c, void *elem, void *key,
+		int64_t size) {
+	struct cacheNode *old = g_hash_table_lookup(c->map, key);
+	if (old) {
+		detach(c, old);
+		if (c->free_elem)
+			c->free_elem(ELEM_OF(c, old));
+	}
+	while (c->max_size > 0 && c->count > 0 && c->size + size > c->max_size) {
+		struct cacheNode *v = victim(c);
+		detach(c, v);
+		c->evict_count++;
+		if (c->free_elem)
+			c->free_elem(ELEM_OF(c, v));
+	}
+
+	struct cacheNode *n = NODE_OF(c, elem);
+	n->key = key;
+	n->size = size;
+	n->referenced = 0;
+	if (c->policy == CACHE_POLICY_2Q) {
+		n->queue = QUEUE_IN;
+		list_push_head(&c->in, n);
+	} else {
+		n->queue = QUEUE_MAIN;
+		list_push_head(&c->main, n);
+	}
+	g_hash_table_insert(c->map, key, n);
+	c->size += size;
+	c->count++;
+}
+
+/* Take the element of key out of the cache without freeing it. */
+void* hashed_cache_remove(struct hashedCache *c, void *key) {
+	struct cacheNode *n = g_hash_table_lookup(c->map, key);
+	if (!n)
+		return NULL;
+	detach(c, n);
+	return ELEM_OF(c, n);
+}
+
+/*
+ * Evict and free the first element satisfying func,
+ * scanning from the coldest one.
+ */
+void hashed_cache_kicks(struct hashedCache *c, void *user_data,
+		int (*func)(void *elem, void *user_data)) {
+	struct cacheList *lists[2] = { &c->in, &c->main };
+	int i;
+	for (i = 0; i < 2; i++) {
+		struct cacheNode *n;
+		for (n = lists[i]->tail; n; n = n->prev) {
+			if (func(ELEM_OF(c, n), user_data)) {
+				detach(c, n);
+				c->evict_count++;
+				if (c->free_elem)
+					c->free_elem(ELEM_OF(c, n));
+				return;
+			}
+		}
+	}
+}
+
+int hashed_cache_is_full(struct hashedCache *c) {
+	if (c->max_size <= 0)
+		return 0;
+	return c->size >= c->max_size ? 1 : 0;
+}
+
+const char* hashed_cache_policy_name(int policy) {
+	switch (policy) {
+	case CACHE_POLICY_CLOCK:
+		return "clock";
+	case CACHE_POLICY_2Q:
+		return "2q";
+	default:
+		return "lru";
+	}
+}
@@ -0,0 +1,85 @@
+/*
+ * hashed_cache.h
+ *	Hash-indexed cache with intrusive nodes
+ *  Created on: Oct 17, 2026
+ *      Author: Boju Chen
+ *
+ * An element embeds a struct cacheNode and is found through a GHashTable
+ * on its key, so lookup, insert and evict are O(1) and the cache
+ * allocates nothing per element.
+ * The key must stay valid while the element is cached,
+ * usually it is a field of the element.
+ * The capacity is counted in the sizes given at insertion,
+ * bytes or simply 1 per element.
+ */
+
+#ifndef HASHED_CACHE_H_
+#define HASHED_CACHE_H_
+
+#include <glib.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define CACHE_POLICY_LRU 0
+/* Second chance: a hit only sets a bit, the eviction scan clears it. */
+#define CACHE_POLICY_CLOCK 1
+/*
+ * Two queues: new elements enter a FIFO, a hit there promotes them to an LRU.
+ * The FIFO is evicted first while it holds more than a quarter of the capacity,
+ * so a scan of elements used once does not flush the LRU.
+ * There is no ghost queue of evicted keys as in the full 2Q.
+ */
+#define CACHE_POLICY_2Q 2
+
+struct cacheNode {
+	struct cacheNode *prev;
+	struct cacheNode *next;
+	void *key;
+	int64_t size;
+	uint8_t referenced;
+	uint8_t queue;
+};
+
+struct cacheList {
+	/* head is the most recent */
+	struct cacheNode *head;
+	struct cacheNode *tail;
+	int64_t size;
+};
+
+struct hashedCache {
+	int policy;
+	/* the offset of the node in an element */
+	size_t node_offset;
+	GHashTable *map;
+
+	/* 2Q uses both, the others the main queue only */
+	struct cacheList in;
+	struct cacheList main;
+
+	int64_t max_size; // not positive means infinite cache
+	int64_t size;
+	int64_t count;
+
+	int64_t hit_count;
+	int64_t miss_count;
+	int64_t evict_count;
+
+	void (*free_elem)(void *);
+};
+
+struct hashedCache* new_hashed_cache(int policy, int64_t max_size,
+		size_t node_offset, GHashFunc hash, GEqualFunc equal,
+		void (*free_elem)(void *));
+void free_hashed_cache(struct hashedCache *c);
+void* hashed_cache_lookup(struct hashedCache *c, void *key);
+void* hashed_cache_peek(struct hashedCache *c, void *key);
+void hashed_cache_insert(struct hashedCache *c, void *elem, void *key,
+		int64_t size);
+void* hashed_cache_remove(struct hashedCache *c, void *key);
+void hashed_cache_kicks(struct hashedCache *c, void *user_data,
+		int (*func)(void *elem, void *user_data));
+int hashed_cache_is_full(struct hashedCache *c);
+const char* hashed_cache_policy_name(int policy);
+
+#endif /* HASHED_CACHE_H_ */
@@ -1,11 +1,21 @@
 #include "sync_queue.h"
 #include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+
+/*
+ * Waiters are woken only on the transitions they wait for:
+ * poppers when the queue stops being empty, or gets more items while
+ * a batch popper waits, and pushers when the queue stops being full.
+ */
 
 SyncQueue* sync_queue_new(int size) {
 	SyncQueue *s_queue = (SyncQueue*) malloc(sizeof(SyncQueue));
 	s_queue->queue = queue_new();
 	s_queue->max_size = size;
 	s_queue->term = 0;
+	s_queue->batch_waiters = 0;
 
 	if (pthread_mutex_init(&s_queue->mutex, 0)
 			|| pthread_cond_init(&s_queue->max_work, 0)
@@ -42,7 +52,8 @@ void sync_queue_push(SyncQueue* s_queue, void* item) {
 
 	queue_push(s_queue->queue, item);
 
-	pthread_cond_broadcast(&s_queue->min_work);
+	if (queue_size(s_queue->queue) == 1 || s_queue->batch_waiters > 0)
+		pthread_cond_broadcast(&s_queue->min_work);
 
 	if (pthread_mutex_unlock(&s_queue->mutex)) {
 		puts("failed to lock!");
@@ -67,13 +78,99 @@ void* sync_queue_pop(SyncQueue* s_queue) {
 		pthread_cond_wait(&s_queue->min_work, &s_queue->mutex);
 	}
 
+	if (s_queue->max_size > 0 && queue_size(s_queue->queue) == s_queue->max_size)
+		pthread_cond_broadcast(&s_queue->max_work);
 	void * item = queue_pop(s_queue->queue);
-	pthread_cond_broadcast(&s_queue->max_work);
 
 	pthread_mutex_unlock(&s_queue->mutex);
 	return item;
 }
 
+/*
+ * Push n items under one lock,
+ * waiting for room as the consumers free it.
+ */
+void sync_queue_push_n(SyncQueue* s_queue, void **items, int n) {
+	if (pthread_mutex_lock(&s_queue->mutex) != 0) {
+		puts("failed to lock!");
+		return;
+	}
+
+	int i = 0;
+	while (i < n && s_queue->term == 0) {
+		while (s_queue->max_size > 0
+				&& queue_size(s_queue->queue) >= s_queue->max_size) {
+			pthread_cond_wait(&s_queue->max_work, &s_queue->mutex);
+		}
+
+		int empty = queue_size(s_queue->queue) == 0;
+		for (; i < n && (s_queue->max_size <= 0
+				|| queue_size(s_queue->queue) < s_queue->max_size); i++)
+			queue_push(s_queue->queue, items[i]);
+
+		if (empty || s_queue->batch_waiters > 0)
+			pthread_cond_broadcast(&s_queue->min_work);
+	}
+
+	pthread_mutex_unlock(&s_queue->mutex);
+}
+
+/*
+ * Pop up to max_n items.
+ * Wait for min_n items, but no more than timeout_us once there is one,
+ * timeout_us < 0 waits without a limit.
+ * Return the number of items, 0 if the queue is terminated.
+ */
+int sync_queue_pop_n(SyncQueue* s_queue, void **items, int max_n, int min_n,
+		int timeout_us) {
+	if (pthread_mutex_lock(&s_queue->mutex) != 0) {
+		puts("failed to lock!");
+		return 0;
+	}
+
+	if (min_n > max_n)
+		min_n = max_n;
+	if (s_queue->max_size > 0 && min_n > s_queue->max_size)
+		min_n = s_queue->max_size;
+
+	while (queue_size(s_queue->queue) == 0) {
+		if (s_queue->term == 1) {
+			pthread_mutex_unlock(&s_queue->mutex);
+			return 0;
+		}
+		pthread_cond_wait(&s_queue->min_work, &s_queue->mutex);
+	}
+
+	if (queue_size(s_queue->queue) < min_n && s_queue->term == 0) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout_us / 1000000;
+		deadline.tv_nsec += (long) (timeout_us % 1000000) * 1000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		s_queue->batch_waiters++;
+		while (queue_size(s_queue->queue) < min_n && s_queue->term == 0) {
+			if (timeout_us < 0)
+				pthread_cond_wait(&s_queue->min_work, &s_queue->mutex);
+			else if (pthread_cond_timedwait(&s_queue->min_work,
+					&s_queue->mutex, &deadline) == ETIMEDOUT)
+				break;
+		}
+		s_queue->batch_waiters--;
+	}
+
+	if (s_queue->max_size > 0 && queue_size(s_queue->queue) == s_queue->max_size)
+		pthread_cond_broadcast(&s_queue->max_work);
+	int n = 0;
+	while (n < max_n && queue_size(s_queue->queue) > 0)
+		items[n++] = queue_pop(s_queue->queue);
+
+	pthread_mutex_unlock(&s_queue->mutex);
+	return n;
+}
+
 int sync_queue_size(SyncQueue* s_queue) {
 	return queue_size(s_queue->queue);
 }
@@ -134,3 +231,34 @@ void* sync_queue_get_top(SyncQueue* s_queue) {
 	pthread_mutex_unlock(&s_queue->mutex);
 	return item;
 }
+
+SyncQueueReader* sync_queue_reader_new(SyncQueue* s_queue, int batch) {
+	SyncQueueReader *r = (SyncQueueReader*) malloc(sizeof(SyncQueueReader));
+	r->queue = s_queue;
+	r->items = malloc(sizeof(void*) * batch);
+	r->max_num = batch;
+	r->num = 0;
+	r->cur = 0;
+	return r;
+}
+
+void sync_queue_reader_free(SyncQueueReader* r) {
+	assert(r->cur == r->num);
+	free(r->items);
+	free(r);
+}
+
+/*
+ * Return the next item, taking all the available ones, up to a batch,
+ * when the buffered ones are consumed.
+ * Return NULL if the queue is terminated.
+ */
+void* sync_queue_reader_pop(SyncQueueReader* r) {
+	if (r->cur == r->num) {
+		r->num = sync_queue_pop_n(r->queue, r->items, r->max_num, 1, -1);
+		r->cur = 0;
+		if (r->num == 0)
+			return NULL;
+	}
+	return r->items[r->cur++];
+}
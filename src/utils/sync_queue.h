@@ -12,16 +12,40 @@ typedef struct {
 	pthread_mutex_t mutex;
 	pthread_cond_t max_work;
 	pthread_cond_t min_work;
+	/* poppers waiting for more than one item */
+	int batch_waiters;
 } SyncQueue;
 
+/* The batch of a SyncQueueReader in the pipelines. */
+#define SYNC_QUEUE_READER_BATCH 32
+
+/*
+ * Pops a queue in batches for a single consumer,
+ * which takes the items one by one.
+ */
+typedef struct {
+	SyncQueue *queue;
+	void **items;
+	int max_num;
+	int num;
+	int cur;
+} SyncQueueReader;
+
 SyncQueue* sync_queue_new(int);
 void sync_queue_free(SyncQueue*, void (*)(void*));
 void sync_queue_push(SyncQueue*, void*);
 void* sync_queue_pop(SyncQueue*);
+void sync_queue_push_n(SyncQueue*, void **items, int n);
+int sync_queue_pop_n(SyncQueue*, void **items, int max_n, int min_n,
+		int timeout_us);
 void sync_queue_term(SyncQueue*);
 int sync_queue_size(SyncQueue* s_queue);
 void* sync_queue_find(SyncQueue* s_queue, int (*hit)(void*, void*), void* data,
 		void* (*dup)(void*));
 void* sync_queue_get_top(SyncQueue* s_queue);
 
+SyncQueueReader* sync_queue_reader_new(SyncQueue*, int batch);
+void sync_queue_reader_free(SyncQueueReader*);
+void* sync_queue_reader_pop(SyncQueueReader*);
+
 #endif